@@ -119,11 +119,21 @@ struct PyExternalRef {
 
 #define CATCH() catch(std::exception& e) { if(!PyErr_Occurred()) { PyErr_SetString(PyExc_RuntimeError, e.what()); } }
 
-#if 1
-#define TRACE(ARG) do{ std::cerr<<"TRACE "<<__FUNCTION__<<" "<<ARG<<"\n";} while(0)
-#else
-#define TRACE(ARG) do{ } while(0)
-#endif
+// Trace categories, enabled at runtime with _p4p.setTrace() or $P4P_TRACE
+enum TraceCategory {
+    TraceServer   = 1<<0, // Server run/stop
+    TraceSearch   = 1<<1, // channelFind
+    TraceChannel  = 1<<2, // channel, get and monitor creation
+    TraceRPC      = 1<<3, // RPC requests and replies
+    TraceProvider = 1<<4, // provider (un)registration
+};
+
+extern volatile unsigned p4p_trace_mask;
+// append to the ring of the calling thread
+void p4p_trace_record(unsigned category, const char *func, const std::string& msg);
+
+// The message is only formatted when the category is enabled
+#define TRACE(CAT, ARG) do{ if(p4p_trace_mask & Trace##CAT) { p4p_trace_record(Trace##CAT, __FUNCTION__, SB()<<ARG); } } while(0)
 
 #if PY_MAJOR_VERSION >= 3
 # define MODINIT_RET(VAL) return (VAL)
@@ -141,8 +151,11 @@ void p4p_type_register(PyObject *mod);
 void p4p_value_register(PyObject *mod);
 void p4p_server_register(PyObject *mod);
 void p4p_array_register(PyObject *mod);
+void p4p_trace_register(PyObject *mod);
 
 extern struct PyMethodDef P4P_methods[];
+PyObject* p4p_trace_set(PyObject *junk, PyObject *args, PyObject *kwds);
+PyObject* p4p_trace_dump(PyObject *junk, PyObject *args, PyObject *kwds);
 void p4p_server_provider_register(PyObject *mod);
 
 extern PyTypeObject* P4PType_type;
@@ -9,6 +9,7 @@ except ImportError:
     from queue import Queue, Full, Empty
 
 from .wrapper import Value, Type
+from ._p4p import RPCQueue
 
 def rpc(rtype=None):
     wrap = None
@@ -63,6 +64,21 @@ class WorkQueue(object):
             finally:
                 self._Q.task_done()
 
+class NativeQueue(RPCQueue):
+    """RPC calls wait in C++, without holding the GIL, until a thread calling handle() serves them.
+
+    Pass to both the dispatcher and installProvider(..., queue=Q).
+    Calls are served round robin by channel.  When maxsize calls are waiting,
+    or perChannel calls (0 for no limit) of one channel, new ones are rejected
+    with "Too many concurrent RPC calls".
+    stats() returns queue depth and wait time (seconds) statistics.
+    """
+    def __init__(self, maxsize=100, perChannel=0):
+        RPCQueue.__init__(self, maxsize=maxsize, perChannel=perChannel)
+    def push(self, callable):
+        # rpc() is already called on a thread running handle()
+        callable()
+
 class RPCDispatcherBase(object):
     # wrapper to use for request Structures
     Value = Value
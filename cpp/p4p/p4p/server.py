@@ -8,7 +8,59 @@ from ._p4p import (Server as _Server,
                    installProvider,
                    removeProvider,
                    clearProviders,
+                   invalidateChannels,
+                   findChannel,
+                   maskValue,
+                   RPCQueue,
+                   SharedPV as _SharedPV,
+                   setTrace,
+                   dumpTrace,
+                   TraceServer,
+                   TraceSearch,
+                   TraceChannel,
+                   TraceRPC,
+                   TraceProvider,
                    )
+from .wrapper import Value
+
+# installProvider(name, provider, cacheTTL=10.0, negativeTTL=2.0, queue=None)
+#   Results of provider.testChannel(name) are cached for cacheTTL seconds (claimed)
+#   or negativeTTL seconds (not claimed), 0 disables.
+#   A provider whose channels change calls invalidateChannels(name[, channel]).
+#   findChannel(name, channel) searches a provider as a client would, eg. to test it.
+#   With queue=RPCQueue (see p4p.rpc.NativeQueue) RPC calls are queued without the GIL
+#   and provider.rpc() is called by the threads running queue.handle().
+#   A channel whose provider.makeChannel() returns a SharedPV also supports Get and Monitor.
+#   RPC replies, Get and Monitor only carry the fields selected by the client pvRequest, eg. "field(value.channelName)".
+#   maskValue(value, request, changed) shows the Value and changed fields a Monitor of that request would get.
+#
+# setTrace(TraceSearch|TraceRPC) records server activity into per-thread rings in memory,
+#   $P4P_TRACE sets the initial mask.  dumpTrace() returns the recent records.
+
+class SharedPV(_SharedPV):
+    """The latest value of a channel, pushed to monitors as post() is called.
+
+    >>> pv = SharedPV()
+    >>> pv.post(Value(NTScalar.buildType('i'), {'value': 1}))
+    >>> pv.post(V, changed=['value']) # only V.value differs from the last post()
+
+    Get and Monitor are served in C++, without the GIL.
+    Each monitor queues up to queueSize updates, when full the newest is overwritten.
+    The type of the value is fixed by the first post() until close().
+    """
+    Value = Value
+
+class StaticProvider(object):
+    """Serve a set of SharedPV by channel name
+
+    >>> installProvider("status", StaticProvider({'pv:name': pv}))
+    """
+    def __init__(self, pvs=None):
+        self.pvs = dict(pvs or {})
+    def testChannel(self, name):
+        return name in self.pvs
+    def makeChannel(self, name, src):
+        return self.pvs.get(name)
 
 class Server(object):
     def __init__(self, *args, **kws):
@@ -30,3 +82,9 @@ class Server(object):
             _log.debug("Joining server thread")
             self._T.join()
             _log.debug("Joined server thread")
+
+def logTrace(log=_log, clear=True):
+    "Log the recorded trace, eg. from a signal handler"
+    import time
+    for T, thread, cat, func, msg in dumpTrace(clear=clear):
+        log.info("%s.%06d %s %s %s", time.strftime('%H:%M:%S', time.localtime(T)), int(T%1*1e6), thread, func, msg)
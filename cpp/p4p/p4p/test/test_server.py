@@ -0,0 +1,209 @@
+from __future__ import print_function
+
+import unittest
+import time
+import threading
+
+from ..server import (installProvider, removeProvider, invalidateChannels, findChannel, maskValue, SharedPV, StaticProvider,
+                      setTrace, dumpTrace, TraceProvider)
+from ..wrapper import Type, Value
+from ..rpc import NativeQueue
+
+class Dummy(object):
+    def __init__(self):
+        self.tested = []
+    def testChannel(self, name):
+        self.tested.append(name)
+        return name=='foo'
+    def makeChannel(self, name, src):
+        return None
+
+class TestProviderCache(unittest.TestCase):
+    def setUp(self):
+        self.provider = Dummy()
+        installProvider("testcache", self.provider, cacheTTL=0.5, negativeTTL=0.0)
+
+    def tearDown(self):
+        removeProvider("testcache")
+
+    def testCached(self):
+        self.assertTrue(findChannel("testcache", "foo"))
+        self.assertTrue(findChannel("testcache", "foo"))
+        self.assertEqual(self.provider.tested, ['foo'])
+
+        # not claimed, negativeTTL=0 disables caching
+        self.assertFalse(findChannel("testcache", "bar"))
+        self.assertFalse(findChannel("testcache", "bar"))
+        self.assertEqual(self.provider.tested, ['foo', 'bar', 'bar'])
+
+    def testExpire(self):
+        self.assertTrue(findChannel("testcache", "foo"))
+        time.sleep(0.6)
+        self.assertTrue(findChannel("testcache", "foo"))
+        self.assertEqual(self.provider.tested, ['foo', 'foo'])
+
+    def testInvalidate(self):
+        self.assertTrue(findChannel("testcache", "foo"))
+        invalidateChannels("testcache", "foo")
+        self.assertTrue(findChannel("testcache", "foo"))
+        self.assertEqual(self.provider.tested, ['foo', 'foo'])
+
+        invalidateChannels("testcache")
+        self.assertTrue(findChannel("testcache", "foo"))
+        invalidateChannels(name="testcache", channel=None)
+        self.assertTrue(findChannel("testcache", "foo"))
+        self.assertEqual(self.provider.tested, ['foo']*4)
+
+        # other channels stay cached
+        invalidateChannels("testcache", "other")
+        self.assertTrue(findChannel("testcache", "foo"))
+        self.assertEqual(self.provider.tested, ['foo']*4)
+
+    def testUnknown(self):
+        self.assertRaises(KeyError, invalidateChannels, "nosuchprovider")
+        self.assertRaises(KeyError, findChannel, "nosuchprovider", "foo")
+
+class TestRPCQueue(unittest.TestCase):
+    def testStats(self):
+        Q = NativeQueue(maxsize=3)
+        S = Q.stats()
+        self.assertEqual(S['maxsize'], 3)
+        self.assertEqual(S['depth'], 0)
+        self.assertEqual(S['rejected'], 0)
+
+    def testInterrupt(self):
+        Q = NativeQueue()
+        Q.interrupt()
+        Q.handle() # returns immediately
+
+    def testPush(self):
+        Q = NativeQueue()
+        L = []
+        Q.push(lambda:L.append(1))
+        self.assertEqual(L, [1])
+
+    def testInstall(self):
+        Q = NativeQueue()
+        installProvider("testqueue", object(), queue=Q)
+        removeProvider("testqueue")
+        self.assertRaises(TypeError, installProvider, "testqueue", object(), queue=5)
+
+class TestSharedPV(unittest.TestCase):
+    T = Type([('value', 'i'), ('extra', 's')])
+
+    def testPost(self):
+        pv = SharedPV(queueSize=2)
+        self.assertIsNone(pv.current())
+        self.assertEqual(pv.subscribers(), 0)
+
+        pv.post(Value(self.T, {'value': 1, 'extra': 'x'}))
+        V = pv.current()
+        self.assertIsInstance(V, Value)
+        self.assertEqual(V.value, 1)
+        self.assertEqual(V.extra, u'x')
+
+        # only the listed fields are taken
+        pv.post(Value(self.T, {'value': 2, 'extra': 'y'}), changed=['value'])
+        V = pv.current()
+        self.assertEqual(V.value, 2)
+        self.assertEqual(V.extra, u'x')
+
+        self.assertRaises(KeyError, pv.post, V, changed=['nosuch'])
+        self.assertRaises(RuntimeError, pv.post, Value(Type([('other', 'd')]), {}))
+
+        pv.close()
+        self.assertIsNone(pv.current())
+        pv.post(Value(Type([('other', 'd')]), {'other': 1.5}))
+        self.assertEqual(pv.current().other, 1.5)
+
+    def testProvider(self):
+        pv = SharedPV()
+        P = StaticProvider({'foo': pv})
+        self.assertTrue(P.testChannel('foo'))
+        self.assertFalse(P.testChannel('bar'))
+        self.assertIs(P.makeChannel('foo', 'src'), pv)
+        installProvider("testshared", P)
+        removeProvider("testshared")
+
+class TestFieldMask(unittest.TestCase):
+    # an NTMultiChannel as the value of a reply
+    T = Type([
+        ('value', ('s', 'epics:nt/NTMultiChannel:1.0', [
+            ('channelName', 'as'),
+            ('severity', 'ai'),
+            ('isConnected', 'a?'),
+        ])),
+        ('descriptor', 's'),
+    ])
+
+    def setUp(self):
+        self.V = Value(self.T, {
+            'value': {'channelName': ['a', 'b'], 'severity': [0, 2], 'isConnected': [True, False]},
+            'descriptor': 'x',
+        })
+
+    def testSelect(self):
+        R, changed = maskValue(self.V, 'field(value.channelName,value.severity)')
+        self.assertListEqual([name for name, _ in R.tolist()], ['value'])
+        self.assertListEqual([name for name, _ in R.tolist('value')], ['channelName', 'severity'])
+        self.assertListEqual(list(R.value.channelName), [u'a', u'b'])
+        self.assertListEqual(list(R.value.severity), [0, 2])
+        self.assertIsNone(changed) # everything
+
+        R, changed = maskValue(self.V, 'field(value.channelName,value.severity)', changed=['value.severity'])
+        self.assertListEqual(changed, ['value.severity'])
+
+    def testMissing(self):
+        # nothing requested exists, so everything is sent
+        R, changed = maskValue(self.V, 'field(nosuch)', changed=['descriptor'])
+        self.assertListEqual([name for name, _ in R.tolist()], ['value', 'descriptor'])
+        self.assertListEqual(changed, ['descriptor'])
+
+    def testParent(self):
+        # a changed structure marks the selected fields within it
+        R, changed = maskValue(self.V, 'field(value.channelName,value.severity)', changed=['value'])
+        self.assertListEqual(changed, ['value.channelName', 'value.severity'])
+
+    def testUnselected(self):
+        # a monitor queues nothing for a post() of fields it did not ask for
+        R, changed = maskValue(self.V, 'field(value.channelName,value.severity)',
+                               changed=['value.isConnected', 'descriptor'])
+        self.assertListEqual(changed, [])
+
+        self.assertRaises(KeyError, maskValue, self.V, 'field(value)', changed=['nosuch'])
+
+class TestTrace(unittest.TestCase):
+    def tearDown(self):
+        setTrace(0)
+
+    def testRecord(self):
+        setTrace(0)
+        dumpTrace(clear=True)
+        installProvider("testtrace", Dummy())
+        removeProvider("testtrace")
+        self.assertEqual(dumpTrace(), []) # disabled
+
+        self.assertEqual(setTrace(TraceProvider), 0)
+        installProvider("testtrace", Dummy())
+        removeProvider("testtrace")
+        R = dumpTrace(clear=True)
+        self.assertTrue(len(R)>=2)
+        T, thread, cat, func, msg = R[-1]
+        self.assertEqual(cat, TraceProvider)
+        self.assertIn("testtrace", msg)
+        self.assertEqual(dumpTrace(), [])
+
+    def testThreads(self):
+        # more threads than rings, one after the other, reuse the rings of those exited
+        setTrace(TraceProvider)
+        dumpTrace(clear=True)
+        def run(i):
+            installProvider("testring%d"%i, Dummy())
+            removeProvider("testring%d"%i)
+        for i in range(100):
+            T = threading.Thread(target=run, args=(i,))
+            T.start()
+            T.join()
+        R = dumpTrace(clear=True)
+        self.assertTrue(any("testring99" in msg for T, thread, cat, func, msg in R))
+        self.assertFalse(any(cat==0 for T, thread, cat, func, msg in R)) # nothing dropped
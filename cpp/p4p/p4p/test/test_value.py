@@ -83,6 +83,74 @@ class TestRawValue(unittest.TestCase):
         assert_aequal(V.dval, np.asfarray([1.1, 2.2]))
         self.assertListEqual(V.sval, [u'a', u'b'])
 
+    def testArrayReference(self):
+        T = _Type([('dval', 'ad')])
+
+        # read-only arrays are stored by reference
+        A = np.arange(4, dtype='d')
+        A.flags.writeable = False
+        V = _Value(T, {'dval': A})
+        del A
+        gc.collect()
+        assert_aequal(V.dval, np.asfarray([0, 1, 2, 3]))
+
+        # so are arrays fetched from another Value
+        V2 = _Value(T, {'dval': V.dval})
+        del V
+        gc.collect()
+        assert_aequal(V2.dval, np.asfarray([0, 1, 2, 3]))
+
+        # writable arrays are copied
+        A = np.arange(4, dtype='d')
+        V = _Value(T, {'dval': A})
+        A[0] = 42
+        assert_aequal(V.dval, np.asfarray([0, 1, 2, 3]))
+
+    def testStructArray(self):
+        T = _Type([
+            ('tbl', ('as', 'row_t', [
+                ('a', 'i'),
+                ('b', 'd'),
+            ])),
+            ('named', ('as', 'named_t', [
+                ('name', 's'),
+                ('b', 'd'),
+            ])),
+        ])
+
+        # flat structures of numbers map to a numpy structured array
+        V = _Value(T, {
+            'tbl': [{'a':1, 'b':1.5}, {'a':2}],
+        })
+        R = V.tbl
+        self.assertEqual(R.dtype.names, ('a', 'b'))
+        assert_aequal(R['a'], np.asarray([1, 2]))
+        assert_aequal(R['b'], np.asfarray([1.5, 0]))
+
+        R = np.zeros(3, dtype=[('b', 'f4'), ('a', 'i8'), ('c', 'i4')])
+        R['a'] = [4, 5, 6]
+        R['b'] = [0.5, 1.5, 2.5]
+        V.tbl = R
+        assert_aequal(V.tbl['a'], np.asarray([4, 5, 6]))
+        assert_aequal(V.tbl['b'], np.asfarray([0.5, 1.5, 2.5]))
+
+        self.assertListEqual(V.tolist('tbl'), [
+            [('a', 4), ('b', 0.5)],
+            [('a', 5), ('b', 1.5)],
+            [('a', 6), ('b', 2.5)],
+        ])
+
+        # others are a list of Value
+        V.named = [{'name':'x', 'b':1.0}, None]
+        L = V.named
+        self.assertEqual(len(L), 2)
+        self.assertEqual(L[0].name, u'x')
+        self.assertEqual(L[0].b, 1.0)
+        self.assertIsNone(L[1])
+
+        V.named = L[:1]
+        self.assertEqual(V.named[0].name, u'x')
+
     def testSubStruct(self):
         V = _Value(_Type([
             ('ival', 'i'),
@@ -116,6 +184,8 @@ class TestRawValue(unittest.TestCase):
         self.assertEqual(V['str'].a, 1)
         self.assertEqual(V['str']['a'], 1)
         self.assertEqual(V['str.a'], 1)
+        self.assertEqual(V[u'str.b'], 2)
+        self.assertEqual(V.str['b'], 2)
 
     def testVariantUnion(self):
         V = _Value(_Type([
@@ -142,6 +212,31 @@ class TestRawValue(unittest.TestCase):
         V.x = np.asfarray([1, 2])
         assert_aequal(V.x, np.asfarray([1,2]))
 
+        # lists and dicts are guessed as arrays and structures
+        V.x = [1, 2, 3]
+        assert_aequal(V.x, np.asarray([1,2,3]))
+
+        V.x = [1, 2.5]
+        assert_aequal(V.x, np.asfarray([1,2.5]))
+
+        V.x = ['a', 'b']
+        self.assertListEqual(V.x, [u'a', u'b'])
+
+        V.x = {'a':1, 'b':{'c':[1.5]}}
+        self.assertEqual(V.x.a, 1)
+        assert_aequal(V.x.b.c, np.asfarray([1.5]))
+
+        # same shape with keys in another order
+        V.x = {'b':{'c':[2.5]}, 'a':2}
+        self.assertEqual(V.x.a, 2)
+        assert_aequal(V.x.b.c, np.asfarray([2.5]))
+
+        # no common element type
+        self.assertRaises(RuntimeError, setattr, V, 'x', [1, 'a', None])
+        # numpy would make strings of these
+        self.assertRaises(RuntimeError, setattr, V, 'x', [1, 'a'])
+        self.assertRaises(RuntimeError, setattr, V, 'x', ['a', 2.5])
+
         #TODO: PVD bugs prevent this from working
         #V.x = None
         #self.assertIsNone(V.x)
@@ -31,7 +31,7 @@ int P4PServer_init(PyObject *self, PyObject *args, PyObject *kwds)
     TRY {
         if(provs) {
             SELF.providers = provs;
-            TRACE("Providers: "<<SELF.providers);
+            TRACE(Server, "Providers: "<<SELF.providers);
         }
 
         pva::ConfigurationBuilder B;
@@ -71,7 +71,7 @@ PyObject* P4PServer_run(PyObject *self, PyObject *args, PyObject *kwds)
         return NULL;
 
     TRY {
-        TRACE("ENTER");
+        TRACE(Server, "ENTER");
         if(SELF.server) {
             return PyErr_Format(PyExc_RuntimeError, "Already running");
         }
@@ -85,22 +85,22 @@ PyObject* P4PServer_run(PyObject *self, PyObject *args, PyObject *kwds)
 
         SELF.server = S;
 
-        TRACE("UNLOCK");
+        TRACE(Server, "UNLOCK");
         {
             PyUnlock U; // release GIL
 
             S->run(0); // 0 == run forever (unless ->shutdown())
         }
-        TRACE("RELOCK");
+        TRACE(Server, "RELOCK");
 
         SELF.server.reset();
 
         S->destroy();
 
-        TRACE("EXIT");
+        TRACE(Server, "EXIT");
         Py_RETURN_NONE;
     }CATCH()
-    TRACE("ERROR");
+    TRACE(Server, "ERROR");
     return NULL;
 }
 
@@ -112,10 +112,10 @@ PyObject* P4PServer_stop(PyObject *self, PyObject *args, PyObject *kwds)
 
     TRY {
         if(SELF.server) {
-            TRACE("SHUTDOWN");
+            TRACE(Server, "SHUTDOWN");
             SELF.server->shutdown();
         } else
-            TRACE("SKIP");
+            TRACE(Server, "SKIP");
         Py_RETURN_NONE;
     }CATCH()
     return NULL;
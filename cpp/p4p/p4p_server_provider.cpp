@@ -1,6 +1,16 @@
 
 #include <stddef.h>
 
+#include <map>
+#include <deque>
+#include <vector>
+
+#include <epicsTime.h>
+
+#include <pv/lock.h>
+#include <pv/event.h>
+#include <pv/convert.h>
+#include <pv/createRequest.h>
 #include <pv/serverContext.h>
 
 #include "p4p.h"
@@ -11,6 +21,380 @@ namespace pvd = epics::pvData;
 namespace pva = epics::pvAccess;
 
 struct PyServerChannel;
+struct PyServerRPC;
+struct PyServerMonitor;
+
+// RPC requests waiting for a python worker thread.
+// Filled by the network threads without the GIL,
+// and served round robin by channel so that one busy channel can't starve the others.
+// lock is never held while taking the GIL.
+struct RPCQueue
+{
+    POINTER_DEFINITIONS(RPCQueue);
+
+    struct Work {
+        std::tr1::shared_ptr<PyServerRPC> rpc;
+        pvd::PVStructure::shared_pointer arg;
+        epicsTimeStamp queued;
+    };
+    typedef std::deque<Work> fifo_t;
+    typedef std::map<const void*, fifo_t> pending_t;
+
+    pvd::Mutex lock;
+    pvd::Event wakeup;
+    pending_t pending;
+    std::deque<const void*> order; // channels with pending work, next to serve first
+    size_t count, limit, perChannel;
+    size_t interrupts;
+
+    // statistics
+    size_t peak;
+    unsigned long long queued, rejected, served;
+    double waitTotal, waitMax;
+
+    RPCQueue()
+        :count(0), limit(100), perChannel(0), interrupts(0)
+        ,peak(0), queued(0), rejected(0), served(0), waitTotal(0.0), waitMax(0.0)
+    {}
+
+    // returns false if the queue, or the share of this channel, is full
+    bool push(const void* channel, const std::tr1::shared_ptr<PyServerRPC>& rpc,
+              const pvd::PVStructure::shared_pointer& arg)
+    {
+        {
+            pvd::Lock L(lock);
+            fifo_t& F = pending[channel];
+            if(count>=limit || (perChannel && F.size()>=perChannel)) {
+                if(F.empty())
+                    pending.erase(channel);
+                rejected++;
+                return false;
+            }
+            if(F.empty())
+                order.push_back(channel);
+            F.push_back(Work());
+            Work& W = F.back();
+            W.rpc = rpc;
+            W.arg = arg;
+            epicsTimeGetCurrent(&W.queued);
+            count++;
+            queued++;
+            peak = std::max(peak, count);
+        }
+        wakeup.signal();
+        return true;
+    }
+
+    enum popped_t {Popped, Timeout, Interrupted};
+
+    // wait up to timeout seconds for work.  Call without the GIL.
+    popped_t pop(Work& W, double timeout)
+    {
+        bool waited = false, interrupted = false, more;
+        while(true) {
+            {
+                pvd::Lock L(lock);
+                if(interrupts) {
+                    interrupts--;
+                    interrupted = true;
+                    more = interrupts || count;
+                    break;
+                }
+                if(count) {
+                    const void* channel = order.front();
+                    order.pop_front();
+                    fifo_t& F = pending[channel];
+                    W = F.front();
+                    F.pop_front();
+                    if(F.empty())
+                        pending.erase(channel);
+                    else
+                        order.push_back(channel); // back of the line
+                    count--;
+
+                    epicsTimeStamp now;
+                    epicsTimeGetCurrent(&now);
+                    double wait = epicsTimeDiffInSeconds(&now, &W.queued);
+                    served++;
+                    waitTotal += wait;
+                    waitMax = std::max(waitMax, wait);
+                    more = count>0;
+                    break;
+                }
+                if(waited)
+                    return Timeout;
+            }
+            wakeup.wait(timeout);
+            waited = true;
+        }
+        // more to do, wake another worker
+        if(more)
+            wakeup.signal();
+        return interrupted ? Interrupted : Popped;
+    }
+
+    void interrupt()
+    {
+        {
+            pvd::Lock L(lock);
+            interrupts++;
+        }
+        wakeup.signal();
+    }
+};
+
+struct RPCQueueHolder {
+    RPCQueue::shared_pointer queue;
+    RPCQueueHolder() :queue(new RPCQueue) {}
+};
+
+typedef PyClassWrapper<RPCQueueHolder> P4PRPCQueue;
+
+// The fields a client asked for with pvRequest "field(...)".
+struct FieldRequest
+{
+    pvd::PVStructurePtr fields; // NULL selects everything
+    std::string key; // canonical form of fields
+
+    FieldRequest() {}
+    explicit FieldRequest(const pvd::PVStructurePtr& pvRequest)
+    {
+        pvd::PVStructurePtr F;
+        if(pvRequest)
+            F = pvRequest->getSubField<pvd::PVStructure>("field");
+        if(F && hasChildren(F.get())) {
+            fields = F;
+            key = canonical(F.get());
+        }
+    }
+
+    bool all() const { return !fields; }
+
+    // sub-fields named in a request.  Entries without are selected with all their sub-fields.
+    static bool hasChildren(const pvd::PVStructure *req)
+    {
+        const pvd::PVFieldPtrArray& flds(req->getPVFields());
+        for(size_t i=0; i<flds.size(); i++) {
+            if(flds[i]->getField()->getType()==pvd::structure && flds[i]->getFieldName()!="_options")
+                return true;
+        }
+        return false;
+    }
+
+    static std::string canonical(const pvd::PVStructure *req)
+    {
+        std::string ret;
+        const pvd::PVFieldPtrArray& flds(req->getPVFields());
+        for(size_t i=0; i<flds.size(); i++) {
+            if(flds[i]->getField()->getType()!=pvd::structure || flds[i]->getFieldName()=="_options")
+                continue;
+            if(!ret.empty())
+                ret += ',';
+            ret += flds[i]->getFieldName();
+            const pvd::PVStructure *sub = static_cast<const pvd::PVStructure*>(flds[i].get());
+            if(hasChildren(sub))
+                ret += "("+canonical(sub)+")";
+        }
+        return ret;
+    }
+};
+
+// Maps a Structure to the part of it selected by a FieldRequest.
+// Cached per (Structure, request) pair, and usable from any thread.
+struct FieldMask
+{
+    POINTER_DEFINITIONS(FieldMask);
+
+    // a field copied with all of its sub-fields
+    struct Leaf {
+        size_t src, srcEnd, dst; // field offsets
+    };
+
+    pvd::StructureConstPtr full; // keeps the cache key alive
+    pvd::StructureConstPtr reduced; // NULL when everything is selected
+    std::vector<Leaf> leaves;
+
+    pvd::StructureConstPtr type() const { return reduced ? reduced : full; }
+
+    static const_shared_pointer get(const pvd::StructureConstPtr& full, const FieldRequest& req);
+
+    // number of field offsets used by F and its sub-fields
+    static size_t width(const pvd::Field *F)
+    {
+        size_t ret = 1;
+        if(F->getType()==pvd::structure) {
+            const pvd::FieldConstPtrArray& flds(static_cast<const pvd::Structure*>(F)->getFields());
+            for(size_t i=0; i<flds.size(); i++)
+                ret += width(flds[i].get());
+        }
+        return ret;
+    }
+
+    // Select the requested members of S, whose offset is src.
+    // Returns NULL if none exist.  dst offsets of leaves are relative to the returned Structure.
+    static pvd::StructureConstPtr select(const pvd::Structure *S, const pvd::PVStructure *req,
+                                         size_t src, std::vector<Leaf>& leaves)
+    {
+        const pvd::StringArray& names(S->getFieldNames());
+        const pvd::FieldConstPtrArray& flds(S->getFields());
+
+        pvd::StringArray selnames;
+        pvd::FieldConstPtrArray selflds;
+        size_t next = src+1, dst = 1;
+
+        for(size_t i=0; i<names.size(); i++) {
+            size_t cur = next;
+            next += width(flds[i].get());
+
+            pvd::PVStructurePtr sub(req->getSubField<pvd::PVStructure>(names[i]));
+            if(!sub)
+                continue;
+
+            if(flds[i]->getType()==pvd::structure && FieldRequest::hasChildren(sub.get())) {
+                std::vector<Leaf> subleaves;
+                pvd::StructureConstPtr part(select(static_cast<const pvd::Structure*>(flds[i].get()),
+                                                   sub.get(), cur, subleaves));
+                if(!part)
+                    continue;
+                for(size_t j=0; j<subleaves.size(); j++) {
+                    subleaves[j].dst += dst;
+                    leaves.push_back(subleaves[j]);
+                }
+                selnames.push_back(names[i]);
+                selflds.push_back(part);
+                dst += width(part.get());
+
+            } else {
+                Leaf L;
+                L.src = cur;
+                L.srcEnd = next;
+                L.dst = dst;
+                leaves.push_back(L);
+                selnames.push_back(names[i]);
+                selflds.push_back(flds[i]);
+                dst += width(flds[i].get());
+            }
+        }
+
+        if(selnames.empty())
+            return pvd::StructureConstPtr();
+        return pvd::getFieldCreate()->createStructure(S->getID(), selnames, selflds);
+    }
+
+    // new structure of type() with the selected fields of src.  Arrays are shared.
+    pvd::PVStructurePtr copy(const pvd::PVStructure& src) const
+    {
+        pvd::PVStructurePtr ret(pvd::getPVDataCreate()->createPVStructure(type()));
+        copy(src, *ret);
+        return ret;
+    }
+
+    void copy(const pvd::PVStructure& src, pvd::PVStructure& dst) const
+    {
+        if(!reduced) {
+            dst.copyUnchecked(src);
+            return;
+        }
+        pvd::ConvertPtr convert(pvd::getConvert());
+        for(size_t i=0; i<leaves.size(); i++)
+            convert->copy(src.getSubField(leaves[i].src), dst.getSubField(leaves[i].dst));
+    }
+
+    // translate changed field offsets of src into those of type()
+    void mapBits(const pvd::PVStructure& src, const pvd::BitSet& in, pvd::BitSet& out) const
+    {
+        if(!reduced || in.get(0)) {
+            out = in;
+            return;
+        }
+        out.clear();
+        for(pvd::int32 k = in.nextSetBit(0); k>=0; k = in.nextSetBit(k+1)) {
+            size_t end = 0;
+            for(size_t i=0; i<leaves.size(); i++) {
+                const Leaf& L = leaves[i];
+                if((size_t)k>=L.src && (size_t)k<L.srcEnd) {
+                    out.set(L.dst + (k-L.src));
+                } else if((size_t)k<L.src) {
+                    // is k a structure containing this leaf?
+                    if(!end)
+                        end = src.getSubField(k)->getNextFieldOffset();
+                    if(L.src<end)
+                        out.set(L.dst);
+                }
+            }
+        }
+    }
+};
+
+FieldMask::const_shared_pointer FieldMask::get(const pvd::StructureConstPtr& full, const FieldRequest& req)
+{
+    typedef std::map<std::pair<const pvd::Structure*, std::string>, FieldMask::const_shared_pointer> cache_t;
+    static pvd::Mutex cacheLock;
+    static cache_t cache;
+
+    std::pair<const pvd::Structure*, std::string> key(full.get(), req.key);
+    {
+        pvd::Lock L(cacheLock);
+        cache_t::const_iterator it(cache.find(key));
+        if(it!=cache.end())
+            return it->second;
+    }
+
+    FieldMask::shared_pointer ret(new FieldMask);
+    ret->full = full;
+    if(!req.all()) {
+        ret->reduced = select(full.get(), req.fields.get(), 0, ret->leaves);
+        // when nothing requested exists, send everything
+        if(!ret->reduced)
+            ret->leaves.clear();
+    }
+
+    pvd::Lock L(cacheLock);
+    if(cache.size()>=1024)
+        cache.clear();
+    cache[key] = ret;
+    return ret;
+}
+
+// The latest value of a channel, served to Get and Monitor without the GIL.
+// post() updates the value, then copies the change into the queue of each subscriber.
+// Lock order is SharedPV::lock then PyServerMonitor::lock.
+// Neither is held while calling a requester.
+// The GIL is never taken with either held: python callers release it before locking,
+// and replaced values, whose numpy arrays need the GIL to be freed, are released after unlocking.
+struct SharedPV
+{
+    POINTER_DEFINITIONS(SharedPV);
+
+    typedef std::map<PyServerMonitor*, std::tr1::weak_ptr<PyServerMonitor> > monitors_t;
+
+    pvd::Mutex lock;
+    pvd::PVStructurePtr current; // NULL until the first post()
+    monitors_t monitors;
+    size_t queueSize; // of each subscriber
+
+    SharedPV() :queueSize(4) {}
+
+    pvd::StructureConstPtr type();
+    // a copy of the current value, NULL if there is none.  Arrays are shared.
+    pvd::PVStructurePtr get();
+    // value is not modified afterwards.  Bit 0 of changed means all fields.
+    void post(const pvd::PVStructurePtr& value, const pvd::BitSet& changed);
+    // disconnect subscribers and forget the value, which may then change type
+    void close();
+
+    void subscribe(const std::tr1::shared_ptr<PyServerMonitor>& mon);
+    void unsubscribe(PyServerMonitor* mon);
+    // send current fields to a subscriber which missed an update
+    void resend(const std::tr1::shared_ptr<PyServerMonitor>& mon, const pvd::BitSet& changed);
+};
+
+struct SharedPVHolder {
+    SharedPV::shared_pointer pv;
+    SharedPVHolder() :pv(new SharedPV) {}
+};
+
+typedef PyClassWrapper<SharedPVHolder> P4PSharedPV;
 
 struct PyServerProvider :
         public pva::ChannelProviderFactory,
@@ -20,10 +404,78 @@ struct PyServerProvider :
 {
     POINTER_DEFINITIONS(PyServerProvider);
 
+    PyServerProvider() :positiveTTL(10.0), negativeTTL(2.0), cacheLimit(10000) {}
     virtual ~PyServerProvider() {}
 
     PyExternalRef provider;
     std::string provider_name;
+    // when set, RPC calls wait here for a worker thread
+    RPCQueue::shared_pointer queue;
+
+    // Results of testChannel(), so that repeated searches for a name
+    // are answered without taking the GIL.
+    // cacheLock is never held while calling into python.
+    struct Found {
+        bool claim;
+        epicsTimeStamp expires;
+    };
+    typedef std::map<std::string, Found> found_t;
+    pvd::Mutex cacheLock;
+    found_t found;
+    double positiveTTL, negativeTTL; // seconds, 0 disables
+    size_t cacheLimit;
+
+    // returns true, and sets claim, if name was tested recently
+    bool cached(const std::string& name, bool& claim)
+    {
+        epicsTimeStamp now;
+        epicsTimeGetCurrent(&now);
+        pvd::Lock L(cacheLock);
+        found_t::iterator it = found.find(name);
+        if(it==found.end())
+            return false;
+        if(epicsTimeGreaterThan(&now, &it->second.expires)) {
+            found.erase(it);
+            return false;
+        }
+        claim = it->second.claim;
+        return true;
+    }
+
+    void remember(const std::string& name, bool claim)
+    {
+        double ttl = claim ? positiveTTL : negativeTTL;
+        if(ttl<=0.0)
+            return;
+        epicsTimeStamp now;
+        epicsTimeGetCurrent(&now);
+        pvd::Lock L(cacheLock);
+        if(found.size()>=cacheLimit) {
+            // drop expired entries, or everything if a search storm filled the cache
+            for(found_t::iterator it = found.begin(); it!=found.end(); ) {
+                if(epicsTimeGreaterThan(&now, &it->second.expires))
+                    found.erase(it++);
+                else
+                    ++it;
+            }
+            if(found.size()>=cacheLimit)
+                found.clear();
+        }
+        Found& F = found[name];
+        F.claim = claim;
+        F.expires = now;
+        epicsTimeAddSeconds(&F.expires, ttl);
+    }
+
+    // forget one name, or all when name is empty
+    void invalidate(const std::string& name)
+    {
+        pvd::Lock L(cacheLock);
+        if(name.empty())
+            found.clear();
+        else
+            found.erase(name);
+    }
 
     virtual std::string getFactoryName() { return provider_name; }
     virtual ChannelProvider::shared_pointer sharedInstance() {
@@ -42,26 +494,37 @@ struct PyServerProvider :
     virtual pva::ChannelFind::shared_pointer channelFind(std::string const & channelName,
             pva::ChannelFindRequester::shared_pointer const & channelFindRequester)
     {
-        TRACE("ENTER "<<channelName);
+        TRACE(Search, "ENTER "<<channelName);
         pva::ChannelFind::shared_pointer ret;
         try {
-            // TODO: cache results for a short time to reduce calls
+            bool claim = false;
+            if(cached(channelName, claim)) {
+                if(claim)
+                    ret = shared_from_this();
+                channelFindRequester->channelFindResult(pvd::Status::Ok,
+                                                        ret, claim);
+                TRACE(Search, "CACHED "<<(ret ? "Claim" : "Ignore"));
+                return ret;
+            }
 
             PyLock G;
 
             PyRef grab(PyObject_CallMethod(provider.ref.get(), "testChannel", "s", channelName.c_str()), allownull());
             if(!grab.get()) {
+                // errors are not cached
                 PyErr_Print();
                 PyErr_Clear();
                 channelFindRequester->channelFindResult(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Logic Error"),
                                                         ret, false);
 
             } else if(PyObject_IsTrue(grab.get())) {
+                remember(channelName, true);
                 ret = shared_from_this();
                 channelFindRequester->channelFindResult(pvd::Status::Ok,
                                                         ret, true);
 
             } else {
+                remember(channelName, false);
                 channelFindRequester->channelFindResult(pvd::Status::Ok,
                                                         ret, false);
             }
@@ -69,7 +532,7 @@ struct PyServerProvider :
             channelFindRequester->channelFindResult(pvd::Status(pvd::Status::STATUSTYPE_ERROR, e.what()),
                                                     ret, false);
         }
-        TRACE("EXIT "<<(ret ? "Claim" : "Ignore"));
+        TRACE(Search, "EXIT "<<(ret ? "Claim" : "Ignore"));
         return ret;
     }
 
@@ -105,14 +568,18 @@ struct PyServerChannel :
     pva::ChannelRequester::shared_pointer requester;
     const std::string name;
     PyExternalRef handler;
+    // set when handler is a SharedPV, which then serves Get and Monitor
+    SharedPV::shared_pointer pv;
 
     PyServerChannel(const PyServerProvider::shared_pointer& provider,
                     const pva::ChannelRequester::shared_pointer& req,
                     const std::string& name,
-                    PyRef& py)
+                    PyRef& py,
+                    const SharedPV::shared_pointer& pv)
         :provider(provider)
         ,requester(req)
         ,name(name)
+        ,pv(pv)
     {
         handler.swap(py);
     }
@@ -128,8 +595,14 @@ struct PyServerChannel :
 
     virtual void getField(pva::GetFieldRequester::shared_pointer const & requester,std::string const & subField)
     {
-        requester->getDone(pvd::Status(pvd::Status::STATUSTYPE_FATAL, "Not implemented"),
-                           pvd::FieldConstPtr());
+        pvd::StructureConstPtr type;
+        if(pv)
+            type = pv->type();
+        if(type)
+            requester->getDone(pvd::Status::Ok, type);
+        else
+            requester->getDone(pvd::Status(pvd::Status::STATUSTYPE_FATAL, "Not implemented"),
+                               pvd::FieldConstPtr());
     }
 
     virtual pva::AccessRights getAccessRights(epics::pvData::PVField::shared_pointer const & pvField)
@@ -140,6 +613,14 @@ struct PyServerChannel :
     virtual pva::ChannelRPC::shared_pointer createChannelRPC(
             pva::ChannelRPCRequester::shared_pointer const & channelRPCRequester,
             pvd::PVStructure::shared_pointer const & pvRequest);
+
+    virtual pva::ChannelGet::shared_pointer createChannelGet(
+            pva::ChannelGetRequester::shared_pointer const & channelGetRequester,
+            pvd::PVStructure::shared_pointer const & pvRequest);
+
+    virtual pvd::Monitor::shared_pointer createMonitor(
+            pvd::MonitorRequester::shared_pointer const & monitorRequester,
+            pvd::PVStructure::shared_pointer const & pvRequest);
 };
 
 struct PyServerRPC : public pva::ChannelRPC,
@@ -157,10 +638,13 @@ struct PyServerRPC : public pva::ChannelRPC,
 
     PyServerChannel::weak_pointer chan;
     pva::ChannelRPCRequester::weak_pointer requester;
+    const FieldRequest request;
     bool inprog;
 
     PyServerRPC(const PyServerChannel::shared_pointer& c,
-                const pva::ChannelRPCRequester::shared_pointer& r) :chan(c), requester(r), inprog(false) {}
+                const pva::ChannelRPCRequester::shared_pointer& r,
+                const FieldRequest& request)
+        :chan(c), requester(r), request(request), inprog(false) {}
     virtual ~PyServerRPC() {}
 
     virtual void lock() {}
@@ -174,13 +658,35 @@ struct PyServerRPC : public pva::ChannelRPC,
 
     virtual void request(pvd::PVStructure::shared_pointer const & pvArgument)
     {
-        TRACE("ENTER");
+        TRACE(RPC, "ENTER");
         PyServerChannel::shared_pointer C(chan.lock());
         pva::ChannelRPCRequester::shared_pointer R(requester.lock());
         if(!C || !R) return;
 
-        bool createdReply = false;
+        RPCQueue::shared_pointer Q(C->provider->queue);
+        if(Q) {
+            // leave the network thread without touching python
+            if(!Q->push(C.get(), shared_from_this(), pvArgument)) {
+                TRACE(RPC, "QUEUE FULL");
+                R->requestDone(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Too many concurrent RPC calls"),
+                               shared_from_this(),
+                               pvd::PVStructurePtr());
+            }
+            return;
+        }
+
         PyLock G;
+        call(pvArgument);
+    }
+
+    // hand a request to the python handler.  Call with the GIL held.
+    void call(pvd::PVStructure::shared_pointer const & pvArgument)
+    {
+        PyServerChannel::shared_pointer C(chan.lock());
+        pva::ChannelRPCRequester::shared_pointer R(requester.lock());
+        if(!C || !R) return;
+
+        bool createdReply = false;
         try {
 
             PyRef wrapper(PyObject_GetAttrString(C->handler.ref.get(), "Value"));
@@ -199,31 +705,47 @@ struct PyServerRPC : public pva::ChannelRPC,
 
             PyRef junk(PyObject_CallMethod(C->handler.ref.get(), "rpc", "OO", rep.get(), req.get()));
 
-            TRACE("SUCCESS");
+            TRACE(RPC, "SUCCESS");
         } catch(std::exception& e) {
             if(PyErr_Occurred()) {
                 PyErr_Print();
                 PyErr_Clear();
             }
-            if(!createdReply)
-                R->requestDone(pvd::Status(pvd::Status::STATUSTYPE_ERROR, e.what()),
-                               shared_from_this(),
-                               pvd::PVStructurePtr());
-            TRACE("ERROR "<<(createdReply ? "DELEGATE" : "SENT"));
+            if(!createdReply) {
+                pvd::Status sts(pvd::Status::STATUSTYPE_ERROR, e.what());
+                PyUnlock U;
+                R->requestDone(sts, shared_from_this(), pvd::PVStructurePtr());
+            }
+            TRACE(RPC, "ERROR "<<(createdReply ? "DELEGATE" : "SENT"));
         }
     }
 
+    // Send the final reply without the GIL.  Uses no python API.
+    static void send(const PyServerRPC::shared_pointer& rpc,
+                     const pva::ChannelRPCRequester::shared_pointer& R,
+                     const pvd::Status& sts,
+                     const pvd::PVStructure::shared_pointer& value)
+    {
+        PyUnlock U;
+        R->requestDone(sts, rpc, value);
+    }
+
     static void reply_dealloc(PyObject *raw) {
+        // send() releases the GIL.  Meanwhile neither the collector nor a weakref
+        // may reach this object, whose refcount is already 0.
+        PyObject_GC_UnTrack(raw);
+        if(((Reply*)raw)->weak)
+            PyObject_ClearWeakRefs(raw);
         try {
-            TRACE("ENTER");
+            TRACE(RPC, "ENTER");
             Reply::reference_type SELF = Reply::unwrap(raw);
-            if(!SELF.sent) {
-                TRACE("SEND ERROR");
-                pva::ChannelRPCRequester::shared_pointer R(SELF.rpc->requester.lock());
+            if(!SELF.sent && SELF.rpc) {
+                TRACE(RPC, "SEND ERROR");
+                SELF.sent = true;
+                PyServerRPC::shared_pointer rpc(SELF.rpc);
+                pva::ChannelRPCRequester::shared_pointer R(rpc->requester.lock());
                 if(R)
-                    R->requestDone(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "No Reply"),
-                                   SELF.rpc,
-                                   pvd::PVStructurePtr());
+                    send(rpc, R, pvd::Status(pvd::Status::STATUSTYPE_ERROR, "No Reply"), pvd::PVStructurePtr());
             }
         } catch(std::exception& e) {
             std::cerr<<"Error in RPC reply dtor "<<e.what()<<"\n";
@@ -241,10 +763,12 @@ struct PyServerRPC : public pva::ChannelRPC,
                                         &error))
             return NULL;
 
-        TRACE("ENTER");
+        TRACE(RPC, "ENTER");
         Reply::reference_type SELF = Reply::unwrap(self);
         try {
-            pva::ChannelRPCRequester::shared_pointer R(SELF.rpc->requester.lock());
+            // a reference, as self may be used by other threads once the GIL is released
+            PyServerRPC::shared_pointer rpc(SELF.rpc);
+            pva::ChannelRPCRequester::shared_pointer R(rpc->requester.lock());
 
             if(!R) {
                 // requester is gone (server lost connection)
@@ -260,37 +784,374 @@ struct PyServerRPC : public pva::ChannelRPC,
 
                 if(PyObject_TypeCheck(data, P4PValue_type)) {
                     value = P4PValue_unwrap(data);
+                    if(!SELF.rpc->request.all()) {
+                        // only send what the client asked for
+                        FieldMask::const_shared_pointer mask(FieldMask::get(value->getStructure(), SELF.rpc->request));
+                        if(mask->reduced)
+                            value = mask->copy(*value);
+                    }
                 } else {
                     return PyErr_Format(PyExc_ValueError, "RPC results must be Value");
                 }
 
-                R->requestDone(pvd::Status::Ok,
-                               SELF.rpc,
-                               value);
+                // mark before the GIL is released, so a second done() fails
                 SELF.sent = true;
+                // serializing a large reply takes time, let other python threads run
+                send(rpc, R, pvd::Status::Ok, value);
             } else if(error) {
-                R->requestDone(pvd::Status(pvd::Status::STATUSTYPE_ERROR, error),
-                                       SELF.rpc,
-                                       pvd::PVStructurePtr());
                 SELF.sent = true;
+                send(rpc, R, pvd::Status(pvd::Status::STATUSTYPE_ERROR, error), pvd::PVStructurePtr());
             } else {
                 return PyErr_Format(PyExc_ValueError, "done() needs reply= or error=");
             }
 
-            TRACE("SUCCESS");
+            TRACE(RPC, "SUCCESS");
             Py_RETURN_NONE;
         }CATCH()
-        TRACE("ERROR");
+        TRACE(RPC, "ERROR");
         return NULL;
     }
 };
 
+struct PyServerGet : public pva::ChannelGet,
+                     public std::tr1::enable_shared_from_this<PyServerGet>
+{
+    POINTER_DEFINITIONS(PyServerGet);
+
+    PyServerChannel::weak_pointer chan;
+    pva::ChannelGetRequester::weak_pointer requester;
+    SharedPV::shared_pointer pv;
+    const FieldRequest request;
+
+    PyServerGet(const PyServerChannel::shared_pointer& c,
+                const pva::ChannelGetRequester::shared_pointer& r,
+                const FieldRequest& request)
+        :chan(c), requester(r), pv(c->pv), request(request) {}
+    virtual ~PyServerGet() {}
+
+    virtual void lock() {}
+    virtual void unlock() {}
+    virtual void destroy() {}
+
+    virtual pva::Channel::shared_pointer getChannel() { return pva::Channel::shared_pointer(chan); }
+
+    virtual void cancel() {}
+    virtual void lastRequest() {}
+
+    virtual void get()
+    {
+        pva::ChannelGetRequester::shared_pointer R(requester.lock());
+        if(!R) return;
+
+        pvd::PVStructurePtr value(pv->get());
+        if(!value) {
+            R->getDone(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "No value"),
+                       shared_from_this(), pvd::PVStructurePtr(), pvd::BitSetPtr());
+            return;
+        }
+
+        if(!request.all()) {
+            FieldMask::const_shared_pointer mask(FieldMask::get(value->getStructure(), request));
+            if(mask->reduced)
+                value = mask->copy(*value);
+        }
+
+        pvd::BitSetPtr changed(new pvd::BitSet(value->getNumberFields()));
+        changed->set(0);
+        R->getDone(pvd::Status::Ok, shared_from_this(), value, changed);
+    }
+};
+
+// One subscriber of a SharedPV, with a queue of queueSize updates.
+// When the queue is full the newest update is overwritten, and the fields changed twice are marked as overrun.
+struct PyServerMonitor : public pvd::Monitor,
+                         public std::tr1::enable_shared_from_this<PyServerMonitor>
+{
+    POINTER_DEFINITIONS(PyServerMonitor);
+
+    typedef std::deque<pvd::MonitorElementPtr> elements_t;
+
+    SharedPV::shared_pointer pv;
+    pvd::MonitorRequester::weak_pointer requester;
+    const FieldRequest request;
+
+    pvd::Mutex lock;
+    bool running;
+    size_t queueSize;
+    pvd::StructureConstPtr type; // of the posted values
+    FieldMask::const_shared_pointer mask; // from type to the elements
+    elements_t empty, filled;
+    // changes lost while the requester held every element
+    pvd::BitSet missed;
+
+    PyServerMonitor(const SharedPV::shared_pointer& pv,
+                    const pvd::MonitorRequester::shared_pointer& r,
+                    const FieldRequest& request,
+                    size_t queueSize)
+        :pv(pv), requester(r), request(request), running(false), queueSize(std::max(queueSize, (size_t)2)) {}
+    virtual ~PyServerMonitor() {}
+
+    // Keep what an element holds before it is overwritten or dropped.  Arrays are shared, not copied.
+    static void keep(const pvd::MonitorElementPtr& E, std::vector<pvd::PVStructurePtr>& old)
+    {
+        pvd::PVStructurePtr V(pvd::getPVDataCreate()->createPVStructure(E->pvStructurePtr->getStructure()));
+        V->copyUnchecked(*E->pvStructurePtr);
+        old.push_back(V);
+    }
+
+    // Copy an update.  Returns true if the requester needs a monitorEvent().
+    // Called by SharedPV with its lock held.  The values replaced are added to old,
+    // for the caller to release once unlocked.
+    bool push(const pvd::PVStructurePtr& value, const pvd::BitSet& changed, std::vector<pvd::PVStructurePtr>& old)
+    {
+        pvd::Lock L(lock);
+        if(!running)
+            return false;
+
+        if(type!=value->getStructure()) {
+            type = value->getStructure();
+            mask = FieldMask::get(type, request);
+            for(elements_t::const_iterator it = empty.begin(); it!=empty.end(); ++it)
+                old.push_back((*it)->pvStructurePtr);
+            for(elements_t::const_iterator it = filled.begin(); it!=filled.end(); ++it)
+                old.push_back((*it)->pvStructurePtr);
+            empty.clear();
+            filled.clear();
+            missed.clear();
+            pvd::PVDataCreatePtr create(pvd::getPVDataCreate());
+            for(size_t i=0; i<queueSize; i++)
+                empty.push_back(pvd::MonitorElementPtr(new pvd::MonitorElement(create->createPVStructure(mask->type()))));
+        }
+
+        if(!empty.empty() || !filled.empty()) {
+            pvd::BitSet selected;
+            mask->mapBits(*value, changed, selected);
+            if(selected.isEmpty())
+                return false; // nothing this subscriber asked for
+
+            if(!empty.empty()) {
+                pvd::MonitorElementPtr E(empty.front());
+                empty.pop_front();
+                keep(E, old);
+                mask->copy(*value, *E->pvStructurePtr);
+                *E->changedBitSet = selected;
+                E->overrunBitSet->clear();
+                filled.push_back(E);
+                return filled.size()==1;
+
+            } else {
+                // squash into the newest update
+                pvd::MonitorElementPtr& E = filled.back();
+                keep(E, old);
+                mask->copy(*value, *E->pvStructurePtr);
+                pvd::BitSet twice(selected);
+                twice &= *E->changedBitSet;
+                *E->overrunBitSet |= twice;
+                *E->changedBitSet |= selected;
+                return false;
+            }
+
+        } else {
+            missed |= changed;
+            return false;
+        }
+    }
+
+    void notify()
+    {
+        pvd::MonitorRequester::shared_pointer R(requester.lock());
+        if(R)
+            R->monitorEvent(shared_from_this());
+    }
+
+    // SharedPV::close() disconnects subscribers
+    void close()
+    {
+        elements_t dropped; // released once unlocked
+        {
+            pvd::Lock L(lock);
+            running = false;
+            dropped.swap(filled);
+            type.reset();
+            mask.reset();
+        }
+        pvd::MonitorRequester::shared_pointer R(requester.lock());
+        if(R)
+            R->unlisten(shared_from_this());
+    }
+
+    virtual pvd::Status start()
+    {
+        {
+            pvd::Lock L(lock);
+            if(running)
+                return pvd::Status::Ok;
+            running = true;
+        }
+        pv->subscribe(shared_from_this());
+        return pvd::Status::Ok;
+    }
+
+    virtual pvd::Status stop()
+    {
+        {
+            pvd::Lock L(lock);
+            running = false;
+        }
+        pv->unsubscribe(this);
+        return pvd::Status::Ok;
+    }
+
+    virtual pvd::MonitorElementPtr poll()
+    {
+        pvd::MonitorElementPtr ret;
+        pvd::Lock L(lock);
+        if(!filled.empty()) {
+            ret = filled.front();
+            filled.pop_front();
+        }
+        return ret;
+    }
+
+    virtual void release(pvd::MonitorElementPtr const & monitorElement)
+    {
+        pvd::BitSet resend;
+        {
+            pvd::Lock L(lock);
+            if(!monitorElement || !mask || monitorElement->pvStructurePtr->getStructure()!=mask->type())
+                return; // from before a type change
+            empty.push_back(monitorElement);
+            resend = missed;
+            missed.clear();
+        }
+        if(!resend.isEmpty())
+            pv->resend(shared_from_this(), resend);
+    }
+
+    virtual void destroy()
+    {
+        stop();
+    }
+};
+
+pvd::StructureConstPtr SharedPV::type()
+{
+    pvd::Lock L(lock);
+    return current ? current->getStructure() : pvd::StructureConstPtr();
+}
+
+pvd::PVStructurePtr SharedPV::get()
+{
+    pvd::PVStructurePtr ret;
+    pvd::Lock L(lock);
+    if(current) {
+        ret = pvd::getPVDataCreate()->createPVStructure(current->getStructure());
+        ret->copyUnchecked(*current);
+    }
+    return ret;
+}
+
+void SharedPV::post(const pvd::PVStructurePtr& value, const pvd::BitSet& changed)
+{
+    std::vector<PyServerMonitor::shared_pointer> notify;
+    std::vector<pvd::PVStructurePtr> old; // released once unlocked
+    {
+        pvd::Lock L(lock);
+        if(!current) {
+            current = pvd::getPVDataCreate()->createPVStructure(value->getStructure());
+            current->copyUnchecked(*value);
+
+        } else if(!(*current->getStructure()==*value->getStructure())) {
+            throw std::runtime_error("Type of a SharedPV can't change until close()");
+
+        } else {
+            // update a copy, so that the arrays replaced stay with the previous value
+            pvd::PVStructurePtr next(pvd::getPVDataCreate()->createPVStructure(current->getStructure()));
+            next->copyUnchecked(*current);
+            if(changed.get(0))
+                next->copyUnchecked(*value);
+            else
+                next->copyUnchecked(*value, changed);
+            old.push_back(current);
+            current = next;
+        }
+
+        for(monitors_t::iterator it = monitors.begin(); it!=monitors.end(); ) {
+            PyServerMonitor::shared_pointer M(it->second.lock());
+            if(!M) {
+                monitors.erase(it++);
+                continue;
+            }
+            if(M->push(current, changed, old))
+                notify.push_back(M);
+            ++it;
+        }
+    }
+    for(size_t i=0; i<notify.size(); i++)
+        notify[i]->notify();
+}
+
+void SharedPV::close()
+{
+    std::vector<PyServerMonitor::shared_pointer> subscribers;
+    pvd::PVStructurePtr old; // released once unlocked
+    {
+        pvd::Lock L(lock);
+        old.swap(current);
+        for(monitors_t::iterator it = monitors.begin(); it!=monitors.end(); ++it) {
+            PyServerMonitor::shared_pointer M(it->second.lock());
+            if(M)
+                subscribers.push_back(M);
+        }
+        monitors.clear();
+    }
+    for(size_t i=0; i<subscribers.size(); i++)
+        subscribers[i]->close();
+}
+
+void SharedPV::subscribe(const PyServerMonitor::shared_pointer& mon)
+{
+    bool notify = false;
+    std::vector<pvd::PVStructurePtr> old; // released once unlocked
+    {
+        pvd::Lock L(lock);
+        monitors[mon.get()] = mon;
+        if(current) {
+            // the initial update has every field
+            pvd::BitSet all;
+            all.set(0);
+            notify = mon->push(current, all, old);
+        }
+    }
+    if(notify)
+        mon->notify();
+}
+
+void SharedPV::unsubscribe(PyServerMonitor* mon)
+{
+    pvd::Lock L(lock);
+    monitors.erase(mon);
+}
+
+void SharedPV::resend(const PyServerMonitor::shared_pointer& mon, const pvd::BitSet& changed)
+{
+    bool notify = false;
+    std::vector<pvd::PVStructurePtr> old; // released once unlocked
+    {
+        pvd::Lock L(lock);
+        if(current && monitors.find(mon.get())!=monitors.end())
+            notify = mon->push(current, changed, old);
+    }
+    if(notify)
+        mon->notify();
+}
+
 pva::Channel::shared_pointer
 PyServerProvider::createChannel(std::string const & channelName,
                                                    pva::ChannelRequester::shared_pointer const & channelRequester,
                                                    short priority, std::string const & address)
 {
-    TRACE("ENTER "<<channelRequester->getRequesterName());
+    TRACE(Channel, "ENTER "<<channelRequester->getRequesterName());
     pva::Channel::shared_pointer ret;
     try {
         PyLock G;
@@ -308,7 +1169,11 @@ PyServerProvider::createChannel(std::string const & channelName,
                                              ret);
 
         } else {
-            ret.reset(new PyServerChannel(shared_from_this(),channelRequester, channelName, handler));
+            SharedPV::shared_pointer pv;
+            if(PyObject_TypeCheck(handler.get(), &P4PSharedPV::type))
+                pv = P4PSharedPV::unwrap(handler.get()).pv;
+
+            ret.reset(new PyServerChannel(shared_from_this(),channelRequester, channelName, handler, pv));
             // handler consumed now
             channelRequester->channelCreated(pvd::Status::Ok, ret);
         }
@@ -316,7 +1181,7 @@ PyServerProvider::createChannel(std::string const & channelName,
         channelRequester->channelCreated(pvd::Status(pvd::Status::STATUSTYPE_ERROR, e.what()),
                                          ret);
     }
-    TRACE("EXIT "<<(ret ? "Create" : "Refuse"));
+    TRACE(Channel, "EXIT "<<(ret ? "Create" : "Refuse"));
     return ret;
 }
 
@@ -325,13 +1190,62 @@ PyServerChannel::createChannelRPC(
         pva::ChannelRPCRequester::shared_pointer const & channelRPCRequester,
         pvd::PVStructure::shared_pointer const & pvRequest)
 {
-    TRACE("ENTER");
-    // TODO: pvRequest being ignored
-    pva::ChannelRPC::shared_pointer ret(new PyServerRPC(shared_from_this(), channelRPCRequester));
+    TRACE(Channel, "ENTER");
+    pva::ChannelRPC::shared_pointer ret(new PyServerRPC(shared_from_this(), channelRPCRequester,
+                                                        FieldRequest(pvRequest)));
     channelRPCRequester->channelRPCConnect(pvd::Status::Ok, ret);
     return ret;
 }
 
+pva::ChannelGet::shared_pointer
+PyServerChannel::createChannelGet(
+        pva::ChannelGetRequester::shared_pointer const & channelGetRequester,
+        pvd::PVStructure::shared_pointer const & pvRequest)
+{
+    if(!pv)
+        return pva::Channel::createChannelGet(channelGetRequester, pvRequest);
+
+    TRACE(Channel, "ENTER");
+    FieldRequest request(pvRequest);
+    pvd::StructureConstPtr type(pv->type());
+    if(type)
+        type = FieldMask::get(type, request)->type();
+    PyServerGet::shared_pointer ret(new PyServerGet(shared_from_this(), channelGetRequester, request));
+    if(type)
+        channelGetRequester->channelGetConnect(pvd::Status::Ok, ret, type);
+    else
+        channelGetRequester->channelGetConnect(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "No value"),
+                                               ret, type);
+    return ret;
+}
+
+pvd::Monitor::shared_pointer
+PyServerChannel::createMonitor(
+        pvd::MonitorRequester::shared_pointer const & monitorRequester,
+        pvd::PVStructure::shared_pointer const & pvRequest)
+{
+    if(!pv)
+        return pva::Channel::createMonitor(monitorRequester, pvRequest);
+
+    TRACE(Channel, "ENTER");
+    size_t queueSize;
+    {
+        pvd::Lock L(pv->lock);
+        queueSize = pv->queueSize;
+    }
+    FieldRequest request(pvRequest);
+    pvd::StructureConstPtr type(pv->type());
+    if(type)
+        type = FieldMask::get(type, request)->type();
+    PyServerMonitor::shared_pointer ret(new PyServerMonitor(pv, monitorRequester, request, queueSize));
+    if(type)
+        monitorRequester->monitorConnect(pvd::Status::Ok, ret, type);
+    else
+        monitorRequester->monitorConnect(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "No value"),
+                                         ret, type);
+    return ret;
+}
+
 typedef std::map<std::string, PyServerProvider::shared_pointer> pyproviders_t;
 pyproviders_t* pyproviders;
 
@@ -339,11 +1253,17 @@ PyObject* p4p_add_provider(PyObject *junk, PyObject *args, PyObject *kwds)
 {
     const char *name;
     PyObject *prov;
+    double positiveTTL = 10.0, negativeTTL = 2.0;
+    PyObject *queue = Py_None;
 
-    const char *names[] = {"name", "provider", NULL};
-    if(!PyArg_ParseTupleAndKeywords(args, kwds, "sO", (char**)names, &name, &prov))
+    const char *names[] = {"name", "provider", "cacheTTL", "negativeTTL", "queue", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "sO|ddO", (char**)names, &name, &prov,
+                                    &positiveTTL, &negativeTTL, &queue))
         return NULL;
 
+    if(queue!=Py_None && !PyObject_TypeCheck(queue, &P4PRPCQueue::type))
+        return PyErr_Format(PyExc_TypeError, "queue= must be an RPCQueue");
+
     try {
         if(!pyproviders)
             pyproviders = new pyproviders_t;
@@ -356,11 +1276,15 @@ PyObject* p4p_add_provider(PyObject *junk, PyObject *args, PyObject *kwds)
         PyServerProvider::shared_pointer P(new PyServerProvider);
         P->provider.swap(handler);
         P->provider_name = name;
+        P->positiveTTL = positiveTTL;
+        P->negativeTTL = negativeTTL;
+        if(queue!=Py_None)
+            P->queue = P4PRPCQueue::unwrap(queue).queue;
 
         pva::registerChannelProviderFactory(P);
 
         (*pyproviders)[name] = P;
-        TRACE("name="<<name);
+        TRACE(Provider, "name="<<name);
 
         Py_RETURN_NONE;
     }CATCH()
@@ -375,7 +1299,7 @@ PyObject* p4p_remove_provider(PyObject *junk, PyObject *args, PyObject *kwds)
         return NULL;
 
     try {
-        TRACE("Clear "<<name);
+        TRACE(Provider, "Clear "<<name);
         if(!pyproviders)
             return PyErr_Format(PyExc_KeyError, "Provider %s not registered", name);
 
@@ -389,13 +1313,144 @@ PyObject* p4p_remove_provider(PyObject *junk, PyObject *args, PyObject *kwds)
         it->second->provider.swap(X);
 
         pyproviders->erase(it);
-        TRACE("name="<<name);
+        TRACE(Provider, "name="<<name);
+
+        Py_RETURN_NONE;
+    }CATCH()
+    return NULL;
+}
+
+PyObject* p4p_invalidate(PyObject *junk, PyObject *args, PyObject *kwds)
+{
+    const char *name, *channel = NULL;
+    const char *names[] = {"name", "channel", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|z", (char**)names, &name, &channel))
+        return NULL;
+
+    try {
+        if(!pyproviders)
+            return PyErr_Format(PyExc_KeyError, "Provider %s not registered", name);
+
+        pyproviders_t::iterator it = pyproviders->find(name);
+        if(it==pyproviders->end())
+            return PyErr_Format(PyExc_KeyError, "Provider %s not registered", name);
+
+        it->second->invalidate(channel ? channel : "");
+        TRACE(Provider, "name="<<name<<" channel="<<(channel ? channel : "<all>"));
 
         Py_RETURN_NONE;
     }CATCH()
     return NULL;
 }
 
+// keeps the answer of a channelFind()
+struct FoundRequester : public pva::ChannelFindRequester
+{
+    POINTER_DEFINITIONS(FoundRequester);
+    FoundRequester() :claim(false) {}
+    virtual ~FoundRequester() {}
+    pvd::Status status;
+    bool claim;
+    virtual void channelFindResult(const pvd::Status& status,
+                                   pva::ChannelFind::shared_pointer const & channelFind,
+                                   bool wasFound)
+    {
+        this->status = status;
+        claim = wasFound;
+    }
+};
+
+PyObject* p4p_find(PyObject *junk, PyObject *args, PyObject *kwds)
+{
+    const char *name, *channel;
+    const char *names[] = {"name", "channel", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "ss", (char**)names, &name, &channel))
+        return NULL;
+
+    try {
+        if(!pyproviders)
+            return PyErr_Format(PyExc_KeyError, "Provider %s not registered", name);
+
+        pyproviders_t::iterator it = pyproviders->find(name);
+        if(it==pyproviders->end())
+            return PyErr_Format(PyExc_KeyError, "Provider %s not registered", name);
+
+        PyServerProvider::shared_pointer P(it->second);
+        FoundRequester::shared_pointer req(new FoundRequester);
+        {
+            // searches come from server threads which don't hold the GIL
+            PyUnlock U;
+            P->channelFind(channel, req);
+        }
+        if(!req->status.isOK())
+            return PyErr_Format(PyExc_RuntimeError, "%s", req->status.getMessage().c_str());
+
+        return PyBool_FromLong(req->claim);
+    }CATCH()
+    return NULL;
+}
+
+PyObject* p4p_mask(PyObject *junk, PyObject *args, PyObject *kwds)
+{
+    PyObject *value, *changed = Py_None;
+    const char *request;
+    const char *names[] = {"value", "request", "changed", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O!s|O", (char**)names, P4PValue_type, &value, &request, &changed))
+        return NULL;
+
+    try {
+        pvd::PVStructurePtr V(P4PValue_unwrap(value));
+
+        pvd::CreateRequest::shared_pointer create(pvd::CreateRequest::create());
+        pvd::PVStructurePtr pvRequest(create->createRequest(request));
+        if(!pvRequest)
+            return PyErr_Format(PyExc_ValueError, "%s", create->getMessage().c_str());
+
+        // same as P4PSharedPV_post()
+        pvd::BitSet in;
+        if(changed==Py_None) {
+            in.set(0);
+        } else {
+            PyRef iter(PyObject_GetIter(changed));
+            while(true) {
+                PyRef item(PyIter_Next(iter.get()), allownull());
+                if(!item.get()) {
+                    if(PyErr_Occurred())
+                        return NULL;
+                    break;
+                }
+                PyString name(item.get());
+                pvd::PVFieldPtr fld(V->getSubField(name.str()));
+                if(!fld)
+                    return PyErr_Format(PyExc_KeyError, "%s", name.str().c_str());
+                in.set(fld->getFieldOffset() - V->getFieldOffset());
+            }
+        }
+
+        // as a monitor of this request sees a post()
+        FieldMask::const_shared_pointer mask(FieldMask::get(V->getStructure(), FieldRequest(pvRequest)));
+        pvd::PVStructurePtr reduced(mask->copy(*V));
+        pvd::BitSet out;
+        mask->mapBits(*V, in, out);
+
+        PyRef bits;
+        if(out.get(0)) {
+            bits.reset(Py_None, borrow());
+        } else {
+            bits.reset(PyList_New(0));
+            for(pvd::int32 k = out.nextSetBit(0); k>=0; k = out.nextSetBit(k+1)) {
+                PyRef name(PyUnicode_FromString(reduced->getSubField(k)->getFullName().c_str()));
+                if(PyList_Append(bits.get(), name.get()))
+                    return NULL;
+            }
+        }
+
+        PyRef ret(P4PValue_wrap(Py_TYPE(value), reduced));
+        return Py_BuildValue("OO", ret.get(), bits.get());
+    }CATCH()
+    return NULL;
+}
+
 PyObject* p4p_remove_all(PyObject *junk, PyObject *args, PyObject *kwds)
 {
     const char *names[] = {NULL};
@@ -403,7 +1458,7 @@ PyObject* p4p_remove_all(PyObject *junk, PyObject *args, PyObject *kwds)
         return NULL;
 
     try {
-        TRACE("Clear");
+        TRACE(Provider, "Clear");
         if(pyproviders) delete pyproviders;
 
         Py_RETURN_NONE;
@@ -434,6 +1489,283 @@ PyTypeObject PyServerRPC::Reply::type = {
     sizeof(PyServerRPC::Reply),
 };
 
+#define TRYQ P4PRPCQueue::reference_type SELF = P4PRPCQueue::unwrap(self); try
+
+int P4PRPCQueue_init(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    unsigned long depth = 100, perChannel = 0;
+    const char *names[] = {"maxsize", "perChannel", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "|kk", (char**)names, &depth, &perChannel))
+        return -1;
+
+    TRYQ {
+        if(depth==0) {
+            PyErr_SetString(PyExc_ValueError, "maxsize must be positive");
+            return -1;
+        }
+        pvd::Lock L(SELF.queue->lock);
+        SELF.queue->limit = depth;
+        SELF.queue->perChannel = perChannel;
+        return 0;
+    }CATCH()
+    return -1;
+}
+
+PyObject* P4PRPCQueue_handle(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    const char *names[] = {NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "", (char**)names))
+        return NULL;
+
+    TRYQ {
+        RPCQueue::shared_pointer Q(SELF.queue);
+        while(true) {
+            RPCQueue::Work W;
+            RPCQueue::popped_t ret;
+            {
+                PyUnlock U;
+                // wake up periodically to allow signal delivery
+                ret = Q->pop(W, 1.0);
+            }
+            if(ret==RPCQueue::Interrupted) {
+                break;
+            } else if(ret==RPCQueue::Timeout) {
+                if(PyErr_CheckSignals())
+                    return NULL;
+            } else {
+                W.rpc->call(W.arg);
+                // release references while the GIL is held
+                W.rpc.reset();
+                W.arg.reset();
+            }
+        }
+        Py_RETURN_NONE;
+    }CATCH()
+    return NULL;
+}
+
+PyObject* P4PRPCQueue_interrupt(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    const char *names[] = {NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "", (char**)names))
+        return NULL;
+
+    TRYQ {
+        SELF.queue->interrupt();
+        Py_RETURN_NONE;
+    }CATCH()
+    return NULL;
+}
+
+PyObject* P4PRPCQueue_stats(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    const char *names[] = {NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "", (char**)names))
+        return NULL;
+
+    TRYQ {
+        RPCQueue& Q = *SELF.queue;
+        pvd::Lock L(Q.lock);
+        return Py_BuildValue("{sksksksKsKsKsdsd}",
+                             "depth", (unsigned long)Q.count,
+                             "peak", (unsigned long)Q.peak,
+                             "maxsize", (unsigned long)Q.limit,
+                             "queued", Q.queued,
+                             "rejected", Q.rejected,
+                             "served", Q.served,
+                             "waitMean", Q.served ? Q.waitTotal/Q.served : 0.0,
+                             "waitMax", Q.waitMax);
+    }CATCH()
+    return NULL;
+}
+
+static PyMethodDef P4PRPCQueue_methods[] = {
+    {"handle", (PyCFunction)&P4PRPCQueue_handle, METH_VARARGS|METH_KEYWORDS,
+     "Serve queued RPC calls until interrupt() (blocking).  May be called from several threads."},
+    {"interrupt", (PyCFunction)&P4PRPCQueue_interrupt, METH_VARARGS|METH_KEYWORDS,
+     "Make one call of handle() return"},
+    {"stats", (PyCFunction)&P4PRPCQueue_stats, METH_VARARGS|METH_KEYWORDS,
+     "Queue depth and wait time statistics as a dict"},
+    {NULL}
+};
+
+int P4PRPCQueue_traverse(PyObject *self, visitproc visit, void *arg)
+{
+    return 0;
+}
+
+int P4PRPCQueue_clear(PyObject *self)
+{
+    return 0;
+}
+
+template<>
+PyTypeObject P4PRPCQueue::type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "p4p._p4p.RPCQueue",
+    sizeof(P4PRPCQueue),
+};
+
+#define TRYPV P4PSharedPV::reference_type SELF = P4PSharedPV::unwrap(self); try
+
+int P4PSharedPV_init(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    unsigned long queueSize = 4;
+    const char *names[] = {"queueSize", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "|k", (char**)names, &queueSize))
+        return -1;
+
+    TRYPV {
+        SharedPV::shared_pointer pv(SELF.pv);
+        PyUnlock U;
+        pvd::Lock L(pv->lock);
+        pv->queueSize = queueSize;
+        return 0;
+    }CATCH()
+    return -1;
+}
+
+PyObject* P4PSharedPV_post(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *value, *changed = Py_None;
+    const char *names[] = {"value", "changed", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O!|O", (char**)names, P4PValue_type, &value, &changed))
+        return NULL;
+
+    TRYPV {
+        pvd::PVStructurePtr V(P4PValue_unwrap(value));
+
+        pvd::BitSet mask;
+        if(changed==Py_None) {
+            mask.set(0);
+        } else {
+            PyRef iter(PyObject_GetIter(changed));
+            while(true) {
+                PyRef item(PyIter_Next(iter.get()), allownull());
+                if(!item.get()) {
+                    if(PyErr_Occurred())
+                        return NULL;
+                    break;
+                }
+                PyString name(item.get());
+                pvd::PVFieldPtr fld(V->getSubField(name.str()));
+                if(!fld)
+                    return PyErr_Format(PyExc_KeyError, "%s", name.str().c_str());
+                mask.set(fld->getFieldOffset() - V->getFieldOffset());
+            }
+        }
+
+        // the caller may modify value once we return.  Arrays are shared, not copied.
+        pvd::PVStructurePtr copy(pvd::getPVDataCreate()->createPVStructure(V->getStructure()));
+        copy->copyUnchecked(*V);
+
+        {
+            PyUnlock U;
+            SELF.pv->post(copy, mask);
+        }
+        Py_RETURN_NONE;
+    }CATCH()
+    return NULL;
+}
+
+PyObject* P4PSharedPV_current(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    const char *names[] = {NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "", (char**)names))
+        return NULL;
+
+    TRYPV {
+        SharedPV::shared_pointer pv(SELF.pv);
+        pvd::PVStructurePtr V;
+        {
+            // never wait for SharedPV::lock with the GIL held
+            PyUnlock U;
+            V = pv->get();
+        }
+        if(!V)
+            Py_RETURN_NONE;
+
+        // wrap with self.Value, as the RPC handler does
+        PyRef wrapper(PyObject_GetAttrString(self, "Value"), allownull());
+        if(!wrapper.get()) {
+            PyErr_Clear();
+            wrapper.reset((PyObject*)P4PValue_type, borrow());
+        }
+        if(!PyType_Check(wrapper.get()))
+            return PyErr_Format(PyExc_TypeError, "self.Value is not a Type");
+
+        return P4PValue_wrap((PyTypeObject*)wrapper.get(), V);
+    }CATCH()
+    return NULL;
+}
+
+PyObject* P4PSharedPV_close(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    const char *names[] = {NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "", (char**)names))
+        return NULL;
+
+    TRYPV {
+        SharedPV::shared_pointer pv(SELF.pv);
+        {
+            PyUnlock U;
+            pv->close();
+        }
+        Py_RETURN_NONE;
+    }CATCH()
+    return NULL;
+}
+
+PyObject* P4PSharedPV_subscribers(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    const char *names[] = {NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "", (char**)names))
+        return NULL;
+
+    TRYPV {
+        SharedPV::shared_pointer pv(SELF.pv);
+        size_t count;
+        {
+            PyUnlock U;
+            pvd::Lock L(pv->lock);
+            count = pv->monitors.size();
+        }
+        return PyLong_FromSize_t(count);
+    }CATCH()
+    return NULL;
+}
+
+static PyMethodDef P4PSharedPV_methods[] = {
+    {"post", (PyCFunction)&P4PSharedPV_post, METH_VARARGS|METH_KEYWORDS,
+     "post(value, changed=None)\n"
+     "Update the value and send it to subscribers.  changed lists the names of the fields\n"
+     "which differ from the previous post(), None for all."},
+    {"current", (PyCFunction)&P4PSharedPV_current, METH_VARARGS|METH_KEYWORDS,
+     "A copy of the latest value, or None"},
+    {"close", (PyCFunction)&P4PSharedPV_close, METH_VARARGS|METH_KEYWORDS,
+     "Disconnect subscribers and forget the value"},
+    {"subscribers", (PyCFunction)&P4PSharedPV_subscribers, METH_VARARGS|METH_KEYWORDS,
+     "Number of monitors"},
+    {NULL}
+};
+
+int P4PSharedPV_traverse(PyObject *self, visitproc visit, void *arg)
+{
+    return 0;
+}
+
+int P4PSharedPV_clear(PyObject *self)
+{
+    return 0;
+}
+
+template<>
+PyTypeObject P4PSharedPV::type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "p4p._p4p.SharedPV",
+    sizeof(P4PSharedPV),
+};
+
 } // namespace
 
 struct PyMethodDef P4P_methods[] = {
@@ -443,6 +1775,27 @@ struct PyMethodDef P4P_methods[] = {
      "Remove a previously added Server Channel provider"},
     {"clearProviders", (PyCFunction)p4p_remove_all, METH_VARARGS|METH_KEYWORDS,
      "Remove all Server Channel providers"},
+    {"invalidateChannels", (PyCFunction)p4p_invalidate, METH_VARARGS|METH_KEYWORDS,
+     "invalidateChannels(name, channel=None)\n"
+     "Forget cached testChannel() results of a provider, for one channel or all.\n"
+     "Call when channels are added or removed."},
+    {"findChannel", (PyCFunction)p4p_find, METH_VARARGS|METH_KEYWORDS,
+     "findChannel(name, channel) -> bool\n"
+     "Search a provider for a channel, as a client search would, through the testChannel() cache.\n"
+     "Returns True if the provider claims the channel."},
+    {"maskValue", (PyCFunction)p4p_mask, METH_VARARGS|METH_KEYWORDS,
+     "maskValue(value, request, changed=None) -> (Value, changed)\n"
+     "Reduce a Value to the fields a pvRequest string selects, as Get and Monitor send it.\n"
+     "changed lists the fields a post() would change, None for all.  Returned is the list of\n"
+     "changed fields of the reduced Value, None for all, or empty when a Monitor would queue nothing."},
+    {"setTrace", (PyCFunction)p4p_trace_set, METH_VARARGS|METH_KEYWORDS,
+     "setTrace(categories) -> previous\n"
+     "Enable trace categories, a mask of Trace* constants.  0 disables tracing."},
+    {"dumpTrace", (PyCFunction)p4p_trace_dump, METH_VARARGS|METH_KEYWORDS,
+     "dumpTrace(clear=False)\n"
+     "Recent trace records, oldest first, as a list of (time, thread, category, function, message).\n"
+     "With clear=True they are not returned again.\n"
+     "Records lost when more than 64 threads trace at once are counted in a last record of category 0."},
     {NULL}
 };
 
@@ -468,4 +1821,44 @@ void p4p_server_provider_register(PyObject *mod)
         Py_DECREF((PyObject*)&PyServerRPC::Reply::type);
         throw std::runtime_error("failed to add _p4p.RPCReply");
     }
+
+    P4PRPCQueue::type.tp_flags = Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE|Py_TPFLAGS_HAVE_GC;
+    P4PRPCQueue::type.tp_new = &P4PRPCQueue::tp_new;
+    P4PRPCQueue::type.tp_init = &P4PRPCQueue_init;
+    P4PRPCQueue::type.tp_dealloc = &P4PRPCQueue::tp_dealloc;
+    P4PRPCQueue::type.tp_traverse = &P4PRPCQueue_traverse;
+    P4PRPCQueue::type.tp_clear = &P4PRPCQueue_clear;
+
+    P4PRPCQueue::type.tp_methods = P4PRPCQueue_methods;
+
+    P4PRPCQueue::type.tp_weaklistoffset = offsetof(P4PRPCQueue, weak);
+
+    if(PyType_Ready(&P4PRPCQueue::type))
+        throw std::runtime_error("failed to initialize p4p._p4p.RPCQueue");
+
+    Py_INCREF((PyObject*)&P4PRPCQueue::type);
+    if(PyModule_AddObject(mod, "RPCQueue", (PyObject*)&P4PRPCQueue::type)) {
+        Py_DECREF((PyObject*)&P4PRPCQueue::type);
+        throw std::runtime_error("failed to add p4p._p4p.RPCQueue");
+    }
+
+    P4PSharedPV::type.tp_flags = Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE|Py_TPFLAGS_HAVE_GC;
+    P4PSharedPV::type.tp_new = &P4PSharedPV::tp_new;
+    P4PSharedPV::type.tp_init = &P4PSharedPV_init;
+    P4PSharedPV::type.tp_dealloc = &P4PSharedPV::tp_dealloc;
+    P4PSharedPV::type.tp_traverse = &P4PSharedPV_traverse;
+    P4PSharedPV::type.tp_clear = &P4PSharedPV_clear;
+
+    P4PSharedPV::type.tp_methods = P4PSharedPV_methods;
+
+    P4PSharedPV::type.tp_weaklistoffset = offsetof(P4PSharedPV, weak);
+
+    if(PyType_Ready(&P4PSharedPV::type))
+        throw std::runtime_error("failed to initialize p4p._p4p.SharedPV");
+
+    Py_INCREF((PyObject*)&P4PSharedPV::type);
+    if(PyModule_AddObject(mod, "SharedPV", (PyObject*)&P4PSharedPV::type)) {
+        Py_DECREF((PyObject*)&P4PSharedPV::type);
+        throw std::runtime_error("failed to add p4p._p4p.SharedPV");
+    }
 }
@@ -32,6 +32,7 @@ PyMOD(_p4p)
         p4p_array_register(mod.get());
         p4p_server_register(mod.get());
         p4p_server_provider_register(mod.get());
+        p4p_trace_register(mod.get());
 
         MODINIT_RET(mod.release());
     } catch(std::exception& e) {
@@ -0,0 +1,240 @@
+/* Trace of server activity, kept in memory instead of printed.
+ *
+ * Each thread appends to its own ring of fixed size records, so recording takes no lock.
+ * A dump copies every ring, and drops records which were overwritten while being copied.
+ * The ring of an exited thread is kept, and handed to a new thread once maxRings are in use.
+ */
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <vector>
+#include <algorithm>
+
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <epicsAtomic.h>
+
+#include <pv/lock.h>
+
+#include "p4p.h"
+
+namespace {
+
+namespace pvd = epics::pvData;
+
+struct TraceRecord {
+    epicsTimeStamp time;
+    unsigned category;
+    const char *func; // from __FUNCTION__, never free'd
+    char msg[104];
+};
+
+struct TraceRing {
+    enum {size=512};
+    char thread[32]; // name of the owner.  Guarded by ringLock.
+    // number of records ever written.  Only changed by the owning thread,
+    // published with a write barrier after the record, read with epicsAtomicGetSizeT().
+    size_t next;
+    // records before this were discarded by a dump, or by a new owner.  Guarded by ringLock.
+    size_t cleared;
+    TraceRecord records[size];
+};
+
+// rings are never free'd, so that a dump can run while threads exit
+const size_t maxRings = 64;
+
+epicsThreadOnceId ringOnce = EPICS_THREAD_ONCE_INIT;
+pthread_key_t ringKey; // epicsThreadPrivate has no destructor
+pvd::Mutex *ringLock;
+std::vector<TraceRing*> *rings;
+std::vector<TraceRing*> *freeRings; // of exited threads.  Guarded by ringLock.
+// records not kept because every ring belongs to a running thread
+size_t dropped;
+
+// thread exit
+void ringExit(void *raw)
+{
+    TraceRing *ring = (TraceRing*)raw;
+    pvd::Lock L(*ringLock);
+    freeRings->push_back(ring);
+}
+
+void ringInit(void *)
+{
+    if(pthread_key_create(&ringKey, &ringExit))
+        abort();
+    ringLock = new pvd::Mutex;
+    rings = new std::vector<TraceRing*>;
+    freeRings = new std::vector<TraceRing*>;
+}
+
+TraceRing *ringSelf()
+{
+    epicsThreadOnce(&ringOnce, &ringInit, NULL);
+
+    TraceRing *ring = (TraceRing*)pthread_getspecific(ringKey);
+    if(!ring) {
+        char name[sizeof(ring->thread)];
+        epicsThreadGetName(epicsThreadGetIdSelf(), name, sizeof(name));
+        name[sizeof(name)-1] = '\0';
+        {
+            pvd::Lock L(*ringLock);
+            if(rings->size()<maxRings) {
+                ring = (TraceRing*)calloc(1, sizeof(TraceRing));
+                if(!ring)
+                    return NULL;
+                rings->push_back(ring);
+            } else if(!freeRings->empty()) {
+                // the records of the exited thread are forgotten
+                ring = freeRings->back();
+                freeRings->pop_back();
+                ring->cleared = epicsAtomicGetSizeT(&ring->next);
+            } else {
+                return NULL; // too many threads, drop
+            }
+            memcpy(ring->thread, name, sizeof(name));
+        }
+        pthread_setspecific(ringKey, ring);
+    }
+    return ring;
+}
+
+struct Dumped {
+    epicsTimeStamp time;
+    unsigned category;
+    const char *func;
+    std::string thread, msg;
+    bool operator<(const Dumped& o) const {
+        return epicsTimeLessThan(&time, &o.time);
+    }
+};
+
+} // namespace
+
+volatile unsigned p4p_trace_mask;
+
+void p4p_trace_record(unsigned category, const char *func, const std::string& msg)
+{
+    TraceRing *ring = ringSelf();
+    if(!ring) {
+        epicsAtomicIncrSizeT(&dropped);
+        return;
+    }
+
+    size_t n = ring->next;
+    TraceRecord& R = ring->records[n%TraceRing::size];
+    epicsTimeGetCurrent(&R.time);
+    R.category = category;
+    R.func = func;
+    size_t len = std::min(msg.size(), sizeof(R.msg)-1);
+    memcpy(R.msg, msg.c_str(), len);
+    R.msg[len] = '\0';
+    // the record is complete before it is counted, the next one is written after
+    epicsAtomicWriteMemoryBarrier();
+    epicsAtomicSetSizeT(&ring->next, n+1);
+}
+
+PyObject* p4p_trace_set(PyObject *junk, PyObject *args, PyObject *kwds)
+{
+    unsigned long mask;
+    const char *names[] = {"categories", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "k", (char**)names, &mask))
+        return NULL;
+
+    unsigned long prev = p4p_trace_mask;
+    p4p_trace_mask = mask;
+    return PyLong_FromUnsignedLong(prev);
+}
+
+PyObject* p4p_trace_dump(PyObject *junk, PyObject *args, PyObject *kwds)
+{
+    PyObject *clear = Py_False;
+    const char *names[] = {"clear", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "|O", (char**)names, &clear))
+        return NULL;
+
+    try {
+        bool doclear = PyObject_IsTrue(clear);
+        std::vector<Dumped> out;
+        size_t lost;
+        {
+            PyUnlock U;
+
+            epicsThreadOnce(&ringOnce, &ringInit, NULL);
+            // only keeps new threads waiting, never those recording
+            pvd::Lock L(*ringLock);
+
+            for(size_t r=0; r<rings->size(); r++) {
+                TraceRing *ring = (*rings)[r];
+                size_t end = epicsAtomicGetSizeT(&ring->next);
+                epicsAtomicReadMemoryBarrier();
+                size_t begin = end>TraceRing::size ? end-TraceRing::size : 0;
+                begin = std::max(begin, ring->cleared);
+                if(doclear)
+                    ring->cleared = end;
+
+                std::vector<Dumped> copied;
+                for(size_t n=begin; n<end; n++) {
+                    const TraceRecord& R = ring->records[n%TraceRing::size];
+                    Dumped D;
+                    D.time = R.time;
+                    D.category = R.category;
+                    D.func = R.func;
+                    D.thread = ring->thread;
+                    D.msg = std::string(R.msg, strnlen(R.msg, sizeof(R.msg)));
+                    copied.push_back(D);
+                }
+
+                // records written since may have replaced the oldest ones we copied,
+                // and record 'after' may be being written over record after-size
+                epicsAtomicReadMemoryBarrier();
+                size_t after = epicsAtomicGetSizeT(&ring->next);
+                size_t valid = after+1>TraceRing::size ? after+1-TraceRing::size : 0;
+                for(size_t n=std::max(begin, valid); n<end; n++)
+                    out.push_back(copied[n-begin]);
+            }
+
+            std::stable_sort(out.begin(), out.end());
+
+            lost = epicsAtomicGetSizeT(&dropped);
+            if(doclear)
+                epicsAtomicSubSizeT(&dropped, lost);
+        }
+
+        if(lost) {
+            // reported last, as of now
+            Dumped D;
+            epicsTimeGetCurrent(&D.time);
+            D.category = 0;
+            D.func = "dumpTrace";
+            D.msg = SB()<<lost<<" records dropped, more than "<<maxRings<<" threads tracing";
+            out.push_back(D);
+        }
+
+        PyRef list(PyList_New(out.size()));
+        for(size_t i=0; i<out.size(); i++) {
+            const Dumped& D = out[i];
+            double time = D.time.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH + D.time.nsec*1e-9;
+            PyRef ent(Py_BuildValue("dsIss", time, D.thread.c_str(), D.category, D.func ? D.func : "", D.msg.c_str()));
+            PyList_SET_ITEM(list.get(), i, ent.release());
+        }
+        return list.release();
+    }CATCH()
+    return NULL;
+}
+
+void p4p_trace_register(PyObject *mod)
+{
+    const char *env = getenv("P4P_TRACE");
+    if(env)
+        p4p_trace_mask = strtoul(env, NULL, 0);
+
+    if(PyModule_AddIntConstant(mod, "TraceServer", TraceServer)
+            || PyModule_AddIntConstant(mod, "TraceSearch", TraceSearch)
+            || PyModule_AddIntConstant(mod, "TraceChannel", TraceChannel)
+            || PyModule_AddIntConstant(mod, "TraceRPC", TraceRPC)
+            || PyModule_AddIntConstant(mod, "TraceProvider", TraceProvider))
+        throw std::runtime_error("failed to add _p4p trace categories");
+}
@@ -1,6 +1,8 @@
 
 #include <stddef.h>
 
+#include <map>
+
 #include "p4p.h"
 
 #define NO_IMPORT_ARRAY
@@ -340,38 +342,138 @@ pvd::Structure::const_shared_pointer P4PType_unwrap(PyObject *obj)
     return P4PType::unwrap(obj);
 }
 
-epics::pvData::Field::const_shared_pointer P4PType_guess(PyObject *obj)
+namespace {
+
+pvd::Field::const_shared_pointer guess_array(int nptype)
 {
     pvd::FieldCreatePtr create(pvd::getFieldCreate());
 
+    switch(nptype) {
+#define CASE(NTYPE, PTYPE) case NTYPE: return create->createScalarArray(PTYPE);
+    CASE(NPY_BOOL, pvd::pvBoolean) // bool stored as one byte
+    CASE(NPY_BYTE, pvd::pvByte)
+    CASE(NPY_SHORT, pvd::pvShort)
+    CASE(NPY_INT, pvd::pvInt)
+    CASE(NPY_LONG, pvd::pvLong)
+    CASE(NPY_UBYTE, pvd::pvUByte)
+    CASE(NPY_USHORT, pvd::pvUShort)
+    CASE(NPY_UINT, pvd::pvUInt)
+    CASE(NPY_ULONG, pvd::pvULong)
+    CASE(NPY_FLOAT, pvd::pvFloat)
+    CASE(NPY_DOUBLE, pvd::pvDouble)
+    CASE(NPY_STRING, pvd::pvString)
+    CASE(NPY_UNICODE, pvd::pvString)
+#undef CASE
+    }
+    return pvd::Field::const_shared_pointer();
+}
+
+// Guess a Field for obj, and append its shape to sig.
+// Structures are interned by shape, so repeated guesses for
+// dicts with the same keys and value types share one Structure.
+pvd::Field::const_shared_pointer guess(PyObject *obj, std::string& sig)
+{
+    pvd::FieldCreatePtr create(pvd::getFieldCreate());
+    pvd::Field::const_shared_pointer ret;
+
     if(0) {
 #if PY_MAJOR_VERSION < 3
     } else if(PyInt_Check(obj)) {
-        return create->createScalar(pvd::pvInt);
+        ret = create->createScalar(pvd::pvInt);
 #endif
     } else if(PyLong_Check(obj)) {
-        return create->createScalar(pvd::pvLong);
+        ret = create->createScalar(pvd::pvLong);
     } else if(PyFloat_Check(obj)) {
-        return create->createScalar(pvd::pvDouble);
+        ret = create->createScalar(pvd::pvDouble);
     } else if(PyBytes_Check(obj) || PyUnicode_Check(obj)) {
-        return create->createScalar(pvd::pvString);
+        ret = create->createScalar(pvd::pvString);
     } else if(PyArray_Check(obj)) {
-        switch(PyArray_TYPE(obj)) {
-#define CASE(NTYPE, PTYPE) case NTYPE: return create->createScalarArray(PTYPE);
-        CASE(NPY_BOOL, pvd::pvBoolean) // bool stored as one byte
-        CASE(NPY_BYTE, pvd::pvByte)
-        CASE(NPY_SHORT, pvd::pvShort)
-        CASE(NPY_INT, pvd::pvInt)
-        CASE(NPY_LONG, pvd::pvLong)
-        CASE(NPY_UBYTE, pvd::pvUByte)
-        CASE(NPY_USHORT, pvd::pvUShort)
-        CASE(NPY_UINT, pvd::pvUInt)
-        CASE(NPY_ULONG, pvd::pvULong)
-        CASE(NPY_FLOAT, pvd::pvFloat)
-        CASE(NPY_DOUBLE, pvd::pvDouble)
-#undef CASE
+        if(PyArray_NDIM((PyArrayObject*)obj)==1)
+            ret = guess_array(PyArray_TYPE(obj));
+
+    } else if(PyList_Check(obj)) {
+        // let numpy find a common element type in one pass.
+        // lists mixing eg. numbers and None come back as object, which has no mapping
+        PyArray_Descr *descr = PyArray_DescrFromObject(obj, NULL);
+        if(!descr) {
+            PyErr_Clear();
+            return ret;
+        }
+        PyRef D((PyObject*)descr);
+        if(descr->type_num==NPY_STRING || descr->type_num==NPY_UNICODE) {
+            // numpy would also store [1, 'a'] as strings, only take lists of strings
+            for(Py_ssize_t i=0, N=PyList_GET_SIZE(obj); i<N; i++) {
+                PyObject *item = PyList_GET_ITEM(obj, i);
+                if(!PyBytes_Check(item) && !PyUnicode_Check(item))
+                    return ret;
+            }
+        }
+        ret = guess_array(descr->type_num);
+
+    } else if(PyDict_Check(obj)) {
+        PyRef keys(PyDict_Keys(obj));
+        // dict order is arbitrary, so sort for a repeatable shape
+        if(PyList_Sort(keys.get())) {
+            PyErr_Clear();
+            return ret;
+        }
+
+        Py_ssize_t N = PyList_GET_SIZE(keys.get());
+        pvd::StringArray names(N);
+        pvd::FieldConstPtrArray fields(N);
+        std::string mysig("{");
+
+        for(Py_ssize_t i=0; i<N; i++) {
+            PyObject *key = PyList_GET_ITEM(keys.get(), i);
+            if(PyUnicode_Check(key)) {
+                PyRef B(PyUnicode_AsUTF8String(key));
+                names[i] = std::string(PyBytes_AS_STRING(B.get()), PyBytes_GET_SIZE(B.get()));
+            } else if(PyBytes_Check(key)) {
+                names[i] = std::string(PyBytes_AS_STRING(key), PyBytes_GET_SIZE(key));
+            } else {
+                return ret; // only string keys name fields
+            }
+
+            mysig += std::string(SB()<<names[i].size()<<':'<<names[i]);
+
+            fields[i] = guess(PyDict_GetItem(obj, key), mysig);
+            if(!fields[i])
+                return ret;
+        }
+        mysig += '}';
+        sig += mysig;
+
+        // only used with the GIL held
+        typedef std::map<std::string, pvd::Structure::const_shared_pointer> cache_t;
+        static cache_t *cache = new cache_t;
+
+        cache_t::const_iterator it(cache->find(mysig));
+        if(it!=cache->end())
+            return it->second;
+
+        pvd::Structure::const_shared_pointer S(create->createStructure(names, fields));
+
+        if(cache->size()>=1024)
+            cache->clear();
+        (*cache)[mysig] = S;
+        return S;
+    }
+
+    if(ret) {
+        if(ret->getType()==pvd::scalarArray) {
+            sig += 'a';
+            sig += sname(static_cast<const pvd::ScalarArray*>(ret.get())->getElementType());
+        } else {
+            sig += sname(static_cast<const pvd::Scalar*>(ret.get())->getScalarType());
         }
     }
-    return epics::pvData::Field::const_shared_pointer();
-    // TODO: guess for  list and dict
+    return ret;
+}
+
+} // namespace
+
+epics::pvData::Field::const_shared_pointer P4PType_guess(PyObject *obj)
+{
+    std::string sig;
+    return guess(obj, sig);
 }
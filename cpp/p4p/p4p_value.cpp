@@ -1,6 +1,8 @@
 
 #include <stddef.h>
 
+#include <map>
+
 #include "p4p.h"
 
 #define NO_IMPORT_ARRAY
@@ -12,8 +14,24 @@ namespace {
 
 namespace pvd = epics::pvData;
 
+// Per Structure tables for lookup of fields by name.
+// Only used with the GIL held.
+struct FieldIndex {
+    POINTER_DEFINITIONS(FieldIndex);
+
+    pvd::StructureConstPtr type; // keeps the cache key alive
+    PyRef names; // tuple of interned member names
+    PyRef offsets; // dict of member and dotted sub-member name to relative field offset
+
+    static const_shared_pointer get(const pvd::StructureConstPtr& type);
+};
+
 struct Value {
     pvd::PVStructure::shared_pointer V;
+    FieldIndex::const_shared_pointer index; // of V, filled on first lookup()
+
+    // find a field of V by name, NULL if there is none
+    pvd::PVFieldPtr lookup(PyObject *name);
 
     void storefld(epics::pvData::PVField *fld,
                const epics::pvData::Field *ftype,
@@ -60,6 +78,168 @@ NPY_TYPES ntype(pvd::ScalarType t) {
     throw std::runtime_error(SB()<<"Unable to map scalar type '"<<(int)t<<"'");
 }
 
+// shared_vector deleter which keeps a numpy array alive.
+// The last reference may be dropped by any thread, so go through PyExternalRef.
+struct npdeleter {
+    std::tr1::shared_ptr<PyExternalRef> arr;
+    void operator()(const void*) {
+        arr.reset();
+    }
+};
+
+// Reference the buffer of a contiguous, aligned, read-only 1-d array without copying.
+// Arrays which came from fetchfld() hand back the vector they wrap.
+array_type npborrow(PyObject *obj, pvd::ScalarType etype)
+{
+    PyArrayObject *arr = (PyArrayObject*)obj;
+    PyObject *base = PyArray_BASE(arr);
+
+    if(base && Py_TYPE(base)==P4PArray_type) {
+        const array_type& vec = P4PArray_extract(base);
+        if(vec.original_type()==etype && vec.data()==PyArray_DATA(arr)
+                && vec.size()==(size_t)PyArray_NBYTES(arr))
+            return vec;
+    }
+
+    npdeleter del;
+    del.arr.reset(new PyExternalRef);
+    del.arr->ref.reset(obj, borrow());
+
+    pvd::shared_vector<void> buf((void*)PyArray_DATA(arr), del, 0, PyArray_NBYTES(arr));
+    buf.set_original_type(etype);
+    return pvd::freeze(buf);
+}
+
+// Can an array of this structure map to a numpy structured array?
+// Only when every member is a numeric scalar.
+bool npflat(const pvd::Structure *T)
+{
+    const pvd::FieldConstPtrArray& flds(T->getFields());
+    if(flds.empty())
+        return false;
+    for(size_t i=0; i<flds.size(); i++) {
+        if(flds[i]->getType()!=pvd::scalar)
+            return false;
+        if(static_cast<const pvd::Scalar*>(flds[i].get())->getScalarType()==pvd::pvString)
+            return false;
+    }
+    return true;
+}
+
+// copy one member of each structure to or from a column of a numpy structured array
+template<typename T>
+void npcopy(const pvd::PVStructurePtr *rows, size_t count, size_t idx,
+            char *col, npy_intp stride, bool store)
+{
+    for(size_t i=0; i<count; i++, col+=stride) {
+        if(!rows[i])
+            continue;
+        pvd::PVScalarValue<T> *F = static_cast<pvd::PVScalarValue<T>*>(rows[i]->getPVFields()[idx].get());
+        T val;
+        // columns of a packed dtype need not be aligned
+        if(store) {
+            memcpy(&val, col, sizeof(T));
+            F->put(val);
+        } else {
+            val = F->get();
+            memcpy(col, &val, sizeof(T));
+        }
+    }
+}
+
+void npcopycol(pvd::ScalarType etype,
+               const pvd::PVStructurePtr *rows, size_t count, size_t idx,
+               char *col, npy_intp stride, bool store)
+{
+    switch(etype) {
+#define CASE(PTYPE, TYPE) case pvd::PTYPE: npcopy<pvd::TYPE>(rows, count, idx, col, stride, store); return
+    CASE(pvBoolean, boolean);
+    CASE(pvByte, int8);
+    CASE(pvShort, int16);
+    CASE(pvInt, int32);
+    CASE(pvLong, int64);
+    CASE(pvUByte, uint8);
+    CASE(pvUShort, uint16);
+    CASE(pvUInt, uint32);
+    CASE(pvULong, uint64);
+    CASE(pvFloat, float);
+    CASE(pvDouble, double);
+#undef CASE
+    default:
+        break;
+    }
+    throw std::runtime_error(SB()<<"Unable to map scalar type '"<<(int)etype<<"'");
+}
+
+// number the members of S in the order of field offsets, returns the offset after the last member
+size_t index_fields(PyObject *offsets, const pvd::Structure *S, const std::string& prefix, size_t offset)
+{
+    const pvd::StringArray& names(S->getFieldNames());
+    const pvd::FieldConstPtrArray& flds(S->getFields());
+
+    size_t next = offset+1;
+    for(size_t i=0; i<names.size(); i++) {
+        std::string name(prefix+names[i]);
+        PyRef off(PyLong_FromSize_t(next));
+        if(PyDict_SetItemString(offsets, name.c_str(), off.get()))
+            throw std::runtime_error("XXX");
+
+        if(flds[i]->getType()==pvd::structure)
+            next = index_fields(offsets, static_cast<const pvd::Structure*>(flds[i].get()), name+".", next);
+        else
+            next++;
+    }
+    return next;
+}
+
+FieldIndex::const_shared_pointer FieldIndex::get(const pvd::StructureConstPtr& type)
+{
+    // never free'd, entries may outlive the interpreter
+    typedef std::map<const pvd::Structure*, FieldIndex::const_shared_pointer> cache_t;
+    static cache_t *cache = new cache_t;
+
+    cache_t::const_iterator it(cache->find(type.get()));
+    if(it!=cache->end())
+        return it->second;
+
+    FieldIndex::shared_pointer ret(new FieldIndex);
+    ret->type = type;
+
+    const pvd::StringArray& names(type->getFieldNames());
+    ret->names.reset(PyTuple_New(names.size()));
+    for(size_t i=0; i<names.size(); i++) {
+#if PY_MAJOR_VERSION < 3
+        PyObject *name = PyString_InternFromString(names[i].c_str());
+#else
+        PyObject *name = PyUnicode_InternFromString(names[i].c_str());
+#endif
+        if(!name)
+            throw std::runtime_error("XXX");
+        PyTuple_SET_ITEM(ret->names.get(), i, name);
+    }
+
+    ret->offsets.reset(PyDict_New());
+    index_fields(ret->offsets.get(), type.get(), std::string(), 0);
+
+    // Structures are usually long lived and few.  Start over if this isn't so.
+    if(cache->size()>=1024)
+        cache->clear();
+    (*cache)[type.get()] = ret;
+    return ret;
+}
+
+pvd::PVFieldPtr Value::lookup(PyObject *name)
+{
+    if(!index || index->type!=V->getStructure())
+        index = FieldIndex::get(V->getStructure());
+
+    PyObject *off = PyDict_GetItem(index->offsets.get(), name); // borrowed
+    if(!off)
+        return pvd::PVFieldPtr();
+
+    return V->getSubField(V->getFieldOffset() + PyLong_AsSize_t(off));
+}
+
 //pvd::ScalarType ptype(NPY_TYPES t) {
 //    for(const npmap *p = np2pvd; p->npy!=NPY_NOTYPE; p++) {
 //        if(p->npy==t) return p->pvd;
@@ -72,16 +252,16 @@ void Value::store_struct(pvd::PVStructure* fld,
                          const pvd::Structure* ftype,
                          PyObject *obj)
 {
-    const pvd::StringArray& names(ftype->getFieldNames());
+    FieldIndex::const_shared_pointer index(FieldIndex::get(fld->getStructure()));
     const pvd::FieldConstPtrArray& flds(ftype->getFields());
     const pvd::PVFieldPtrArray& vals(fld->getPVFields());
 
-    size_t nfld = names.size();
+    size_t nfld = flds.size();
 
     for(size_t i=0; i<nfld; i++) {
-        PyRef name(PyUnicode_FromString(names[i].c_str()));
+        PyObject *name = PyTuple_GET_ITEM(index->names.get(), i);
 
-        PyRef item(PyObject_GetItem(obj, name.get()), allownull());
+        PyRef item(PyObject_GetItem(obj, name), allownull());
         if(!item.get()) {
             assert(PyErr_Occurred());
             if(!PyErr_ExceptionMatches(PyExc_KeyError))
@@ -253,9 +433,15 @@ void Value::storefld(pvd::PVField* fld,
             if(PyArray_NDIM(V.get())!=1)
                 throw std::runtime_error("Only 1-d array can be assigned");
 
-            // TODO: detect reference cycles so we can avoid this copy
-            //       Cycles can be created only if we both store and fetch
-            //       by reference.
+            if(!PyArray_ISWRITEABLE((PyArrayObject*)V.get())
+                    || (V.get()!=obj && PyArray_CHKFLAGS((PyArrayObject*)V.get(), NPY_OWNDATA))) {
+                // read-only, or a private copy made by the conversion above,
+                // so the buffer can't change under us.  Store by reference.
+                F->putFrom(npborrow(V.get(), etype));
+                return;
+            }
+
+            // arrays the caller may still modify are copied
             pvd::shared_vector<void> buf(pvd::ScalarTypeFunc::allocArray(etype, PyArray_DIM(V.get(), 0)));
 
             memcpy(buf.data(), PyArray_DATA(V.get()), PyArray_NBYTES(V.get()));
@@ -270,9 +456,75 @@ void Value::storefld(pvd::PVField* fld,
         store_struct(F, T, obj);
     }
         return;
-    case pvd::structureArray:
-        // TODO
-        break;
+    case pvd::structureArray: {
+        pvd::PVStructureArray* F = static_cast<pvd::PVStructureArray*>(fld);
+        pvd::StructureConstPtr T = static_cast<const pvd::StructureArray *>(ftype)->getStructure();
+
+        pvd::PVDataCreatePtr create(pvd::getPVDataCreate());
+        pvd::PVStructureArray::svector arr;
+
+        if(PyArray_Check(obj) && PyDataType_HASFIELDS(PyArray_DESCR((PyArrayObject*)obj)) && npflat(T.get())) {
+            // numpy structured array, copied column by column
+            if(PyArray_NDIM(obj)!=1)
+                throw std::runtime_error("Only 1-d array can be assigned");
+
+            size_t count = PyArray_DIM(obj, 0);
+            arr.resize(count);
+            for(size_t i=0; i<count; i++)
+                arr[i] = create->createPVStructure(T);
+
+            const pvd::StringArray& names(T->getFieldNames());
+            const pvd::FieldConstPtrArray& flds(T->getFields());
+            PyObject *fields = PyArray_DESCR((PyArrayObject*)obj)->fields;
+
+            for(size_t i=0; i<names.size() && count; i++) {
+                if(!PyDict_GetItemString(fields, names[i].c_str()))
+                    continue; // like store_struct(), members not provided are left alone
+
+                pvd::ScalarType etype = static_cast<const pvd::Scalar*>(flds[i].get())->getScalarType();
+
+                PyRef name(Py_BuildValue("s", names[i].c_str()));
+                PyRef col(PyObject_GetItem(obj, name.get()));
+                PyRef C(PyArray_FromAny(col.get(), PyArray_DescrFromType(ntype(etype)), 1, 1,
+                                        NPY_CARRAY_RO, NULL));
+
+                npcopycol(etype, &arr[0], count, i, PyArray_BYTES(C.get()), PyArray_ITEMSIZE(C.get()), true);
+            }
+
+        } else {
+            PyRef iter(PyObject_GetIter(obj));
+
+            while(true) {
+                PyRef item(PyIter_Next(iter.get()), allownull());
+                if(!item.get()) {
+                    if(PyErr_Occurred())
+                        throw std::runtime_error("XXX");
+                    break;
+                }
+
+                pvd::PVStructurePtr dest;
+
+                if(item.get()==Py_None) {
+                    // leave a NULL element
+
+                } else if(PyObject_TypeCheck(item.get(), &P4PValue::type)
+                          && P4PValue::unwrap(item.get()).V->getStructure()==T) {
+                    // copy so that later changes to the Value don't show through
+                    dest = create->createPVStructure(T);
+                    dest->copyUnchecked(*P4PValue::unwrap(item.get()).V);
+
+                } else {
+                    dest = create->createPVStructure(T);
+                    store_struct(dest.get(), T.get(), item.get());
+                }
+
+                arr.push_back(dest);
+            }
+        }
+
+        F->replace(pvd::freeze(arr));
+    }
+        return;
     case pvd::union_: {
         pvd::PVUnion* F = static_cast<pvd::PVUnion*>(fld);
         const pvd::Union *T = static_cast<const pvd::Union *>(ftype);
@@ -409,7 +661,72 @@ PyObject *Value::fetchfld(pvd::PVField *fld,
         }
     }
         break;
-    case pvd::structureArray:
+    case pvd::structureArray: {
+        pvd::PVStructureArray* F = static_cast<pvd::PVStructureArray*>(fld);
+        pvd::StructureConstPtr T = static_cast<const pvd::StructureArray*>(ftype)->getStructure();
+
+        pvd::PVStructureArray::const_svector arr(F->view());
+
+        if(!unpackstruct && npflat(T.get())) {
+            // numpy structured array, with one column per member.  NULL elements read as zeros.
+            const pvd::StringArray& names(T->getFieldNames());
+            const pvd::FieldConstPtrArray& flds(T->getFields());
+
+            PyRef spec(PyList_New(names.size()));
+            for(size_t i=0; i<names.size(); i++) {
+                pvd::ScalarType etype = static_cast<const pvd::Scalar*>(flds[i].get())->getScalarType();
+                PyRef dtype((PyObject*)PyArray_DescrFromType(ntype(etype)));
+
+                PyList_SET_ITEM(spec.get(), i, Py_BuildValue("sO", names[i].c_str(), dtype.get()));
+                if(!PyList_GET_ITEM(spec.get(), i))
+                    throw std::runtime_error("XXX");
+            }
+
+            PyArray_Descr *descr = NULL;
+            if(!PyArray_DescrConverter(spec.get(), &descr))
+                throw std::runtime_error("XXX");
+
+            npy_intp dim = arr.size();
+            PyRef ret(PyArray_Zeros(1, &dim, descr, 0)); // steals descr
+
+            PyObject *fields = PyArray_DESCR((PyArrayObject*)ret.get())->fields;
+            npy_intp stride = PyArray_STRIDE(ret.get(), 0);
+
+            for(size_t i=0; i<names.size() && dim; i++) {
+                pvd::ScalarType etype = static_cast<const pvd::Scalar*>(flds[i].get())->getScalarType();
+
+                // (dtype, offset)
+                PyObject *info = PyDict_GetItemString(fields, names[i].c_str());
+                Py_ssize_t offset = info ? PyNumber_AsSsize_t(PyTuple_GET_ITEM(info, 1), NULL) : -1;
+                if(offset<0)
+                    throw std::runtime_error(SB()<<"Missing column "<<names[i]);
+
+                npcopycol(etype, &arr[0], arr.size(), i, PyArray_BYTES(ret.get())+offset, stride, false);
+            }
+
+            return ret.release();
+
+        } else {
+            PyRef list(PyList_New(arr.size()));
+
+            for(size_t i=0; i<arr.size(); i++) {
+                PyRef ent;
+
+                if(!arr[i]) {
+                    ent.reset(Py_None, borrow());
+                } else if(unpackstruct) {
+                    ent.reset(fetchfld(arr[i].get(), T.get(), unpackstruct));
+                } else {
+                    PyObject *self = P4PValue::wrap(this);
+                    ent.reset(P4PValue_wrap(Py_TYPE(self), arr[i]));
+                }
+
+                PyList_SET_ITEM(list.get(), i, ent.release());
+            }
+
+            return list.release();
+        }
+    }
         break;
     case pvd::union_: {
         pvd::PVUnion* F = static_cast<pvd::PVUnion*>(fld);
@@ -491,8 +808,7 @@ int P4PValue_init(PyObject *self, PyObject *args, PyObject *kwds)
 int P4PValue_setattr(PyObject *self, PyObject *name, PyObject *value)
 {
     TRY {
-        PyString S(name);
-        pvd::PVFieldPtr fld = SELF.V->getSubField(S.str());
+        pvd::PVFieldPtr fld = SELF.lookup(name);
         if(!fld)
             return PyObject_GenericSetAttr((PyObject*)self, name, value);
 
@@ -509,8 +825,7 @@ int P4PValue_setattr(PyObject *self, PyObject *name, PyObject *value)
 PyObject* P4PValue_getattr(PyObject *self, PyObject *name)
 {
     TRY {
-        PyString S(name);
-        pvd::PVFieldPtr fld = SELF.V->getSubField(S.str());
+        pvd::PVFieldPtr fld = SELF.lookup(name);
         if(!fld)
             return PyObject_GenericGetAttr((PyObject*)self, name);
 
@@ -610,10 +925,9 @@ Py_ssize_t P4PValue_len(PyObject *self)
 int P4PValue_setitem(PyObject *self, PyObject *name, PyObject *value)
 {
     TRY {
-        PyString S(name);
-        pvd::PVFieldPtr fld = SELF.V->getSubField(S.str());
+        pvd::PVFieldPtr fld = SELF.lookup(name);
         if(!fld) {
-            PyErr_SetString(PyExc_KeyError, S.str().c_str());
+            PyErr_SetObject(PyExc_KeyError, name);
             return -1;
         }
 
@@ -630,10 +944,9 @@ int P4PValue_setitem(PyObject *self, PyObject *name, PyObject *value)
 PyObject* P4PValue_getitem(PyObject *self, PyObject *name)
 {
     TRY {
-        PyString S(name);
-        pvd::PVFieldPtr fld = SELF.V->getSubField(S.str());
+        pvd::PVFieldPtr fld = SELF.lookup(name);
         if(!fld) {
-            PyErr_SetString(PyExc_KeyError, S.str().c_str());
+            PyErr_SetObject(PyExc_KeyError, name);
             return NULL;
         }
 
@@ -8,6 +8,8 @@
 #include <stdexcept>
 #include <vector>
 #include <sstream>
+#include <cstdlib>
+#include <cmath>
 
 #include <epicsThread.h>
 #include <alarm.h>
@@ -64,6 +66,42 @@ static int32 scalarType2dbrType[] =
    0  // string to DBR_STRING  
 };
 
+/**
+ * Answer times of the channel searches of all connects of the process,
+ * as smoothed mean and deviation, the same way TCP estimates round trips.
+ */
+struct SearchStatistics
+{
+    SearchStatistics() : mean(0.0), deviation(0.0), samples(0) {}
+    void add(double seconds)
+    {
+        Lock xx(mutex);
+        if(samples==0) {
+            mean = seconds;
+            deviation = seconds/2.0;
+        } else {
+            deviation += (fabs(seconds - mean) - deviation)/4.0;
+            mean += (seconds - mean)/8.0;
+        }
+        ++samples;
+    }
+    double timeout(double timeOut)
+    {
+        Lock xx(mutex);
+        if(samples==0) return timeOut;
+        double result = mean + 4.0*deviation;
+        double limit = (timeOut > 10.0) ? timeOut : 10.0;
+        if(result > limit) result = limit;
+        return (result > timeOut) ? result : timeOut;
+    }
+    Mutex mutex;
+    double mean;
+    double deviation;
+    size_t samples;
+};
+
+static SearchStatistics searchStatistics;
+
 namespace detail {
 
 GatherV3DataChannel::GatherV3DataChannel(
@@ -114,6 +152,14 @@ void GatherV3DataChannel::channelStateChange(
     bool isConnected = false;
     if(connectionState==Channel::CONNECTED) isConnected = true;
     Lock xx(gatherV3Data->mutex);
+    epicsTimeStamp & issued = gatherV3Data->connectIssued[offset];
+    if(isConnected && issued.secPastEpoch!=0) {
+        epicsTimeStamp now;
+        epicsTimeGetCurrent(&now);
+        searchStatistics.add(epicsTimeDiffInSeconds(&now, &issued));
+        issued.secPastEpoch = 0;
+        issued.nsec = 0;
+    }
     if(!isConnected==gatherV3Data->isConnected[offset]) {
         gatherV3Data->isConnected[offset] = isConnected;;
         if(isConnected) {
@@ -127,7 +173,8 @@ void GatherV3DataChannel::channelStateChange(
     {
                 gatherV3Data->event.signal();
     }
-    ++gatherV3Data->numberCallback;
+    // connect waits for callbacks to settle, requests count only their own
+    if(gatherV3Data->state==connecting) ++gatherV3Data->numberCallback;
     return;
 }
 
@@ -191,7 +238,7 @@ void GatherV3DataChannel::channelGetConnect(
          gatherV3Data->requestOK = false;
     }
     ++gatherV3Data->numberCallback;
-    if(gatherV3Data->numberCallback==gatherV3Data->numberConnected) {
+    if(gatherV3Data->numberCallback==gatherV3Data->numberRequested) {
         gatherV3Data->event.signal();
     }
 }
@@ -203,6 +250,16 @@ void GatherV3DataChannel::getDone(
     BitSet::shared_pointer const & bitSet)
 {
     Lock xx(gatherV3Data->mutex);
+    if(!status.isOK() || !pvStructure) {
+        gatherV3Data->message += gatherV3Data->channelName[offset] +
+             " " + status.getMessage();
+        gatherV3Data->requestOK = false;
+        ++gatherV3Data->numberCallback;
+        if(gatherV3Data->numberCallback==gatherV3Data->numberRequested) {
+            gatherV3Data->event.signal();
+        }
+        return;
+    }
     PVFieldPtr pvFrom = pvStructure->getSubField("value");
     PVFieldPtr pvTo = gatherV3Data->value[offset]->get();
     convert->copy(pvFrom,pvTo);
@@ -231,7 +288,7 @@ void GatherV3DataChannel::getDone(
     PVStringPtr pvMess = pvStructure->getSubField<PVString>("alarm.message");
     gatherV3Data->alarmMessage[offset] = pvMess->get();
     ++gatherV3Data->numberCallback;
-    if(gatherV3Data->numberCallback==gatherV3Data->numberConnected) {
+    if(gatherV3Data->numberCallback==gatherV3Data->numberRequested) {
         gatherV3Data->event.signal();
     }
 }
@@ -247,7 +304,7 @@ void GatherV3DataChannel::channelPutConnect(
     gatherV3Data->putBitSet[offset] = BitSetPtr(
          new BitSet(gatherV3Data->putPVStructure[offset]->getNumberFields()));
     ++gatherV3Data->numberCallback;
-    if(gatherV3Data->numberCallback==gatherV3Data->numberConnected) {
+    if(gatherV3Data->numberCallback==gatherV3Data->numberRequested) {
         gatherV3Data->event.signal();
     }
 }
@@ -258,7 +315,7 @@ void GatherV3DataChannel::putDone(
 {
     Lock xx(gatherV3Data->mutex);
     ++gatherV3Data->numberCallback;
-    if(gatherV3Data->numberCallback==gatherV3Data->numberConnected) {
+    if(gatherV3Data->numberCallback==gatherV3Data->numberRequested) {
         gatherV3Data->event.signal();
     }
 }
@@ -356,10 +413,28 @@ GatherV3Data::GatherV3Data(
     NTMultiChannelPtr const & multiChannel,
     size_t numberChannel)
 : channelProvider(getChannelProviderRegistry()->getProvider("ca")),
+  connectBatch(500),
+  connectPause(0.05),
   multiChannel(multiChannel),
   numberChannel(numberChannel),
   channelName(multiChannel->getChannelName()->view())
-{ }
+{
+    const char * batch = getenv("MASAR_CONNECT_BATCH");
+    if(batch) connectBatch = strtoul(batch, 0, 10);
+    const char * pause = getenv("MASAR_CONNECT_PAUSE");
+    if(pause) connectPause = atof(pause);
+}
+
+void GatherV3Data::setConnectBatch(size_t batchSize, double batchPause)
+{
+    connectBatch = batchSize;
+    connectPause = batchPause;
+}
+
+double GatherV3Data::getConnectTimeout(double timeOut)
+{
+    return searchStatistics.timeout(timeOut);
+}
 
 void GatherV3Data::init()
 {
@@ -372,6 +447,7 @@ void GatherV3Data::init()
     pvtimeStamp.attach(pvStructure->getSubField("timeStamp"));
     pvalarm.attach(pvStructure->getSubField("alarm"));
     channel.resize(numberChannel);
+    connectIssued.resize(numberChannel);
     value.resize(numberChannel);
     isConnected.resize(numberChannel);
     secondsPastEpoch.resize(numberChannel);
@@ -395,6 +471,7 @@ void GatherV3Data::init()
     state = idle;
     numberConnected = 0;
     numberCallback = 0;
+    numberRequested = 0;
     requestOK = false;
     getCreated = false;
     putCreated = false;
@@ -423,9 +500,30 @@ bool GatherV3Data::connect(double timeOut)
     putCreated = false;
     atLeastOneGet = false;
     event.tryWait();
+    // Creating thousands of channels at once floods the subnet with searches,
+    // so they are created in batches with a pause in between.
+    // Every batch gets the full timeout counted from its creation,
+    // so the wait ends timeOut after the last batch.
+    timeOut = getConnectTimeout(timeOut);
     for(size_t i=0; i< numberChannel; i++) {
         isConnected[i] = false;
-        channel[i]->connect();
+    }
+    size_t batch = (connectBatch==0) ? numberChannel : connectBatch;
+    for(size_t first=0; first<numberChannel; first+=batch) {
+        if(first>0 && connectPause>0.0) epicsThreadSleep(connectPause);
+        size_t last = (first + batch < numberChannel) ? first + batch : numberChannel;
+        {
+            Lock xx(mutex);
+            epicsTimeStamp now;
+            epicsTimeGetCurrent(&now);
+            for(size_t i=first; i<last; i++) {
+                connectIssued[i] = now;
+            }
+        }
+        for(size_t i=first; i<last; i++) {
+            channel[i]->connect();
+        }
+        channelProvider->flush();
     }
     while(true) {
         size_t oldNumber = numberCallback;
@@ -452,7 +550,15 @@ bool GatherV3Data::connect(double timeOut)
         ss.str("");
         ss << numberChannel;
         buf += ss.str();
-        buf += " are not connected.";
+        buf += " are not connected:";
+        // the first few, the list can be long
+        size_t listed = 0;
+        for(size_t i=0; i<numberChannel && listed<10; i++) {
+            if(isConnected[i]) continue;
+            buf += " " + channelName[i];
+            ++listed;
+        }
+        if(listed < numberChannel - numberConnected) buf += " ...";
         message = buf;
         alarm.setMessage(message);
         alarm.setSeverity(invalidAlarm);
@@ -501,13 +607,20 @@ bool GatherV3Data::createGet()
     requestOK = true;
     message = std::string();
     event.tryWait();
-    for(size_t i=0; i< numberChannel; i++) {
-        if(isConnected[i]) {
-            channel[i]->createGet();
+    // only channels which connected since the last createGet need one
+    std::vector<size_t> offsets;
+    {
+        Lock xx(mutex);
+        for(size_t i=0; i< numberChannel; i++) {
+            if(isConnected[i] && !channel[i]->channelGet) offsets.push_back(i);
         }
+        numberRequested = offsets.size();
+    }
+    for(size_t i=0; i< offsets.size(); i++) {
+        channel[offsets[i]]->createGet();
     }
     channelProvider->flush();
-    event.wait();
+    if(!offsets.empty()) event.wait();
     getCreated = true;
     state = connected;
     return requestOK;
@@ -518,19 +631,26 @@ bool GatherV3Data::get()
     if(state!=connected) {
         throw std::logic_error("GatherV3Data::get illegal state\n");
     }
-    if(!getCreated) createGet();
+    // also creates the channelGet of channels which connected late
+    createGet();
     state = getting;
     numberCallback = 0;
     requestOK = true;
     message = std::string();
     event.tryWait();
-    for(size_t i=0; i< numberChannel; i++) {
-        if(isConnected[i]) {
-            channel[i]->get();
+    std::vector<size_t> offsets;
+    {
+        Lock xx(mutex);
+        for(size_t i=0; i< numberChannel; i++) {
+            if(isConnected[i] && channel[i]->channelGet) offsets.push_back(i);
         }
+        numberRequested = offsets.size();
+    }
+    for(size_t i=0; i< offsets.size(); i++) {
+        channel[offsets[i]]->get();
     }
     channelProvider->flush();
-    event.wait();
+    if(!offsets.empty()) event.wait();
     PVUnionArrayPtr pvValue = multiChannel->getValue();
     PVBooleanArrayPtr pvIsConnected = multiChannel->getIsConnected();
     PVLongArrayPtr pvSecondsPastEpoch = multiChannel->getSecondsPastEpoch();
@@ -616,6 +736,10 @@ bool GatherV3Data::createPut()
     requestOK = true;
     message = std::string();
     event.tryWait();
+    {
+        Lock xx(mutex);
+        numberRequested = numberConnected;
+    }
     for(size_t i=0; i< numberChannel; i++) {
         if(isConnected[i]) {
             channel[i]->createPut();
@@ -639,6 +763,10 @@ bool GatherV3Data::put()
     requestOK = true;
     message = std::string();
     event.tryWait();
+    {
+        Lock xx(mutex);
+        numberRequested = numberConnected;
+    }
     for(size_t i=0; i< numberChannel; i++) {
         if(isConnected[i]) {
             channel[i]->put();
@@ -17,6 +17,7 @@
 
 #include <epicsMutex.h>
 #include <epicsEvent.h>
+#include <epicsTime.h>
 
 #include <pv/lock.h>
 #include <pv/event.h>
@@ -136,8 +137,28 @@ public:
      * If not connected to all channels getMessage can be called to find out why.
      * isConnected shows the status of each channel.
      * Connect can not be called again until disconnect is called.
+     * Channels are created in batches, see setConnectBatch.
+     * Each batch is waited for at least timeOut seconds, longer if
+     * searches were seen to take longer, see getConnectTimeout.
      */
     bool connect(double timeOut);
+    /**
+     * Set how channels are created by connect.
+     * @param batchSize Number of channels created at once, 0 for all.
+     * @param batchPause Seconds between two batches.
+     * The defaults are taken from MASAR_CONNECT_BATCH (500)
+     * and MASAR_CONNECT_PAUSE (0.05).
+     */
+    void setConnectBatch(size_t batchSize, double batchPause);
+    /**
+     * Time to wait for a search answer.
+     * It follows the answer times seen by all connects of the process,
+     * mean plus four deviations, but is at least timeOut and at most
+     * the larger of timeOut and 10 seconds.
+     * @param timeOut Timeout requested by the caller.
+     * @returns the timeout in seconds.
+     */
+    static double getConnectTimeout(double timeOut);
     /**
      * destroy:
      */
@@ -153,6 +174,8 @@ public:
      * @returns (false,true) If (all, not all ) gets were successful.
      * If false getMessage can be called to get the reason.
      * If any channel is disconnected then false is returned.
+     * Channels which connected after the last get are included,
+     * their channelGet is created first.
      * Note that the values of each channels data (The array methods
      * below) are updated as a result of the get request and will not
      * change until the next get request is issued.
@@ -197,6 +220,10 @@ private:
     }
     void init();
     epics::pvAccess::ChannelProvider::shared_pointer channelProvider;
+    size_t connectBatch;
+    double connectPause;
+    // when the channel was created, cleared once its first connect is counted
+    std::vector<epicsTimeStamp> connectIssued;
     epics::nt::NTMultiChannelPtr multiChannel;
     const size_t numberChannel;
     epics::pvData::shared_vector<const std::string> channelName;
@@ -224,6 +251,8 @@ private:
     int state;
     size_t numberConnected;
     size_t numberCallback;
+    // channels sent the current request, whose callbacks are waited for
+    size_t numberRequested;
     bool requestOK;
     bool getCreated;
     bool atLeastOneGet;
@@ -27,6 +27,7 @@
 #include <pv/pvData.h>
 #include <pv/rpcServer.h>
 #include <pv/masarService.h>
+#include <pv/masarScheduler.h>
 
 using namespace std;
 using namespace epics::pvData;
@@ -64,6 +65,54 @@ static void threadRunner(void* usr)
     param.server->run(param.timeToRun);
 }
 
+static MasarScheduler::shared_pointer scheduler;
+
+static const iocshArg masarScheduleArg0 = {"configname", iocshArgString};
+static const iocshArg masarScheduleArg1 = {"period or trigger=PVNAME", iocshArgString};
+static const iocshArg masarScheduleArg2 = {"comment", iocshArgString};
+static const iocshArg * const masarScheduleArgs[] = {&masarScheduleArg0, &masarScheduleArg1, &masarScheduleArg2};
+static const iocshFuncDef masarScheduleDef = {"masarSchedule", 3, masarScheduleArgs};
+static void masarScheduleCall(const iocshArgBuf *args)
+{
+    if(!args[0].sval || !args[1].sval) {
+        cout << "usage: masarSchedule configname period|trigger=PVNAME [comment]" << endl;
+        return;
+    }
+    string when(args[1].sval);
+    string comment(args[2].sval ? args[2].sval : "");
+    try {
+        if(when.compare(0, 8, "trigger=") == 0) {
+            scheduler->addTrigger(args[0].sval, when.substr(8), comment);
+        } else {
+            scheduler->addPeriodic(args[0].sval, atof(when.c_str()), comment);
+        }
+    } catch(std::exception& e) {
+        cout << e.what() << endl;
+    }
+}
+
+static const iocshArg masarScheduleLoadArg0 = {"file", iocshArgString};
+static const iocshArg * const masarScheduleLoadArgs[] = {&masarScheduleLoadArg0};
+static const iocshFuncDef masarScheduleLoadDef = {"masarScheduleLoad", 1, masarScheduleLoadArgs};
+static void masarScheduleLoadCall(const iocshArgBuf *args)
+{
+    if(!args[0].sval) {
+        cout << "usage: masarScheduleLoad file" << endl;
+        return;
+    }
+    try {
+        scheduler->load(args[0].sval);
+    } catch(std::exception& e) {
+        cout << e.what() << endl;
+    }
+}
+
+static const iocshFuncDef masarScheduleReportDef = {"masarScheduleReport", 0, NULL};
+static void masarScheduleReportCall(const iocshArgBuf *)
+{
+    scheduler->report(cout);
+}
+
 int main(int argc,char *argv[])
 {
     ClientFactory::start();
@@ -82,6 +131,23 @@ int main(int argc,char *argv[])
     rpcServer->registerService(name, RPCService::shared_pointer(service));
     rpcServer->printInfo();
 
+    // snapshots are saved from within the service, see masarScheduler.h for the file format
+    const char *serviceName = getenv("MASAR_SERVICE_NAME");
+    scheduler.reset(new MasarScheduler(service, serviceName ? serviceName : "masar"));
+    const char *scheduleFile = getenv("MASAR_SCHEDULE");
+    if(argc>2) scheduleFile = argv[2];
+    if(scheduleFile && *scheduleFile) {
+        try {
+            scheduler->load(scheduleFile);
+        } catch(std::exception& e) {
+            cout << "===" << e.what() << endl;
+        }
+    }
+    scheduler->start();
+    iocshRegister(&masarScheduleDef, masarScheduleCall);
+    iocshRegister(&masarScheduleLoadDef, masarScheduleLoadCall);
+    iocshRegister(&masarScheduleReportDef, masarScheduleReportCall);
+
     cout << "===Starting channel RPC server: " << name << endl;
     cout << "===Use CTRl-D or exit() command to stop server." << endl;
 
@@ -100,6 +166,8 @@ int main(int argc,char *argv[])
     }
 
     iocsh(NULL);
+    scheduler->stop();
+    scheduler.reset();
     rpcServer->destroy();
     return (0);
 }
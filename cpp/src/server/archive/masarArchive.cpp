@@ -0,0 +1,369 @@
+/* masarArchive.cpp */
+/**
+ * Copyright - See the COPYRIGHT that is included with this distribution.
+ * This code is distributed subject to a Software License Agreement found
+ * in file LICENSE that is included with this distribution.
+ */
+
+#include <string>
+#include <stdexcept>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <db_access.h>
+
+#include <pv/pvData.h>
+#include <pv/nt.h>
+
+#include <pv/masarArchive.h>
+
+namespace epics { namespace masar {
+
+using namespace std;
+using namespace epics::pvData;
+using namespace epics::nt;
+
+static FieldCreatePtr fieldCreate = getFieldCreate();
+static PVDataCreatePtr pvDataCreate = getPVDataCreate();
+
+static const char headerMagic[8] = {'M','A','S','A','R','A','R','C'};
+static const char trailerMagic[8] = {'M','A','S','A','R','E','N','D'};
+// version 1 widens waveforms of char and short to int32 and of float to double,
+// version 2 keeps their native width,
+// version 3 keeps the narrowest width which holds the values, recorded per channel
+static const uint32 archiveVersion = 3;
+static const uint32 byteOrderMark = 0x01020304;
+static const size_t headerSize = 64;
+static const size_t trailerSize = 32;
+static const size_t indexEntrySize = 40;
+
+// columns of an event section, in the order of the offsets at its start
+enum Column {
+    nameColumn,         // uint32 string index
+    dbrTypeColumn,      // int32
+    isConnectedColumn,  // uint8
+    secondsColumn,      // int64
+    nanosecondsColumn,  // int32
+    userTagColumn,      // int32
+    severityColumn,     // int32
+    statusColumn,       // int32
+    messageColumn,      // uint32 string index
+    isArrayColumn,      // uint8
+    doubleValueColumn,  // double
+    longValueColumn,    // int32
+    stringValueColumn,  // uint32 string index
+    arrayOffsetColumn,  // uint64 file offset of the waveform
+    arrayLengthColumn,  // uint32 number of waveform elements
+    arrayTypeColumn,    // uint8 struct format character of the waveform elements, version 3
+    numberColumns
+};
+// the column offsets take 16 slots, which keeps the first column aligned
+static const size_t sectionHeaderSize = 16*sizeof(uint64);
+
+struct MasarArchive::Mapping
+{
+    Mapping() : base(0), length(0) {}
+    ~Mapping()
+    {
+        if(base) munmap((void*)base, length);
+    }
+    const char * base;
+    size_t length;
+};
+
+namespace {
+// Keeps the mapping alive as long as a shared_vector refers to it.
+struct MappingRef
+{
+    explicit MappingRef(std::tr1::shared_ptr<MasarArchive::Mapping> const & mapping) : mapping(mapping) {}
+    void operator()(const void *) {mapping.reset();}
+    std::tr1::shared_ptr<MasarArchive::Mapping> mapping;
+};
+
+template<typename T>
+T read(const char * ptr)
+{
+    T value;
+    memcpy(&value, ptr, sizeof(T));
+    return value;
+}
+}
+
+MasarArchive::MasarArchive()
+: device(0), inode(0), version(0)
+{}
+
+MasarArchive::~MasarArchive()
+{}
+
+void MasarArchive::check(uint64 offset, uint64 length) const
+{
+    if(offset > mapping->length || length > mapping->length - offset)
+        throw std::runtime_error("masar archive is corrupt");
+}
+
+template<typename T>
+shared_vector<const T> MasarArchive::column(uint64 offset, size_t count) const
+{
+    check(offset, count*sizeof(T));
+    if(count==0) return shared_vector<const T>();
+    const T * ptr = reinterpret_cast<const T*>(mapping->base + offset);
+    return shared_vector<const T>(ptr, MappingRef(mapping), 0, count);
+}
+
+MasarArchivePtr MasarArchive::open(string const & fileName)
+{
+    MasarArchivePtr archive(new MasarArchive());
+    archive->mapping.reset(new Mapping());
+
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if(fd<0)
+        throw std::runtime_error(string("can not open masar archive ")+fileName+": "+strerror(errno));
+    struct stat info;
+    if(fstat(fd, &info)!=0 || (size_t)info.st_size < headerSize+trailerSize) {
+        close(fd);
+        throw std::runtime_error(string("not a masar archive ")+fileName);
+    }
+    void * base = mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base==MAP_FAILED)
+        throw std::runtime_error(string("can not map masar archive ")+fileName+": "+strerror(errno));
+    archive->mapping->base = (const char*)base;
+    archive->mapping->length = info.st_size;
+    archive->fileName = fileName;
+    archive->device = info.st_dev;
+    archive->inode = info.st_ino;
+
+    const char * ptr = archive->mapping->base;
+    const char * trailer = ptr + info.st_size - trailerSize;
+    if(memcmp(ptr, headerMagic, sizeof(headerMagic))!=0
+            || memcmp(trailer+24, trailerMagic, sizeof(trailerMagic))!=0)
+        throw std::runtime_error(string("not a masar archive ")+fileName);
+    archive->version = read<uint32>(ptr+8);
+    if(archive->version<1 || archive->version>archiveVersion || read<uint32>(trailer+16)!=archive->version)
+        throw std::runtime_error(string("unsupported masar archive version ")+fileName);
+    if(read<uint32>(ptr+12)!=byteOrderMark)
+        throw std::runtime_error(string("masar archive written with another byte order ")+fileName);
+
+    // decode the string table once, events refer to it by index
+    uint64 offset = read<uint64>(trailer);
+    archive->check(offset, sizeof(uint32));
+    uint32 count = read<uint32>(ptr+offset);
+    offset += sizeof(uint32);
+    shared_vector<string> strings(count);
+    for(uint32 i=0; i<count; ++i) {
+        archive->check(offset, sizeof(uint32));
+        uint32 length = read<uint32>(ptr+offset);
+        offset += sizeof(uint32);
+        archive->check(offset, length);
+        strings[i].assign(ptr+offset, length);
+        offset += length;
+    }
+    archive->strings = freeze(strings);
+
+    offset = read<uint64>(trailer+8);
+    archive->check(offset, sizeof(uint32));
+    count = read<uint32>(ptr+offset);
+    offset += sizeof(uint32);
+    archive->check(offset, (uint64)count*indexEntrySize);
+    for(uint32 i=0; i<count; ++i, offset+=indexEntrySize) {
+        Event event;
+        event.offset = read<uint64>(ptr+offset+8);
+        event.numberChannels = read<uint32>(ptr+offset+16);
+        archive->check(event.offset, sectionHeaderSize);
+        archive->index[read<int64>(ptr+offset)] = event;
+    }
+    return archive;
+}
+
+bool MasarArchive::replaced() const
+{
+    struct stat info;
+    if(stat(fileName.c_str(), &info)!=0)
+        return false; // keep what is mapped
+    return (uint64)info.st_dev!=device || (uint64)info.st_ino!=inode;
+}
+
+bool MasarArchive::contains(int64 eventid) const
+{
+    return index.find(eventid)!=index.end();
+}
+
+NTMultiChannelPtr MasarArchive::retrieveSnapshot(int64 eventid) const
+{
+    std::map<int64, Event>::const_iterator it = index.find(eventid);
+    if(it==index.end())
+        throw std::runtime_error("event is not in the masar archive");
+    const Event & event = it->second;
+    size_t count = event.numberChannels;
+    const char * section = mapping->base + event.offset;
+    uint64 offsets[numberColumns];
+    for(int i=0; i<numberColumns; ++i) {
+        offsets[i] = read<uint64>(section + i*sizeof(uint64));
+    }
+
+    shared_vector<const uint32> name = column<uint32>(offsets[nameColumn], count);
+    shared_vector<const uint32> messageIndex = column<uint32>(offsets[messageColumn], count);
+    shared_vector<const int32> dbrType = column<int32>(offsets[dbrTypeColumn], count);
+    shared_vector<const uint8> isArray = column<uint8>(offsets[isArrayColumn], count);
+    shared_vector<const double> doubleValue = column<double>(offsets[doubleValueColumn], count);
+    shared_vector<const int32> longValue = column<int32>(offsets[longValueColumn], count);
+    shared_vector<const uint32> stringValue = column<uint32>(offsets[stringValueColumn], count);
+    shared_vector<const uint64> arrayOffset = column<uint64>(offsets[arrayOffsetColumn], count);
+    shared_vector<const uint32> arrayLength = column<uint32>(offsets[arrayLengthColumn], count);
+    shared_vector<const uint8> arrayType;
+    if(version>=3)
+        arrayType = column<uint8>(offsets[arrayTypeColumn], count);
+
+    shared_vector<string> channelName(count);
+    shared_vector<string> message(count);
+    shared_vector<PVUnionPtr> channelValue(count);
+    for(size_t i=0; i<count; ++i) {
+        if(name[i]>=strings.size() || messageIndex[i]>=strings.size())
+            throw std::runtime_error("masar archive is corrupt");
+        channelName[i] = strings[name[i]];
+        message[i] = strings[messageIndex[i]];
+        channelValue[i] = pvDataCreate->createPVVariantUnion();
+        int32 dbr = dbrType[i];
+        if(!isArray[i]) {
+            if(dbr==DBR_STRING || dbr==DBR_ENUM) {
+                if(stringValue[i]>=strings.size())
+                    throw std::runtime_error("masar archive is corrupt");
+                PVStringPtr pvString = pvDataCreate->createPVScalar<PVString>();
+                pvString->put(strings[stringValue[i]]);
+                channelValue[i]->set(pvString);
+            } else if (dbr==DBR_LONG) {
+                PVIntPtr pvInt = pvDataCreate->createPVScalar<PVInt>();
+                pvInt->put(longValue[i]);
+                channelValue[i]->set(pvInt);
+            } else if (dbr==DBR_INT) {
+                PVShortPtr pvShort = pvDataCreate->createPVScalar<PVShort>();
+                pvShort->put(longValue[i]);
+                channelValue[i]->set(pvShort);
+            } else if (dbr==DBR_CHAR) {
+                PVBytePtr pvByte = pvDataCreate->createPVScalar<PVByte>();
+                pvByte->put(longValue[i]);
+                channelValue[i]->set(pvByte);
+            } else if (dbr==DBR_FLOAT) {
+                PVFloatPtr pvFloat = pvDataCreate->createPVScalar<PVFloat>();
+                pvFloat->put(doubleValue[i]);
+                channelValue[i]->set(pvFloat);
+            } else if (dbr==DBR_DOUBLE) {
+                PVDoublePtr pvDouble = pvDataCreate->createPVScalar<PVDouble>();
+                pvDouble->put(doubleValue[i]);
+                channelValue[i]->set(pvDouble);
+            }
+        } else if(dbr==DBR_STRING) {
+            shared_vector<const uint32> elements = column<uint32>(arrayOffset[i], arrayLength[i]);
+            shared_vector<string> values(elements.size());
+            for(size_t j=0; j<elements.size(); ++j) {
+                if(elements[j]>=strings.size())
+                    throw std::runtime_error("masar archive is corrupt");
+                values[j] = strings[elements[j]];
+            }
+            PVStringArrayPtr pvStringArray = pvDataCreate->createPVScalarArray<PVStringArray>();
+            pvStringArray->replace(freeze(values));
+            channelValue[i]->set(pvStringArray);
+        } else if(version>=3) {
+            PVScalarArrayPtr pvArray;
+            switch(arrayType[i]) {
+            case 'b': {
+                PVByteArrayPtr pvByteArray = pvDataCreate->createPVScalarArray<PVByteArray>();
+                pvByteArray->replace(column<int8>(arrayOffset[i], arrayLength[i]));
+                pvArray = pvByteArray;
+                break;
+            }
+            case 'h': {
+                PVShortArrayPtr pvShortArray = pvDataCreate->createPVScalarArray<PVShortArray>();
+                pvShortArray->replace(column<int16>(arrayOffset[i], arrayLength[i]));
+                pvArray = pvShortArray;
+                break;
+            }
+            case 'i': {
+                PVIntArrayPtr pvIntArray = pvDataCreate->createPVScalarArray<PVIntArray>();
+                pvIntArray->replace(column<int32>(arrayOffset[i], arrayLength[i]));
+                pvArray = pvIntArray;
+                break;
+            }
+            case 'q': {
+                PVLongArrayPtr pvLongArray = pvDataCreate->createPVScalarArray<PVLongArray>();
+                pvLongArray->replace(column<int64>(arrayOffset[i], arrayLength[i]));
+                pvArray = pvLongArray;
+                break;
+            }
+            case 'f': {
+                PVFloatArrayPtr pvFloatArray = pvDataCreate->createPVScalarArray<PVFloatArray>();
+                pvFloatArray->replace(column<float>(arrayOffset[i], arrayLength[i]));
+                pvArray = pvFloatArray;
+                break;
+            }
+            case 'd': {
+                PVDoubleArrayPtr pvDoubleArray = pvDataCreate->createPVScalarArray<PVDoubleArray>();
+                pvDoubleArray->replace(column<double>(arrayOffset[i], arrayLength[i]));
+                pvArray = pvDoubleArray;
+                break;
+            }
+            case 0:
+                // dbr type without waveforms
+                break;
+            default:
+                throw std::runtime_error("masar archive is corrupt");
+            }
+            if(pvArray)
+                channelValue[i]->set(pvArray);
+        } else if(version>=2 && dbr==DBR_CHAR) {
+            PVByteArrayPtr pvByteArray = pvDataCreate->createPVScalarArray<PVByteArray>();
+            pvByteArray->replace(column<int8>(arrayOffset[i], arrayLength[i]));
+            channelValue[i]->set(pvByteArray);
+        } else if(version>=2 && dbr==DBR_INT) {
+            PVShortArrayPtr pvShortArray = pvDataCreate->createPVScalarArray<PVShortArray>();
+            pvShortArray->replace(column<int16>(arrayOffset[i], arrayLength[i]));
+            channelValue[i]->set(pvShortArray);
+        } else if(version>=2 && dbr==DBR_FLOAT) {
+            PVFloatArrayPtr pvFloatArray = pvDataCreate->createPVScalarArray<PVFloatArray>();
+            pvFloatArray->replace(column<float>(arrayOffset[i], arrayLength[i]));
+            channelValue[i]->set(pvFloatArray);
+        } else if(dbr==DBR_LONG || dbr==DBR_INT || dbr==DBR_CHAR) {
+            PVIntArrayPtr pvIntArray = pvDataCreate->createPVScalarArray<PVIntArray>();
+            pvIntArray->replace(column<int32>(arrayOffset[i], arrayLength[i]));
+            channelValue[i]->set(pvIntArray);
+        } else if(dbr==DBR_DOUBLE || dbr==DBR_FLOAT) {
+            PVDoubleArrayPtr pvDoubleArray = pvDataCreate->createPVScalarArray<PVDoubleArray>();
+            pvDoubleArray->replace(column<double>(arrayOffset[i], arrayLength[i]));
+            channelValue[i]->set(pvDoubleArray);
+        }
+    }
+
+    NTMultiChannelPtr multiChannel = NTMultiChannel::createBuilder()->
+            value(fieldCreate->createVariantUnion()) ->
+            addAlarm()->
+            addTimeStamp()->
+            addSeverity() ->
+            addIsConnected() ->
+            addStatus() ->
+            addMessage() ->
+            addSecondsPastEpoch() ->
+            addNanoseconds() ->
+            addUserTag() ->
+            add("dbrType",fieldCreate->createScalarArray(pvInt)) ->
+            create();
+    multiChannel->getChannelName()->replace(freeze(channelName));
+    multiChannel->getValue()->replace(freeze(channelValue));
+    multiChannel->getMessage()->replace(freeze(message));
+    multiChannel->getPVStructure()->getSubField<PVIntArray>("dbrType")->replace(dbrType);
+    multiChannel->getIsConnected()->replace(column<boolean>(offsets[isConnectedColumn], count));
+    multiChannel->getSecondsPastEpoch()->replace(column<int64>(offsets[secondsColumn], count));
+    multiChannel->getNanoseconds()->replace(column<int32>(offsets[nanosecondsColumn], count));
+    multiChannel->getUserTag()->replace(column<int32>(offsets[userTagColumn], count));
+    multiChannel->getSeverity()->replace(column<int32>(offsets[severityColumn], count));
+    multiChannel->getStatus()->replace(column<int32>(offsets[statusColumn], count));
+    return multiChannel;
+}
+
+}}
@@ -0,0 +1,90 @@
+/* masarArchive.h */
+/**
+ * Copyright - See the COPYRIGHT that is included with this distribution.
+ * This code is distributed subject to a Software License Agreement found
+ * in file LICENSE that is included with this distribution.
+ *
+ * Read only access to a masar archive file, as written by masarutils/archivemasar.py.
+ * Finished events are packed into fixed width typed columns, which are
+ * memory mapped and handed out as shared_vector without copying.
+ */
+#ifndef MASAR_ARCHIVE_H
+#define MASAR_ARCHIVE_H
+
+#include <string>
+#include <stdexcept>
+#include <map>
+
+#include <pv/pvData.h>
+#include <pv/ntmultiChannel.h>
+
+namespace epics { namespace masar {
+
+class MasarArchive;
+typedef std::tr1::shared_ptr<MasarArchive> MasarArchivePtr;
+
+/**
+ * File layout, all numbers in host byte order, offsets counted from the file start:
+ *  - header (64 bytes): magic "MASARARC", version, byte order mark
+ *    (version 3 keeps each waveform in the narrowest width holding its values,
+ *    version 2 in the native width of its dbr type, version 1 widens them)
+ *  - one section per event, starting with the offsets of its columns,
+ *    each column and each waveform aligned to 64 bytes
+ *  - string table: every channel name, alarm message, string value and event property once
+ *  - event index: event id, section offset, channel count and event properties
+ *  - trailer (32 bytes): string table offset, index offset, version, magic "MASAREND"
+ * Event sections are never modified, new events are appended in front of a rewritten table and index.
+ */
+class MasarArchive
+{
+public:
+    POINTER_DEFINITIONS(MasarArchive);
+    /**
+     * Map an archive file.
+     * Throws std::runtime_error if the file can not be mapped or is not a valid archive.
+     */
+    static MasarArchivePtr open(std::string const & fileName);
+    ~MasarArchive();
+    /**
+     * Has the file been replaced since it was mapped, by archivemasar.py renaming a new one over it?
+     * The old mapping stays valid, open() maps the new file.
+     */
+    bool replaced() const;
+    /**
+     * Is the event packed in this archive?
+     */
+    bool contains(epics::pvData::int64 eventid) const;
+    /**
+     * Number of packed events.
+     */
+    size_t size() const {return index.size();}
+    /**
+     * Get a snapshot in the same form as a retrieveSnapshot from the database.
+     * Numeric columns and numeric waveforms refer to the mapped file.
+     */
+    epics::nt::NTMultiChannelPtr retrieveSnapshot(epics::pvData::int64 eventid) const;
+    struct Mapping;
+private:
+    struct Event
+    {
+        epics::pvData::uint64 offset;
+        epics::pvData::uint32 numberChannels;
+    };
+    MasarArchive();
+    template<typename T>
+    epics::pvData::shared_vector<const T> column(epics::pvData::uint64 offset, size_t count) const;
+    void check(epics::pvData::uint64 offset, epics::pvData::uint64 length) const;
+
+    std::tr1::shared_ptr<Mapping> mapping;
+    std::string fileName;
+    // identity of the mapped file
+    epics::pvData::uint64 device;
+    epics::pvData::uint64 inode;
+    epics::pvData::uint32 version;
+    epics::pvData::shared_vector<const std::string> strings;
+    std::map<epics::pvData::int64, Event> index;
+};
+
+}}
+
+#endif  /* MASAR_ARCHIVE_H */
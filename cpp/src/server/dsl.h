@@ -13,16 +13,46 @@
 
 #include <string>
 #include <stdexcept>
+#include <vector>
 
 #include <pv/pvData.h>
 #include <pv/sharedVector.h>
 #include <pv/destroyable.h>
+#include <pv/masarMetrics.h>
 
 
 namespace epics { namespace masar{
 
 class DSL;
 typedef std::tr1::shared_ptr<DSL> DSLPtr;
+
+/**
+ * Description of a function served by a Data Source Layer.
+ */
+struct DSLFunction
+{
+    /**
+     * Kind of work a function does, so that requests can be scheduled per kind.
+     */
+    enum Lane {
+        queryLane,      // reads the database only
+        machineLane,    // reads the IOCs
+        writeLane       // writes the database
+    };
+    std::string name;
+    /**
+     * Arguments the function understands, or "*" for any.
+     * Other arguments are passed along and ignored, and reported once.
+     */
+    std::vector<std::string> arguments;
+    bool readOnly;
+    bool touchesMachine;
+    Lane lane;
+    /**
+     * Stage latencies of the calls of this function.
+     */
+    FunctionMetricsPtr metrics;
+};
 /**
  * DSL - Data Source Layer
  * This is the interface that the Data Source Layer must implement
@@ -44,6 +74,11 @@ public:
         std::string const &function,
         epics::pvData::shared_vector<const std::string> const & names,
         epics::pvData::shared_vector<const std::string> const & values) = 0;
+    /**
+     * Look up a function by name.
+     * @return The description, or 0 if the function is not served.
+     */
+    virtual const DSLFunction * getFunction(std::string const &function) const = 0;
 };
 
 }}
@@ -13,12 +13,25 @@
 #include <stdexcept>
 #include <memory>
 #include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <limits>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
 
 #include <db_access.h>
+#include <epicsTime.h>
+#include <epicsThread.h>
 
+#include <pv/lock.h>
 #include <pv/pvIntrospect.h>
 #include <pv/pvData.h>
+#include <pv/standardField.h>
 #include <pv/dsl.h>
+#include <pv/masarArchive.h>
+#include <pv/masarMetrics.h>
 #include <pv/nt.h>
 #include <pv/rpcService.h>
 
@@ -36,6 +49,79 @@ using std::tr1::static_pointer_cast;
 static FieldCreatePtr fieldCreate = getFieldCreate();
 static PVDataCreatePtr pvDataCreate = getPVDataCreate();
 
+/**
+ * Single flight gathers.
+ * Concurrent gathers of the same channel list share one GatherV3Data cycle,
+ * the first caller runs it and the others wait for its result.
+ * A successful result stays valid for 'window' seconds,
+ * so callers arriving shortly after it are served without a new cycle.
+ * Every caller gets its own copy, which it is free to modify.
+ *
+ * Configs are gathered through a pool of GatherV3Data, one per config,
+ * which stay connected between gathers, so that only the first gather
+ * of a config pays the channel searches. warm() pays them ahead.
+ * A pooled GatherV3Data is kept while some of its channels are disconnected,
+ * CA connects them again by itself. It is replaced when the channel list
+ * of its config changes, or when its connect or get fails.
+ */
+class GatherCoalescer
+{
+public:
+    POINTER_DEFINITIONS(GatherCoalescer);
+    explicit GatherCoalescer(double window) : window(window) {}
+    /**
+     * @param config Key of the config the channels belong to, see configKey.
+     * Empty if they do not belong to a config, then the pool is not used.
+     */
+    NTMultiChannelPtr gather(shared_vector<const string> const & channelName, FunctionMetrics * metrics = 0,
+        string const & config = string());
+    /**
+     * Connect the channels of a config into the pool, if they are not yet,
+     * and optionally create their ChannelGet.
+     * @return The number of connected channels.
+     */
+    size_t warm(string const & config, shared_vector<const string> const & channelName,
+        double timeout, bool createGet);
+private:
+    struct Pooled
+    {
+        // held while the GatherV3Data is used
+        Mutex lock;
+        // the channel list the GatherV3Data was created for
+        string channels;
+        GatherV3DataPtr gather;
+    };
+    typedef std::tr1::shared_ptr<Pooled> PooledPtr;
+    PooledPtr getPooled(string const & config);
+    bool connectPooled(Pooled & pooled, string const & channels, shared_vector<const string> const & channelName,
+        double timeout, FunctionMetrics * metrics);
+    NTMultiChannelPtr gatherPooled(string const & config, string const & channels,
+        shared_vector<const string> const & channelName, bool * ok, FunctionMetrics * metrics);
+
+    struct Flight
+    {
+        Flight() : done(false), ok(false) {}
+        // held by the running gather
+        Mutex running;
+        bool done;
+        bool ok;
+        epicsTimeStamp finished;
+        NTMultiChannelPtr result;
+    };
+    typedef std::tr1::shared_ptr<Flight> FlightPtr;
+
+    bool valid(FlightPtr const & flight, epicsTimeStamp const & now) const
+    {
+        if(!flight->done) return true;
+        return flight->ok && epicsTimeDiffInSeconds(&now, &flight->finished) < window;
+    }
+
+    const double window;
+    Mutex mutex;
+    std::map<string, FlightPtr> flights;
+    std::map<string, PooledPtr> pool;
+};
+
 class DSL_RDB;
 typedef std::tr1::shared_ptr<DSL_RDB> DSL_RDBPtr;
 
@@ -50,6 +136,7 @@ public:
     virtual void destroy();
     virtual PVStructurePtr request(
         string const & functionName,shared_vector<const string> const &names,shared_vector<const string> const &values);
+    virtual const DSLFunction * getFunction(string const & functionName) const;
     bool init();
 private:
     DSL_RDBPtr getPtrSelf()
@@ -57,12 +144,89 @@ private:
         return shared_from_this();
     }
 
+    struct Handler;
+    typedef PVStructurePtr (DSL_RDB::*Call)(Handler const & handler,
+        shared_vector<const string> const & names, shared_vector<const string> const & values);
+    // throws std::runtime_error if an argument value is not acceptable
+    typedef void (*Check)(shared_vector<const string> const & names, shared_vector<const string> const & values);
+    struct Handler
+    {
+        DSLFunction function;
+        Call call;
+        // number of leading int64 columns of an NTTable reply
+        long numeric;
+        Check check;
+    };
+    void addFunction(const char * name, const char * arguments,
+        bool readOnly, bool touchesMachine, DSLFunction::Lane lane,
+        Call call, long numeric = 0, Check check = 0);
+    void addFunctions();
+    void checkArguments(Handler const & handler, shared_vector<const string> const & names);
+
+    PyObject * callPython(Handler const & handler, PyObj & result,
+        shared_vector<const string> const & names, shared_vector<const string> const & values);
+    PVStructurePtr callLiveMachine(Handler const & handler,
+        shared_vector<const string> const & names, shared_vector<const string> const & values);
+    PVStructurePtr callRetrieveSnapshot(Handler const & handler,
+        shared_vector<const string> const & names, shared_vector<const string> const & values);
+    PVStructurePtr callUpdateSnapshotEvent(Handler const & handler,
+        shared_vector<const string> const & names, shared_vector<const string> const & values);
+    PVStructurePtr callSaveSnapshot(Handler const & handler,
+        shared_vector<const string> const & names, shared_vector<const string> const & values);
+    PVStructurePtr callTable(Handler const & handler,
+        shared_vector<const string> const & names, shared_vector<const string> const & values);
+    PVStructurePtr callChannelHistory(Handler const & handler,
+        shared_vector<const string> const & names, shared_vector<const string> const & values);
+    PVStructurePtr callServiceMetrics(Handler const & handler,
+        shared_vector<const string> const & names, shared_vector<const string> const & values);
+    PVStructurePtr callServiceStatus(Handler const & handler,
+        shared_vector<const string> const & names, shared_vector<const string> const & values);
+
+    static void warmUpMain(void * arg);
+    void warmUp();
+
+    // served functions by name, filled once by init()
+    std::map<string, Handler> handlers;
+
+    shared_vector<const string> getChannelNames(PyObject * pyTuple,
+        shared_vector<const string> const & names, shared_vector<const string> const & values);
+
     PyObject * prequest;
     PyObject * pgetchannames;
+    PyObject * pgetchannamesstamp;
+    PyObject * pactiveconfigs;
+    struct ChannelList
+    {
+        long stamp;
+        shared_vector<const string> names;
+    };
+    // resolved channel names per service and config, only accessed with the GIL held
+    std::map<string, ChannelList> channelLists;
+    MasarArchivePtr currentArchive();
+    // finished events packed by masarutils/archivemasar.py, or empty.
+    // Mapped again when the file is replaced, guarded by archiveMutex
+    Mutex archiveMutex;
+    string archiveFile;
+    MasarArchivePtr archive;
+    std::tr1::shared_ptr<GatherCoalescer> liveGather;
+    struct WarmState
+    {
+        string configName;
+        size_t channels;
+        size_t connected;
+        string state;
+    };
+    // progress of the startup warm up, guarded by warmMutex
+    Mutex warmMutex;
+    std::vector<WarmState> warmStates;
+    bool warmDone;
+    // function and argument of the undeclared arguments reported so far, guarded by argumentMutex
+    Mutex argumentMutex;
+    std::set<string> reportedArguments;
 };
 
 DSL_RDB::DSL_RDB()
-    : DSL(),prequest(0), pgetchannames(0)
+    : DSL(),prequest(0), pgetchannames(0), pgetchannamesstamp(0), pactiveconfigs(0), warmDone(false)
 {
    PyThreadState *py_tstate = NULL;
    Py_Initialize();
@@ -76,6 +240,8 @@ DSL_RDB::~DSL_RDB()
     PyGILState_STATE gstate = PyGILState_Ensure();
     if(prequest!=0) Py_XDECREF(prequest);
     if(pgetchannames!=0) Py_XDECREF(pgetchannames);
+    if(pgetchannamesstamp!=0) Py_XDECREF(pgetchannamesstamp);
+    if(pactiveconfigs!=0) Py_XDECREF(pactiveconfigs);
     PyGILState_Release(gstate);
     PyGILState_Ensure();
     Py_Finalize();
@@ -83,6 +249,12 @@ DSL_RDB::~DSL_RDB()
 
 bool DSL_RDB::init()
 {
+    addFunctions();
+
+    // seconds a gathered result is shared with later requests for the same channels
+    const char * window = getenv("MASAR_GATHER_WINDOW");
+    liveGather.reset(new GatherCoalescer(window ? atof(window) : 0.0));
+
     PyGILState_STATE gstate = PyGILState_Ensure();
     PyObject * module = PyImport_ImportModule("masarserver.dslPY");
     if(module==0) {
@@ -132,15 +304,109 @@ bool DSL_RDB::init()
         Py_XDECREF(module);
         return false;
     }
+    // optional, without it channel names are read again for every snapshot
+    pgetchannamesstamp = PyObject_GetAttrString(pinstance, "retrieveChannelNamesStamp");
+    if(pgetchannamesstamp==0) PyErr_Clear();
+    // optional, without it there is no warm up
+    pactiveconfigs = PyObject_GetAttrString(pinstance, "retrieveActiveConfigs");
+    if(pactiveconfigs==0) PyErr_Clear();
     Py_XDECREF(pinstance);
     Py_XDECREF(pclass);
     Py_XDECREF(module);
     PyGILState_Release(gstate);
+
+    const char * archiveName = getenv("MASAR_ARCHIVE");
+    if(archiveName && *archiveName) {
+        // without the archive all events are still served from the database
+        archiveFile = archiveName;
+        try {
+            archive = MasarArchive::open(archiveFile);
+            cout << "DSL_RDB::init " << archive->size() << " events in archive " << archiveFile << endl;
+        } catch(std::exception& e) {
+            cout << "DSL_RDB::init " << e.what() << endl;
+        }
+    }
+
+    // MASAR_WARMUP=0 disables the warm up, =connect leaves out the ChannelGets
+    const char * warm = getenv("MASAR_WARMUP");
+    if(pactiveconfigs!=0 && !(warm && strcmp(warm, "0")==0)) {
+        epicsThreadCreate("masarWarmUp",
+                          epicsThreadPriorityLow,
+                          epicsThreadGetStackSize(epicsThreadStackBig),
+                          warmUpMain, new DSL_RDBPtr(getPtrSelf()));
+    } else {
+        warmDone = true;
+    }
     return true;
 }
 
 void DSL_RDB::destroy() {}
 
+/**
+ * The service of requests which name none, MASAR_SERVICE_NAME or masar.
+ */
+static string defaultServiceName()
+{
+    const char * service = getenv("MASAR_SERVICE_NAME");
+    return service ? service : "masar";
+}
+
+/**
+ * Key of the config of a request: its service and config name.
+ */
+static string configKey(shared_vector<const string> const & names, shared_vector<const string> const & values)
+{
+    string service(defaultServiceName()), config;
+    for (size_t i = 0; i < names.size(); i ++) {
+        if (names[i].compare("servicename")==0) service = values[i];
+        else if (names[i].compare("configname")==0) config = values[i];
+    }
+    return service + '\n' + config;
+}
+
+/**
+ * Get the channel names of the config of a saveSnapshot request.
+ * The list is kept per service and config, and is read again
+ * only when the version stamp of the config has changed.
+ * Must be called with the GIL held. Returns an empty list on failure.
+ */
+shared_vector<const string> DSL_RDB::getChannelNames(PyObject * pyTuple,
+    shared_vector<const string> const & names, shared_vector<const string> const & values)
+{
+    string key(configKey(names, values));
+
+    long stamp = -1;
+    if (pgetchannamesstamp!=0) {
+        PyObject * pstamp = PyEval_CallObject(pgetchannamesstamp, pyTuple);
+        if (pstamp == NULL) {
+            PyErr_Clear();
+        } else {
+            stamp = PyInt_AsLong(pstamp);
+            Py_DECREF(pstamp);
+        }
+    }
+    if (stamp >= 0) {
+        std::map<string, ChannelList>::const_iterator it = channelLists.find(key);
+        if (it!=channelLists.end() && it->second.stamp==stamp) return it->second.names;
+    }
+
+    PyObject *pchannelnames = PyEval_CallObject(pgetchannames, pyTuple);
+    if (pchannelnames == NULL) return shared_vector<const string>();
+    Py_ssize_t list_len = PyList_Size(pchannelnames);
+    shared_vector<string> channames(list_len);
+    for (ssize_t i = 0; i < list_len; i ++) {
+        channames[i] = PyString_AsString(PyList_GetItem(pchannelnames, i));
+    }
+    Py_DECREF(pchannelnames);
+    shared_vector<const string> channelNames(freeze(channames));
+    if (stamp >= 0 && channelNames.size() > 0) {
+        ChannelList & list = channelLists[key];
+        list.stamp = stamp;
+        list.names = channelNames;
+    }
+    return channelNames;
+}
+
 static NTMultiChannelPtr noDataMultiChannel(std::string message) {
     NTMultiChannelBuilderPtr builder = NTMultiChannel::createBuilder();
     NTMultiChannelPtr ntMultiChannel = builder->
@@ -170,33 +436,447 @@ static NTMultiChannelPtr noDataMultiChannel(std::string message) {
     return ntMultiChannel;
 }
 
-static NTMultiChannelPtr getLiveMachine(shared_vector<const string> const & channelName)
+static NTMultiChannelPtr getLiveMachine(shared_vector<const string> const & channelName, bool * ok = 0,
+    FunctionMetrics * metrics = 0)
 {
     GatherV3DataPtr gather = GatherV3Data::create(channelName);
 
+    if(ok) *ok = false;
+    StageTimer connect(metrics, FunctionMetrics::gatherConnectStage);
     // wait one second, which is a magic number for now.
     // The waiting time might be removed later after stability test.
     bool result = gather->connect(1.0);
+    connect.stop();
     if(!result) {
         return noDataMultiChannel("connect failed");
     }
+    StageTimer get(metrics, FunctionMetrics::gatherGetStage);
     result = gather->get();
+    get.stop();
     if(!result) {
         return noDataMultiChannel("get failed");
     }
     NTMultiChannelPtr ntmultiChannel = gather->getNTMultiChannel();
 
     gather->destroy();
+    if(ok) *ok = true;
     return ntmultiChannel;
 }
 
+static size_t countConnected(GatherV3DataPtr const & gather)
+{
+    PVBooleanArray::const_svector isConnected = gather->getNTMultiChannel()->getIsConnected()->view();
+    size_t count = 0;
+    for(size_t i=0; i<isConnected.size(); ++i) {
+        if(isConnected[i]) ++count;
+    }
+    return count;
+}
+
+static string channelsKey(shared_vector<const string> const & channelName)
+{
+    string key;
+    for(size_t i=0; i<channelName.size(); ++i) {
+        key += channelName[i];
+        key += '\n';
+    }
+    return key;
+}
+
+GatherCoalescer::PooledPtr GatherCoalescer::getPooled(string const & config)
+{
+    Lock guard(mutex);
+    PooledPtr & pooled = pool[config];
+    if(!pooled) pooled.reset(new Pooled());
+    return pooled;
+}
+
+/**
+ * Make sure the pooled GatherV3Data is connected for the channels,
+ * the one of an older channel list is destroyed first.
+ * Must be called with pooled.lock held.
+ * @return false if none of the channels connected.
+ */
+bool GatherCoalescer::connectPooled(Pooled & pooled, string const & channels,
+    shared_vector<const string> const & channelName, double timeout, FunctionMetrics * metrics)
+{
+    if(pooled.gather && pooled.channels!=channels) {
+        pooled.gather->destroy();
+        pooled.gather.reset();
+    }
+    if(pooled.gather) return true;
+    GatherV3DataPtr gather = GatherV3Data::create(channelName);
+    StageTimer connect(metrics, FunctionMetrics::gatherConnectStage);
+    bool connected = gather->connect(timeout);
+    connect.stop();
+    if(!connected) {
+        gather->destroy();
+        return false;
+    }
+    pooled.channels = channels;
+    pooled.gather = gather;
+    return true;
+}
+
+size_t GatherCoalescer::warm(string const & config, shared_vector<const string> const & channelName,
+    double timeout, bool createGet)
+{
+    PooledPtr pooled = getPooled(config);
+    Lock hold(pooled->lock);
+    bool created = !pooled->gather;
+    if(!connectPooled(*pooled, channelsKey(channelName), channelName, timeout, 0)) return 0;
+    // channels connecting later get theirs with the first get
+    if(createGet && created) pooled->gather->createGet();
+    return countConnected(pooled->gather);
+}
+
+/**
+ * Like getLiveMachine, through the pooled GatherV3Data of a config.
+ */
+NTMultiChannelPtr GatherCoalescer::gatherPooled(string const & config, string const & channels,
+    shared_vector<const string> const & channelName, bool * ok, FunctionMetrics * metrics)
+{
+    PooledPtr pooled = getPooled(config);
+    Lock hold(pooled->lock);
+    if(ok) *ok = false;
+    if(!connectPooled(*pooled, channels, channelName, 1.0, metrics)) {
+        return noDataMultiChannel("connect failed");
+    }
+    GatherV3DataPtr gather = pooled->gather;
+    StageTimer get(metrics, FunctionMetrics::gatherGetStage);
+    bool result = gather->get();
+    get.stop();
+    // the next get overwrites the data of the GatherV3Data
+    NTMultiChannelPtr ntmultiChannel = NTMultiChannel::wrap(
+        pvDataCreate->createPVStructure(gather->getNTMultiChannel()->getPVStructure()));
+    if(!result) {
+        // connected again by the next gather
+        gather->destroy();
+        pooled->gather.reset();
+        return noDataMultiChannel("get failed");
+    }
+    if(ok) *ok = true;
+    return ntmultiChannel;
+}
+
+NTMultiChannelPtr GatherCoalescer::gather(shared_vector<const string> const & channelName, FunctionMetrics * metrics,
+    string const & config)
+{
+    string key = channelsKey(channelName);
+
+    FlightPtr flight;
+    bool leader = false;
+    {
+        Lock guard(mutex);
+        epicsTimeStamp now;
+        epicsTimeGetCurrent(&now);
+        std::map<string, FlightPtr>::iterator it = flights.begin();
+        while(it!=flights.end()) {
+            if(valid(it->second, now)) {
+                ++it;
+            } else {
+                flights.erase(it++);
+            }
+        }
+        it = flights.find(key);
+        if(it!=flights.end()) {
+            flight = it->second;
+        } else {
+            flight.reset(new Flight());
+            flight->running.lock();
+            flights[key] = flight;
+            leader = true;
+        }
+    }
+
+    if(leader) {
+        bool ok = false;
+        NTMultiChannelPtr result;
+        try {
+            if(!config.empty()) {
+                result = gatherPooled(config, key, channelName, &ok, metrics);
+            } else {
+                result = getLiveMachine(channelName, &ok, metrics);
+            }
+        } catch(std::exception& e) {
+            // waiters must not be left behind
+            result = noDataMultiChannel(e.what());
+        }
+        {
+            Lock guard(mutex);
+            flight->result = result;
+            flight->ok = ok;
+            flight->done = true;
+            epicsTimeGetCurrent(&flight->finished);
+        }
+        flight->running.unlock();
+    } else {
+        // wait for the leader
+        Lock wait(flight->running);
+    }
+
+    NTMultiChannelPtr result;
+    {
+        Lock guard(mutex);
+        result = flight->result;
+    }
+    return NTMultiChannel::wrap(pvDataCreate->createPVStructure(result->getPVStructure()));
+}
+
+/**
+ * Copy the elements of an array.array, which are of type T.
+ */
+template<typename T>
+static PVFieldPtr bufferArray(PyObject * value)
+{
+    const void * buffer = 0;
+    Py_ssize_t length = 0;
+    if(PyObject_AsReadBuffer(value, &buffer, &length)!=0) {
+        PyErr_Clear();
+        return PVFieldPtr();
+    }
+    shared_vector<T> values(length/sizeof(T));
+    if(!values.empty()) memcpy(values.data(), buffer, values.size()*sizeof(T));
+    typename PVValueArray<T>::shared_pointer pvArray =
+        pvDataCreate->createPVScalarArray<PVValueArray<T> >();
+    pvArray->replace(freeze(values));
+    return pvArray;
+}
+
+/**
+ * Convert a numeric array which the database unpacked into an array.array.
+ * The pvData element type follows the type code, so int8, int16 and float32
+ * waveforms keep their width.
+ */
+static PVFieldPtr packedArray(PyObject * value)
+{
+    PyObject * typecode = PyObject_GetAttrString(value, "typecode");
+    if(typecode==NULL) {
+        PyErr_Clear();
+        return PVFieldPtr();
+    }
+    const char * code = PyString_AsString(typecode);
+    char type = code ? code[0] : 0;
+    Py_DECREF(typecode);
+    switch(type) {
+    case 'b': return bufferArray<int8>(value);
+    case 'h': return bufferArray<int16>(value);
+    case 'i': return bufferArray<int32>(value);
+    case 'l': return (sizeof(long)==sizeof(int64)) ? bufferArray<int64>(value) : bufferArray<int32>(value);
+    case 'f': return bufferArray<float>(value);
+    case 'd': return bufferArray<double>(value);
+    }
+    PyErr_Clear();
+    return PVFieldPtr();
+}
+
+/**
+ * Convert a list or tuple of numbers into an array of floating point element type T.
+ */
+template<typename T>
+static PVFieldPtr sequenceArray(PyObject * value)
+{
+    Py_ssize_t length = PySequence_Fast_GET_SIZE(value);
+    PyObject ** items = PySequence_Fast_ITEMS(value);
+    shared_vector<T> values(length);
+    for(Py_ssize_t i=0; i<length; i++) {
+        values[i] = (T)PyFloat_AsDouble(items[i]);
+    }
+    typename PVValueArray<T>::shared_pointer pvArray =
+        pvDataCreate->createPVScalarArray<PVValueArray<T> >();
+    pvArray->replace(freeze(values));
+    return pvArray;
+}
+
+template<typename T>
+static PVFieldPtr narrowArray(shared_vector<const int64> const & wide)
+{
+    shared_vector<T> values(wide.size());
+    std::copy(wide.begin(), wide.end(), values.begin());
+    typename PVValueArray<T>::shared_pointer pvArray =
+        pvDataCreate->createPVScalarArray<PVValueArray<T> >();
+    pvArray->replace(freeze(values));
+    return pvArray;
+}
+
+template<typename T>
+static bool fits(int64 low, int64 high)
+{
+    return low>=std::numeric_limits<T>::min() && high<=std::numeric_limits<T>::max();
+}
+
+/**
+ * Convert a list or tuple of integers into an array of the narrowest element type,
+ * starting from T, which holds all of them, as packArray picks the array type code.
+ * Throws std::runtime_error for a value which does not fit int64.
+ */
+template<typename T>
+static PVFieldPtr integerArray(PyObject * value)
+{
+    Py_ssize_t length = PySequence_Fast_GET_SIZE(value);
+    PyObject ** items = PySequence_Fast_ITEMS(value);
+    shared_vector<int64> values(length);
+    int64 low = 0, high = 0;
+    for(Py_ssize_t i=0; i<length; i++) {
+        values[i] = PyLong_AsLongLong(items[i]);
+        if(values[i]==-1 && PyErr_Occurred()) {
+            PyErr_Clear();
+            throw std::runtime_error("waveform value is not a 64 bit integer");
+        }
+        low = std::min(low, values[i]);
+        high = std::max(high, values[i]);
+    }
+    shared_vector<const int64> wide(freeze(values));
+    if(fits<T>(low, high)) return narrowArray<T>(wide);
+    if(sizeof(T)<sizeof(int16) && fits<int16>(low, high)) return narrowArray<int16>(wide);
+    if(sizeof(T)<sizeof(int32) && fits<int32>(low, high)) return narrowArray<int32>(wide);
+    PVLongArrayPtr pvLongArray = pvDataCreate->createPVScalarArray<PVLongArray>();
+    pvLongArray->replace(wide);
+    return pvLongArray;
+}
+
+/**
+ * Convert the value columns of one masar data row into a PVField.
+ * first is the index of the 'pv name' column in the row tuple,
+ * the other columns follow in the order used by retrieveSnapshot.
+ * Numbers keep the element type of their dbr type, see widenSnapshot,
+ * except integer waveforms with values too wide for it.
+ * Returns an empty pointer when the stored dbr type has no mapping.
+ */
+static PVFieldPtr snapshotValue(PyObject * sublist, Py_ssize_t first, int32 dbr_type)
+{
+    int32 is_array = PyLong_AsLong(PyTuple_GetItem(sublist, first+12));
+    bool isArray = (is_array==0) ? false : true;
+    if(!isArray) {
+        if(dbr_type==DBR_STRING || dbr_type==DBR_ENUM) {
+            char * str = PyString_AsString(PyTuple_GetItem(sublist, first+1));
+            PVStringPtr pvString = pvDataCreate->createPVScalar<PVString>();
+            pvString->put(str);
+            return pvString;
+        } else if (dbr_type==DBR_LONG) {
+            int32 val = PyLong_AsLong(PyTuple_GetItem(sublist, first+3));
+            PVIntPtr pvInt = pvDataCreate->createPVScalar<PVInt>();
+            pvInt->put(val);
+            return pvInt;
+        } else if (dbr_type==DBR_INT) {
+            PVShortPtr pvShort = pvDataCreate->createPVScalar<PVShort>();
+            pvShort->put(PyLong_AsLong(PyTuple_GetItem(sublist, first+3)));
+            return pvShort;
+        } else if (dbr_type==DBR_CHAR) {
+            PVBytePtr pvByte = pvDataCreate->createPVScalar<PVByte>();
+            pvByte->put(PyLong_AsLong(PyTuple_GetItem(sublist, first+3)));
+            return pvByte;
+        } else if(dbr_type==DBR_FLOAT) {
+            PVFloatPtr pvFloat = pvDataCreate->createPVScalar<PVFloat>();
+            pvFloat->put(PyFloat_AsDouble(PyTuple_GetItem(sublist, first+2)));
+            return pvFloat;
+        } else if(dbr_type==DBR_DOUBLE) {
+            double val = PyFloat_AsDouble(PyTuple_GetItem(sublist, first+2));
+            PVDoublePtr pvDouble = pvDataCreate->createPVScalar<PVDouble>();
+            pvDouble->put(val);
+            return pvDouble;
+        }
+    } else {
+        PyObject * arrayValueList = PyTuple_GetItem(sublist, first+13);
+        if(dbr_type==DBR_STRING) {
+            shared_vector<string> values;
+            if (PyList_Check(arrayValueList)) {
+                size_t array_len = (size_t)PyList_Size(arrayValueList);
+                values.resize(array_len);
+                for (size_t i = 0; i < array_len; i++){
+                    char * str = PyString_AsString(PyList_GetItem(arrayValueList, i));
+                    values[i] = string(str);;
+                }
+            } else if (PyTuple_Check(arrayValueList)) {
+                size_t array_len = (size_t)PyTuple_Size(arrayValueList);
+                values.resize(array_len);
+                for (size_t i = 0; i < array_len; i++){
+                    char * str = PyString_AsString(PyTuple_GetItem(arrayValueList, i));
+                    values[i] = string(str);;
+                }
+            }
+            PVStringArrayPtr pvStringArray = pvDataCreate->createPVScalarArray<PVStringArray>();
+            pvStringArray->replace(freeze(values));
+            return pvStringArray;
+        }
+        if(!PyList_Check(arrayValueList) && !PyTuple_Check(arrayValueList)) {
+            // packed by the database, already in its native element type
+            return packedArray(arrayValueList);
+        }
+        if(dbr_type==DBR_CHAR) return integerArray<int8>(arrayValueList);
+        if(dbr_type==DBR_INT) return integerArray<int16>(arrayValueList);
+        if(dbr_type==DBR_LONG) return integerArray<int32>(arrayValueList);
+        if(dbr_type==DBR_FLOAT) return sequenceArray<float>(arrayValueList);
+        if(dbr_type==DBR_DOUBLE) return sequenceArray<double>(arrayValueList);
+    }
+    return PVFieldPtr();
+}
+
+/**
+ * Per channel columns of an NTMultiChannel snapshot,
+ * filled one masar data row at a time.
+ */
+struct SnapshotColumns
+{
+    explicit SnapshotColumns(size_t numberChannels)
+    : channelName(numberChannels),
+      channelValue(numberChannels),
+      isConnected(numberChannels),
+      secondsPastEpoch(numberChannels),
+      nanoseconds(numberChannels),
+      userTag(numberChannels),
+      severity(numberChannels),
+      status(numberChannels),
+      message(numberChannels),
+      dbr_type(numberChannels)
+    {}
+
+    void fill(size_t index, PyObject * sublist)
+    {
+        channelValue[index] = pvDataCreate->createPVVariantUnion();
+        PyObject * temp = PyTuple_GetItem(sublist,0);
+        channelName[index] = (PyString_AsString(temp)==NULL) ? "" : PyString_AsString (temp);
+        temp = PyTuple_GetItem(sublist,4);
+        dbr_type[index] = PyLong_AsLong(temp);
+        temp = PyTuple_GetItem(sublist,5);
+        isConnected[index] = (PyLong_AsLong(temp)==0) ? false : true;
+        temp = PyTuple_GetItem(sublist,6);
+        secondsPastEpoch[index] = PyLong_AsLongLong(temp);
+        temp = PyTuple_GetItem(sublist,7);
+        nanoseconds[index] = PyLong_AsLong(temp);
+        temp = PyTuple_GetItem(sublist,8);
+        userTag[index] = PyLong_AsLong(temp);
+        temp = PyTuple_GetItem(sublist,9);
+        severity[index] = PyLong_AsLong(temp);
+        temp = PyTuple_GetItem(sublist,10);
+        status[index] = PyLong_AsLong(temp);
+        temp = PyTuple_GetItem(sublist,11);
+        message[index] = PyString_AsString(temp);
+        PVFieldPtr pvValue = snapshotValue(sublist, 0, dbr_type[index]);
+        if(pvValue) channelValue[index]->set(pvValue);
+    }
+
+    shared_vector<string> channelName;
+    shared_vector<PVUnionPtr> channelValue;
+    shared_vector<boolean> isConnected;
+    shared_vector<int64> secondsPastEpoch;
+    shared_vector<int32> nanoseconds;
+    shared_vector<int32> userTag;
+    shared_vector<int32> severity;
+    shared_vector<int32> status;
+    shared_vector<string> message;
+    shared_vector<int32> dbr_type;
+};
+
 static NTMultiChannelPtr retrieveSnapshot(PyObject * list)
 {
+    // A third entry is given for an event saved in delta mode.
+    // It is the keyframe, which the changed channels of the event are put on top of.
     Py_ssize_t top_len = PyList_Size(list);
-    if (top_len != 2) {
+    if (top_len != 2 && top_len != 3) {
         return noDataMultiChannel("Wrong format for returned data from dslPY when retrieving masar data.");
     }
-    PyObject * data_array = PyList_GetItem(list, 1); // get data array
+    PyObject * data_array = PyList_GetItem(list, top_len-1); // get data array, or keyframe array
     // data length in each field
     // (the first row is a description instead of real data)
     Py_ssize_t numberChannels = PyList_Size(data_array) - 1;
@@ -217,138 +897,330 @@ static NTMultiChannelPtr retrieveSnapshot(PyObject * list)
             addUserTag() ->
             add("dbrType",fieldCreate->createScalarArray(pvInt)) ->
             create();
-    shared_vector<string> channelName(numberChannels);
-    shared_vector<PVUnionPtr> channelValue(numberChannels);
-    shared_vector<boolean> isConnected(numberChannels);
-    shared_vector<int64> secondsPastEpoch(numberChannels);
-    shared_vector<int32> nanoseconds(numberChannels);
-    shared_vector<int32> userTag(numberChannels);
-    shared_vector<int32> severity(numberChannels);
-    shared_vector<int32> status(numberChannels);
-    shared_vector<string> message(numberChannels);
-    shared_vector<int32> dbr_type(numberChannels);
-    PyObject * sublist;
+    SnapshotColumns columns(numberChannels);
     for(size_t index = 0; index < (size_t)numberChannels; index++ ){
-        channelValue[index] = pvDataCreate->createPVVariantUnion();
-        sublist = PyList_GetItem(data_array, index+1);
-        PyObject * temp = PyTuple_GetItem(sublist,0);
-        channelName[index] = (PyString_AsString(temp)==NULL) ? "" : PyString_AsString (temp);
-        temp = PyTuple_GetItem(sublist,4);
-        dbr_type[index] = PyLong_AsLong(temp);
-        temp = PyTuple_GetItem(sublist,5);
-        isConnected[index] = (PyLong_AsLong(temp)==0) ? false : true;
-        temp = PyTuple_GetItem(sublist,6);
-        secondsPastEpoch[index] = PyLong_AsLongLong(temp);
-        temp = PyTuple_GetItem(sublist,7);
-        nanoseconds[index] = PyLong_AsLong(temp);
-        temp = PyTuple_GetItem(sublist,8);
-        userTag[index] = PyLong_AsLong(temp);
-        temp = PyTuple_GetItem(sublist,9);
-        severity[index] = PyLong_AsLong(temp);
-        temp = PyTuple_GetItem(sublist,10);
-        status[index] = PyLong_AsLong(temp);
-        temp = PyTuple_GetItem(sublist,11);
-        message[index] = PyString_AsString(temp);
-        int32 is_array = PyLong_AsLong(PyTuple_GetItem(sublist,12));
-        bool isArray = (is_array==0) ? false : true;
-        if(!isArray) {
-            if(dbr_type[index]==DBR_STRING || dbr_type[index]==DBR_ENUM) {
-                char * str = PyString_AsString(PyTuple_GetItem(sublist,1));
-                PVStringPtr pvString = pvDataCreate->createPVScalar<PVString>();
-                pvString->put(str);
-                channelValue[index]->set(pvString);
-                continue;
-            } else if (dbr_type[index]==DBR_LONG) {
-                int32 val = PyLong_AsLong(PyTuple_GetItem(sublist,3));
-                PVIntPtr pvInt = pvDataCreate->createPVScalar<PVInt>();
-                pvInt->put(val);
-                channelValue[index]->set(pvInt);
-                continue;
-            } else if(dbr_type[index]==DBR_DOUBLE) {
-                double val = PyFloat_AsDouble(PyTuple_GetItem(sublist,2));
-                PVDoublePtr pvDouble = pvDataCreate->createPVScalar<PVDouble>();
-                pvDouble->put(val);
-                channelValue[index]->set(pvDouble);
-                continue;
-            }
+        columns.fill(index, PyList_GetItem(data_array, index+1));
+    }
+    if (top_len == 3) {
+        PyObject * delta_array = PyList_GetItem(list, 1);
+        std::map<string, size_t> channelIndex;
+        for(size_t index = 0; index < (size_t)numberChannels; index++ ){
+            channelIndex[columns.channelName[index]] = index;
+        }
+        Py_ssize_t numberChanged = PyList_Size(delta_array) - 1;
+        for(Py_ssize_t i = 0; i < numberChanged; i++) {
+            PyObject * sublist = PyList_GetItem(delta_array, i+1);
+            const char * name = PyString_AsString(PyTuple_GetItem(sublist, 0));
+            std::map<string, size_t>::const_iterator it = channelIndex.find(name==NULL ? "" : name);
+            if(it!=channelIndex.end()) columns.fill(it->second, sublist);
+        }
+    }
+
+    multiChannel->getChannelName()->replace(freeze(columns.channelName));
+    multiChannel->getValue()->replace(freeze(columns.channelValue));
+    multiChannel->getPVStructure()->getSubField<PVIntArray>("dbrType")->replace(freeze(columns.dbr_type));
+    multiChannel->getIsConnected()->replace(freeze(columns.isConnected));
+    multiChannel->getSecondsPastEpoch()->replace(freeze(columns.secondsPastEpoch));
+    multiChannel->getNanoseconds()->replace(freeze(columns.nanoseconds));
+    multiChannel->getUserTag()->replace(freeze(columns.userTag));
+    multiChannel->getSeverity()->replace(freeze(columns.severity));
+    multiChannel->getStatus()->replace(freeze(columns.status));
+    multiChannel->getMessage()->replace(freeze(columns.message));
+    return multiChannel;
+}
+
+/**
+ * Is a retrieveSnapshot request asking for several events?
+ * That is either a comma separated eventid list, or a time frame without eventid.
+ */
+static bool isBatchRetrieve(shared_vector<const string> const & names,
+    shared_vector<const string> const & values)
+{
+    bool hasEventId = false;
+    bool hasRange = false;
+    for(size_t i=0; i<names.size(); ++i) {
+        if(names[i]=="eventid") {
+            if(values[i].find(',')!=string::npos) return true;
+            hasEventId = true;
+        } else if(names[i]=="start" || names[i]=="end") {
+            hasRange = true;
+        }
+    }
+    return !hasEventId && hasRange;
+}
+
+/**
+ * Does a retrieveSnapshot request ask for widen=true?
+ */
+static bool isWidenRetrieve(shared_vector<const string> const & names,
+    shared_vector<const string> const & values)
+{
+    for(size_t i=0; i<names.size(); ++i) {
+        if(names[i]=="widen") return values[i]=="true" || values[i]=="1";
+    }
+    return false;
+}
+
+/**
+ * Give the value of a channel the element type older clients expect:
+ * byte and short become int, float becomes double.
+ */
+static PVFieldPtr widenValue(PVFieldPtr const & pvField)
+{
+    if(!pvField) return pvField;
+    if(pvField->getField()->getType()==scalar) {
+        PVScalarPtr pvScalar = static_pointer_cast<PVScalar>(pvField);
+        switch(pvScalar->getScalar()->getScalarType()) {
+        case pvByte: case pvShort: case pvUByte: case pvUShort: {
+            PVIntPtr pvInt = pvDataCreate->createPVScalar<PVInt>();
+            pvInt->put(pvScalar->getAs<int32>());
+            return pvInt;
+        }
+        case pvFloat: {
+            PVDoublePtr pvDouble = pvDataCreate->createPVScalar<PVDouble>();
+            pvDouble->put(pvScalar->getAs<double>());
+            return pvDouble;
+        }
+        default:
+            return pvField;
+        }
+    }
+    if(pvField->getField()->getType()==scalarArray) {
+        PVScalarArrayPtr pvArray = static_pointer_cast<PVScalarArray>(pvField);
+        switch(pvArray->getScalarArray()->getElementType()) {
+        case pvByte: case pvShort: case pvUByte: case pvUShort: {
+            shared_vector<const int32> values;
+            pvArray->getAs<int32>(values);
+            PVIntArrayPtr pvIntArray = pvDataCreate->createPVScalarArray<PVIntArray>();
+            pvIntArray->replace(values);
+            return pvIntArray;
+        }
+        case pvFloat: {
+            shared_vector<const double> values;
+            pvArray->getAs<double>(values);
+            PVDoubleArrayPtr pvDoubleArray = pvDataCreate->createPVScalarArray<PVDoubleArray>();
+            pvDoubleArray->replace(values);
+            return pvDoubleArray;
+        }
+        default:
+            return pvField;
+        }
+    }
+    return pvField;
+}
+
+static void widenValues(PVUnionArrayPtr const & pvValue)
+{
+    if(!pvValue) return;
+    PVUnionArray::const_svector values(pvValue->view());
+    for(size_t i=0; i<values.size(); ++i) {
+        if(!values[i]) continue;
+        PVFieldPtr widened = widenValue(values[i]->get());
+        if(widened!=values[i]->get()) values[i]->set(widened);
+    }
+}
+
+/**
+ * Widen the channel values of a single or batch retrieveSnapshot reply,
+ * which otherwise keep their native element type.
+ */
+static PVStructurePtr widenSnapshot(PVStructurePtr const & pvStructure)
+{
+    widenValues(pvStructure->getSubField<PVUnionArray>("value"));
+    PVStructureArrayPtr pvSnapshots = pvStructure->getSubField<PVStructureArray>("snapshot");
+    if(pvSnapshots) {
+        PVStructureArray::const_svector snapshots(pvSnapshots->view());
+        for(size_t i=0; i<snapshots.size(); ++i) {
+            if(snapshots[i]) widenValues(snapshots[i]->getSubField<PVUnionArray>("value"));
+        }
+    }
+    return pvStructure;
+}
+
+/**
+ * Check the paging arguments of retrieveServiceEvents before they reach the database:
+ * limit, offset and before have to be non negative integers, and order either asc or desc.
+ */
+static void checkPaging(shared_vector<const string> const & names,
+    shared_vector<const string> const & values)
+{
+    for(size_t i=0; i<names.size(); ++i) {
+        if(names[i]=="limit" || names[i]=="offset" || names[i]=="before") {
+            const char * value = values[i].c_str();
+            char * end = 0;
+            long long number = strtoll(value, &end, 10);
+            if(end==value || *end!='\0' || number<0)
+                throw std::runtime_error(names[i]+" has to be a non negative integer");
+        } else if(names[i]=="order") {
+            if(values[i]!="asc" && values[i]!="desc")
+                throw std::runtime_error("order has to be asc or desc");
+        }
+    }
+}
+
+/**
+ * Build the reply of a batch retrieveSnapshot.
+ * All events share one channelName column,
+ * and snapshot[i] holds the per channel columns of eventid[i].
+ * A channel which is not part of an event is marked as disconnected.
+ */
+static PVStructurePtr retrieveSnapshots(PyObject * list)
+{
+    if (PyList_Size(list) != 2) {
+        return noDataMultiChannel("Wrong format for returned data from dslPY when retrieving masar data.")->getPVStructure();
+    }
+    // the first row of both lists is a description
+    PyObject * event_array = PyList_GetItem(list, 0);
+    PyObject * data_array = PyList_GetItem(list, 1);
+    Py_ssize_t numberEvents = PyList_Size(event_array) - 1;
+    Py_ssize_t numberRows = PyList_Size(data_array) - 1;
+    if (numberEvents <= 0)
+        return noDataMultiChannel("no event found.")->getPVStructure();
+
+    StructureConstPtr snapshotType = fieldCreate->createFieldBuilder()->
+            addArray("value", fieldCreate->createVariantUnion())->
+            addArray("isConnected", pvBoolean)->
+            addArray("severity", pvInt)->
+            addArray("status", pvInt)->
+            addArray("message", pvString)->
+            addArray("secondsPastEpoch", pvLong)->
+            addArray("nanoseconds", pvInt)->
+            addArray("userTag", pvInt)->
+            addArray("dbrType", pvInt)->
+            createStructure();
+    StandardFieldPtr standardField = getStandardField();
+    StructureConstPtr topType = fieldCreate->createFieldBuilder()->
+            setId("masar:MultiSnapshot:1.0")->
+            addArray("channelName", pvString)->
+            addArray("eventid", pvLong)->
+            addArray("comment", pvString)->
+            addArray("eventTime", pvString)->
+            addArray("snapshot", snapshotType)->
+            add("alarm", standardField->alarm())->
+            add("timeStamp", standardField->timeStamp())->
+            createStructure();
+    PVStructurePtr pvStructure = pvDataCreate->createPVStructure(topType);
+
+    shared_vector<int64> eventid(numberEvents);
+    shared_vector<string> comment(numberEvents);
+    shared_vector<string> eventTime(numberEvents);
+    std::map<int64, size_t> eventIndex;
+    for(Py_ssize_t i=0; i<numberEvents; ++i) {
+        PyObject * row = PyList_GetItem(event_array, i+1);
+        eventid[i] = PyLong_AsLongLong(PyTuple_GetItem(row, 0));
+        PyObject * temp = PyTuple_GetItem(row, 1);
+        comment[i] = (temp==Py_None) ? "" : PyString_AsString(temp);
+        temp = PyTuple_GetItem(row, 2);
+        eventTime[i] = (temp==Py_None) ? "" : PyString_AsString(temp);
+        eventIndex[eventid[i]] = i;
+    }
+
+    // Build the shared channel name column once.
+    // Snapshots of one config list their channels in the same order,
+    // so most rows match the name already at their position and skip the map.
+    shared_vector<string> channelName;
+    std::map<string, size_t> channelIndex;
+    std::vector<size_t> rowEvent(numberRows), rowChannel(numberRows);
+    size_t position = 0;
+    int64 lastEvent = -1;
+    for(Py_ssize_t i=0; i<numberRows; ++i) {
+        PyObject * row = PyList_GetItem(data_array, i+1);
+        int64 eid = PyLong_AsLongLong(PyTuple_GetItem(row, 0));
+        if(eid!=lastEvent) {
+            position = 0;
+            lastEvent = eid;
+        }
+        std::map<int64, size_t>::const_iterator evt = eventIndex.find(eid);
+        if(evt==eventIndex.end()) {
+            return noDataMultiChannel("masar data found for an unknown event.")->getPVStructure();
+        }
+        rowEvent[i] = evt->second;
+        const char * name = PyString_AsString(PyTuple_GetItem(row, 1));
+        string pvName = (name==NULL) ? "" : name;
+        if(position<channelName.size() && channelName[position]==pvName) {
+            rowChannel[i] = position;
         } else {
-            PyObject * arrayValueList = PyTuple_GetItem(sublist, 13);
-            if(dbr_type[index]==DBR_STRING) {
-                shared_vector<string> values;
-                if (PyList_Check(arrayValueList)) {
-                    size_t array_len = (size_t)PyList_Size(arrayValueList);
-                    values.resize(array_len);
-                    for (size_t i = 0; i < array_len; i++){
-                        char * str = PyString_AsString(PyList_GetItem(arrayValueList, i));
-                        values[i] = string(str);;
-                    }
-                } else if (PyTuple_Check(arrayValueList)) {
-                    size_t array_len = (size_t)PyTuple_Size(arrayValueList);
-                    values.resize(array_len);
-                    for (size_t i = 0; i < array_len; i++){
-                        char * str = PyString_AsString(PyTuple_GetItem(arrayValueList, i));
-                        values[i] = string(str);;
-                    }
-                }
-                PVStringArrayPtr pvStringArray = pvDataCreate->createPVScalarArray<PVStringArray>();
-                pvStringArray->replace(freeze(values));
-                channelValue[index]->set(pvStringArray);
-                continue;
-            }
-            if(dbr_type[index]==DBR_LONG || dbr_type[index]==DBR_INT || dbr_type[index]==DBR_CHAR) {
-                shared_vector<int> values;
-                if (PyList_Check(arrayValueList)) {
-                    size_t array_len = (size_t)PyList_Size(arrayValueList);
-                    values.resize(array_len);
-                    for (size_t i = 0; i < array_len; i++){
-                        values[i] = PyLong_AsLong(PyList_GetItem(arrayValueList, i));
-                    }
-                } else if (PyTuple_Check(arrayValueList)) {
-                    size_t array_len = (size_t)PyTuple_Size(arrayValueList);
-                    values.resize(array_len);
-                    for (size_t i = 0; i < array_len; i++){
-                        values[i] = PyLong_AsLong(PyTuple_GetItem(arrayValueList, i));
-                    }
-                }
-                PVIntArrayPtr pvIntArray = pvDataCreate->createPVScalarArray<PVIntArray>();
-                pvIntArray->replace(freeze(values));
-                channelValue[index]->set(pvIntArray);
-                continue;
-            }
-            if(dbr_type[index]==DBR_DOUBLE || dbr_type[index]==DBR_FLOAT) {
-                shared_vector<double> values;
-                if (PyList_Check(arrayValueList)) {
-                    size_t array_len = (size_t)PyList_Size(arrayValueList);
-                    values.resize(array_len);
-                    for (size_t i = 0; i < array_len; i++){
-                        values[i] = PyFloat_AsDouble(PyList_GetItem(arrayValueList, i));
-                    }
-                } else if (PyTuple_Check(arrayValueList)) {
-                    size_t array_len = (size_t)PyTuple_Size(arrayValueList);
-                    values.resize(array_len);
-                    for (size_t i = 0; i < array_len; i++){
-                        values[i] = PyFloat_AsDouble(PyTuple_GetItem(arrayValueList, i));
-                    }
-                }
-                PVDoubleArrayPtr pvDoubleArray = pvDataCreate->createPVScalarArray<PVDoubleArray>();
-                pvDoubleArray->replace(freeze(values));
-                channelValue[index]->set(pvDoubleArray);
-                continue;
+            std::map<string, size_t>::const_iterator it = channelIndex.find(pvName);
+            if(it==channelIndex.end()) {
+                rowChannel[i] = channelName.size();
+                channelIndex[pvName] = channelName.size();
+                channelName.push_back(pvName);
+            } else {
+                rowChannel[i] = it->second;
             }
         }
+        position = rowChannel[i]+1;
     }
+    size_t numberChannels = channelName.size();
 
-    multiChannel->getChannelName()->replace(freeze(channelName));
-    multiChannel->getValue()->replace(freeze(channelValue));
-    multiChannel->getPVStructure()->getSubField<PVIntArray>("dbrType")->replace(freeze(dbr_type));
-    multiChannel->getIsConnected()->replace(freeze(isConnected));
-    multiChannel->getSecondsPastEpoch()->replace(freeze(secondsPastEpoch));
-    multiChannel->getNanoseconds()->replace(freeze(nanoseconds));
-    multiChannel->getUserTag()->replace(freeze(userTag));
-    multiChannel->getSeverity()->replace(freeze(severity));
-    multiChannel->getStatus()->replace(freeze(status));
-    multiChannel->getMessage()->replace(freeze(message));
-    return multiChannel;
+    PVStructureArray::svector snapshots(numberEvents);
+    std::vector<shared_vector<PVUnionPtr> > value(numberEvents);
+    std::vector<shared_vector<boolean> > isConnected(numberEvents);
+    std::vector<shared_vector<int32> > severity(numberEvents);
+    std::vector<shared_vector<int32> > status(numberEvents);
+    std::vector<shared_vector<string> > message(numberEvents);
+    std::vector<shared_vector<int64> > secondsPastEpoch(numberEvents);
+    std::vector<shared_vector<int32> > nanoseconds(numberEvents);
+    std::vector<shared_vector<int32> > userTag(numberEvents);
+    std::vector<shared_vector<int32> > dbrType(numberEvents);
+    for(Py_ssize_t e=0; e<numberEvents; ++e) {
+        value[e].resize(numberChannels);
+        isConnected[e].resize(numberChannels, false);
+        severity[e].resize(numberChannels, invalidAlarm);
+        status[e].resize(numberChannels, 0);
+        message[e].resize(numberChannels, "not in snapshot");
+        secondsPastEpoch[e].resize(numberChannels, 0);
+        nanoseconds[e].resize(numberChannels, 0);
+        userTag[e].resize(numberChannels, 0);
+        dbrType[e].resize(numberChannels, 0);
+        for(size_t c=0; c<numberChannels; ++c) {
+            value[e][c] = pvDataCreate->createPVVariantUnion();
+        }
+    }
+    for(Py_ssize_t i=0; i<numberRows; ++i) {
+        PyObject * row = PyList_GetItem(data_array, i+1);
+        size_t e = rowEvent[i];
+        size_t c = rowChannel[i];
+        dbrType[e][c] = PyLong_AsLong(PyTuple_GetItem(row, 5));
+        isConnected[e][c] = (PyLong_AsLong(PyTuple_GetItem(row, 6))==0) ? false : true;
+        secondsPastEpoch[e][c] = PyLong_AsLongLong(PyTuple_GetItem(row, 7));
+        nanoseconds[e][c] = PyLong_AsLong(PyTuple_GetItem(row, 8));
+        userTag[e][c] = PyLong_AsLong(PyTuple_GetItem(row, 9));
+        severity[e][c] = PyLong_AsLong(PyTuple_GetItem(row, 10));
+        status[e][c] = PyLong_AsLong(PyTuple_GetItem(row, 11));
+        const char * msg = PyString_AsString(PyTuple_GetItem(row, 12));
+        message[e][c] = (msg==NULL) ? "" : msg;
+        PVFieldPtr pvValue = snapshotValue(row, 1, dbrType[e][c]);
+        if(pvValue) value[e][c]->set(pvValue);
+    }
+    for(Py_ssize_t e=0; e<numberEvents; ++e) {
+        PVStructurePtr snapshot = pvDataCreate->createPVStructure(snapshotType);
+        snapshot->getSubField<PVUnionArray>("value")->replace(freeze(value[e]));
+        snapshot->getSubField<PVBooleanArray>("isConnected")->replace(freeze(isConnected[e]));
+        snapshot->getSubField<PVIntArray>("severity")->replace(freeze(severity[e]));
+        snapshot->getSubField<PVIntArray>("status")->replace(freeze(status[e]));
+        snapshot->getSubField<PVStringArray>("message")->replace(freeze(message[e]));
+        snapshot->getSubField<PVLongArray>("secondsPastEpoch")->replace(freeze(secondsPastEpoch[e]));
+        snapshot->getSubField<PVIntArray>("nanoseconds")->replace(freeze(nanoseconds[e]));
+        snapshot->getSubField<PVIntArray>("userTag")->replace(freeze(userTag[e]));
+        snapshot->getSubField<PVIntArray>("dbrType")->replace(freeze(dbrType[e]));
+        snapshots[e] = snapshot;
+    }
+
+    pvStructure->getSubField<PVStringArray>("channelName")->replace(freeze(channelName));
+    pvStructure->getSubField<PVLongArray>("eventid")->replace(freeze(eventid));
+    pvStructure->getSubField<PVStringArray>("comment")->replace(freeze(comment));
+    pvStructure->getSubField<PVStringArray>("eventTime")->replace(freeze(eventTime));
+    pvStructure->getSubField<PVStructureArray>("snapshot")->replace(freeze(snapshots));
+
+    PVTimeStamp pvTimeStamp;
+    pvTimeStamp.attach(pvStructure->getSubField("timeStamp"));
+    TimeStamp timeStamp;
+    timeStamp.getCurrent();
+    timeStamp.setUserTag(0);
+    pvTimeStamp.set(timeStamp);
+
+    return pvStructure;
 }
 
 static NTMultiChannelPtr saveSnapshot(PyObject * list, NTMultiChannelPtr data)
@@ -511,57 +1383,156 @@ static NTTablePtr noDataTable(string message)
     return ntTable;
 }
 
-static NTTablePtr retrieveServiceConfigEvents(PyObject * list, long numeric)
+/**
+ * NTTable type of a table function, built once per function and label set.
+ */
+struct TableType
+{
+    StructureConstPtr structure;
+    shared_vector<const string> labels;
+};
+// only accessed with the GIL held
+static std::map<string, TableType> tableTypes;
+
+static TableType const & tableType(string const & functionName, PyObject * labelList, long numeric)
 {
-    Py_ssize_t list_len = PyList_Size(list);
-    // data order in the tuple
-    // for example result of service config
-    // (service_config_id, service_config_name, service_config_desc, service_config_create_date,
-    //  service_config_version, and service_name)
-    PyObject * labelList = PyList_GetItem(list, 0);
     Py_ssize_t tuple_size = PyTuple_Size(labelList);
-    if (tuple_size < numeric) {
-        numeric = tuple_size; // all array are numbers
-    }
     shared_vector<string> label(tuple_size);
+    string key(functionName);
     for(int i=0; i<tuple_size; ++i) {
          label[i] = string(PyString_AsString(PyTuple_GetItem(labelList, i)));
+         key += '\n';
+         key += label[i];
     }
+    key += (char)('0'+numeric);
+    std::map<string, TableType>::const_iterator it = tableTypes.find(key);
+    if(it!=tableTypes.end()) return it->second;
+
     NTTableBuilderPtr builder = NTTable::createBuilder();
     for(int i=0 ; i< tuple_size; ++i) {
         ScalarType scalarType = (i<numeric) ? pvLong : pvString;
         builder->addColumn(label[i],scalarType);
     }
-    NTTablePtr ntTable = builder->
+    TableType & type = tableTypes[key];
+    type.structure = builder->
             addAlarm()->
             addTimeStamp()->
-            create();
-    PVStructurePtr pvStructure = ntTable->getPVStructure();
+            createStructure();
+    type.labels = freeze(label);
+    return type;
+}
 
-    std::vector<shared_vector<int64> > scIdVals(numeric);
-    for(size_t i=0; i<scIdVals.size(); i++) {
-        scIdVals[i].resize(list_len-1);
+/**
+ * Copy a column of numbers, either a list or an object exporting a buffer of int64
+ * such as array.array('l') on 64 bit platforms.
+ */
+static void longColumn(PyObject * column, shared_vector<int64> & values)
+{
+    const void * buffer = 0;
+    Py_ssize_t length = 0;
+    if(!PyList_Check(column) && !PyTuple_Check(column)
+            && PyObject_AsReadBuffer(column, &buffer, &length)==0) {
+        values.resize(length/sizeof(int64));
+        memcpy(values.data(), buffer, values.size()*sizeof(int64));
+        return;
     }
+    PyErr_Clear();
+    PyObject * seq = PySequence_Fast(column, "column is not a sequence");
+    if(seq==NULL) {
+        PyErr_Clear();
+        throw std::runtime_error("Wrong format for returned data from dslPY.");
+    }
+    Py_ssize_t size = PySequence_Fast_GET_SIZE(seq);
+    PyObject ** items = PySequence_Fast_ITEMS(seq);
+    values.resize(size);
+    for(Py_ssize_t i=0; i<size; ++i) {
+        values[i] = PyLong_AsLongLong(items[i]);
+        if(values[i]==-1 && PyErr_Occurred()) PyErr_Clear();
+    }
+    Py_DECREF(seq);
+}
 
-    std::vector<shared_vector<string> > vals (tuple_size-numeric);
-    for (size_t i = 0; i < vals.size(); i++){
-        vals[i].resize(list_len-1);
+static void stringColumn(PyObject * column, shared_vector<string> & values)
+{
+    PyObject * seq = PySequence_Fast(column, "column is not a sequence");
+    if(seq==NULL) {
+        PyErr_Clear();
+        throw std::runtime_error("Wrong format for returned data from dslPY.");
+    }
+    Py_ssize_t size = PySequence_Fast_GET_SIZE(seq);
+    PyObject ** items = PySequence_Fast_ITEMS(seq);
+    values.resize(size);
+    for(Py_ssize_t i=0; i<size; ++i) {
+        const char * str = (items[i]==Py_None) ? NULL : PyString_AsString(items[i]);
+        if(str==NULL) {
+            PyErr_Clear();
+            values[i] = "";
+        } else {
+            values[i] = str;
+        }
+    }
+    Py_DECREF(seq);
+}
+
+/**
+ * Convert a table function result into an NTTable.
+ * The first entry of list is the label tuple. It is followed either by one tuple per row,
+ * or by one sequence per column (see masarserver/dslPYSQLite.py), which is filled column by column.
+ * The first numeric columns are int64, the others strings.
+ */
+static NTTablePtr retrieveServiceConfigEvents(string const & functionName, PyObject * list, long numeric)
+{
+    Py_ssize_t list_len = PyList_Size(list);
+    // data order in the tuple
+    // for example result of service config
+    // (service_config_id, service_config_name, service_config_desc, service_config_create_date,
+    //  service_config_version, and service_name)
+    PyObject * labelList = PyList_GetItem(list, 0);
+    Py_ssize_t tuple_size = PyTuple_Size(labelList);
+    if (tuple_size < numeric) {
+        numeric = tuple_size; // all array are numbers
     }
-    // Get values for each fields from list
-    PyObject * sublist;
-    for (int index = 1; index < list_len; index++ ){
-        sublist = PyList_GetItem(list, index);
+    TableType const & type = tableType(functionName, labelList, numeric);
+    PVStructurePtr pvStructure = pvDataCreate->createPVStructure(type.structure);
+    NTTablePtr ntTable = NTTable::wrap(pvStructure);
+    pvStructure->getSubField<PVStringArray>("labels")->replace(type.labels);
+    // columns in label order
+    const PVFieldPtrArray & columns = pvStructure->getSubField<PVStructure>("value")->getPVFields();
+
+    std::vector<shared_vector<int64> > scIdVals(numeric);
+    std::vector<shared_vector<string> > vals (tuple_size-numeric);
+    bool rows = list_len < 2 || PyTuple_Check(PyList_GetItem(list, 1));
+    if (!rows) {
+        if (list_len != tuple_size+1)
+            throw std::runtime_error("Wrong format for returned data from dslPY.");
         for (int i = 0; i < tuple_size; i ++) {
-            PyObject * temp = PyTuple_GetItem(sublist, i);
-            if (i < numeric){
-                // PyLong_Check for type check?
-                scIdVals[i][index-1] = PyLong_AsLongLong(temp);
-            } else {
-                // PyString_Check for type check?
-                if (PyString_AsString(temp) == NULL) {
-                    vals[i-numeric][index-1] = "";
+            PyObject * column = PyList_GetItem(list, i+1);
+            if (i < numeric) longColumn(column, scIdVals[i]);
+            else stringColumn(column, vals[i-numeric]);
+        }
+    } else {
+        for(size_t i=0; i<scIdVals.size(); i++) {
+            scIdVals[i].resize(list_len-1);
+        }
+        for (size_t i = 0; i < vals.size(); i++){
+            vals[i].resize(list_len-1);
+        }
+        // Get values for each fields from list
+        PyObject * sublist;
+        for (int index = 1; index < list_len; index++ ){
+            sublist = PyList_GetItem(list, index);
+            for (int i = 0; i < tuple_size; i ++) {
+                PyObject * temp = PyTuple_GetItem(sublist, i);
+                if (i < numeric){
+                    // PyLong_Check for type check?
+                    scIdVals[i][index-1] = PyLong_AsLongLong(temp);
                 } else {
-                    vals[i-numeric][index-1] = PyString_AsString(temp);
+                    // PyString_Check for type check?
+                    if (PyString_AsString(temp) == NULL) {
+                        vals[i-numeric][index-1] = "";
+                    } else {
+                        vals[i-numeric][index-1] = PyString_AsString(temp);
+                    }
                 }
             }
         }
@@ -569,20 +1540,86 @@ static NTTablePtr retrieveServiceConfigEvents(PyObject * list, long numeric)
 
     // set value to each numeric field
     for (int i = 0; i < numeric; i ++) {
-        //PVLongArrayPtr pvLongArray = ntTable->getColumn<PVLongArray>(label[i]);
-        PVLongArrayPtr pvLongArray = pvStructure->getSubField<PVLongArray>("value."+label[i]);
-        //TODO: add logging information here
-        if (!pvLongArray) cout << "empty sub field for " << label[i] << endl;
-        else pvLongArray->replace(freeze(scIdVals[i]));
+        static_pointer_cast<PVLongArray>(columns[i])->replace(freeze(scIdVals[i]));
     }
     // set value to each string field
     for (int i = numeric; i < tuple_size; i ++) {
-        //PVStringArrayPtr pvStringArray = ntTable->getColumn<PVStringArray>(label[i]);
-        PVStringArrayPtr pvStringArray = pvStructure->getSubField<PVStringArray>("value."+label[i]);
-        //TODO: add logging information here
-        if (!pvStringArray) cout << "empty sub field for " << label[i] << endl;
-        else pvStringArray->replace(freeze(vals[i-numeric]));
+        static_pointer_cast<PVStringArray>(columns[i])->replace(freeze(vals[i-numeric]));
+    }
+
+    PVTimeStamp pvTimeStamp;
+    ntTable->attachTimeStamp(pvTimeStamp);
+    TimeStamp timeStamp;
+    timeStamp.getCurrent();
+    timeStamp.setUserTag(0);
+    pvTimeStamp.set(timeStamp);
+
+    return ntTable;
+}
+
+/**
+ * Build the reply of retrieveChannelHistory.
+ * One row per channel per event, ordered by channel name then event id.
+ * value holds the numeric value, which is NaN for strings and arrays,
+ * stringValue holds the value as it was saved in string form.
+ */
+static NTTablePtr retrieveChannelHistory(PyObject * list)
+{
+    // the first row is a description instead of real data
+    Py_ssize_t numberRows = PyList_Size(list) - 1;
+    if (numberRows < 0)
+        return noDataTable("Wrong format for returned data from dslPY when retrieving channel history.");
+
+    NTTablePtr ntTable = NTTable::createBuilder()->
+            addColumn("channelName", pvString)->
+            addColumn("eventid", pvLong)->
+            addColumn("time", pvString)->
+            addColumn("value", pvDouble)->
+            addColumn("stringValue", pvString)->
+            addColumn("severity", pvInt)->
+            addColumn("status", pvInt)->
+            addColumn("dbrType", pvInt)->
+            addAlarm()->
+            addTimeStamp()->
+            create();
+    PVStructurePtr pvStructure = ntTable->getPVStructure();
+
+    shared_vector<string> channelName(numberRows);
+    shared_vector<int64> eventid(numberRows);
+    shared_vector<string> time(numberRows);
+    shared_vector<double> value(numberRows);
+    shared_vector<string> stringValue(numberRows);
+    shared_vector<int32> severity(numberRows);
+    shared_vector<int32> status(numberRows);
+    shared_vector<int32> dbrType(numberRows);
+    for(Py_ssize_t index = 0; index < numberRows; index++) {
+        PyObject * sublist = PyList_GetItem(list, index+1);
+        const char * str = PyString_AsString(PyTuple_GetItem(sublist, 0));
+        channelName[index] = (str==NULL) ? "" : str;
+        eventid[index] = PyLong_AsLongLong(PyTuple_GetItem(sublist, 1));
+        PyObject * temp = PyTuple_GetItem(sublist, 2);
+        time[index] = (temp==Py_None) ? "" : PyString_AsString(temp);
+        temp = PyTuple_GetItem(sublist, 3);
+        bool isArray = PyLong_AsLong(PyTuple_GetItem(sublist, 8))!=0;
+        if(temp==Py_None || isArray) {
+            value[index] = std::numeric_limits<double>::quiet_NaN();
+        } else {
+            value[index] = PyFloat_AsDouble(temp);
+        }
+        temp = PyTuple_GetItem(sublist, 4);
+        stringValue[index] = (temp==Py_None) ? "" : PyString_AsString(temp);
+        severity[index] = PyLong_AsLong(PyTuple_GetItem(sublist, 5));
+        status[index] = PyLong_AsLong(PyTuple_GetItem(sublist, 6));
+        dbrType[index] = PyLong_AsLong(PyTuple_GetItem(sublist, 7));
     }
+    pvStructure->getSubField<PVStringArray>("value.channelName")->replace(freeze(channelName));
+    pvStructure->getSubField<PVLongArray>("value.eventid")->replace(freeze(eventid));
+    pvStructure->getSubField<PVStringArray>("value.time")->replace(freeze(time));
+    pvStructure->getSubField<PVDoubleArray>("value.value")->replace(freeze(value));
+    pvStructure->getSubField<PVStringArray>("value.stringValue")->replace(freeze(stringValue));
+    pvStructure->getSubField<PVIntArray>("value.severity")->replace(freeze(severity));
+    pvStructure->getSubField<PVIntArray>("value.status")->replace(freeze(status));
+    pvStructure->getSubField<PVIntArray>("value.dbrType")->replace(freeze(dbrType));
 
     PVTimeStamp pvTimeStamp;
     ntTable->attachTimeStamp(pvTimeStamp);
@@ -594,147 +1631,534 @@ static NTTablePtr retrieveServiceConfigEvents(PyObject * list, long numeric)
     return ntTable;
 }
 
+static std::vector<string> splitArguments(const char * arguments)
+{
+    std::vector<string> result;
+    string word;
+    for(const char * c = arguments; ; ++c) {
+        if(*c==' ' || *c=='\0') {
+            if(!word.empty()) result.push_back(word);
+            word.clear();
+            if(*c=='\0') break;
+        } else {
+            word += *c;
+        }
+    }
+    return result;
+}
+
+void DSL_RDB::addFunction(const char * name, const char * arguments,
+    bool readOnly, bool touchesMachine, DSLFunction::Lane lane,
+    Call call, long numeric, Check check)
+{
+    Handler & handler = handlers[name];
+    handler.function.name = name;
+    handler.function.arguments = splitArguments(arguments);
+    handler.function.readOnly = readOnly;
+    handler.function.touchesMachine = touchesMachine;
+    handler.function.lane = lane;
+    handler.function.metrics.reset(new FunctionMetrics());
+    handler.call = call;
+    handler.numeric = numeric;
+    handler.check = check;
+}
+
+void DSL_RDB::addFunctions()
+{
+    addFunction("getLiveMachine", "*",
+        true, true, DSLFunction::machineLane, &DSL_RDB::callLiveMachine);
+    addFunction("retrieveSnapshot", "eventid start end comment widen",
+        true, false, DSLFunction::queryLane, &DSL_RDB::callRetrieveSnapshot);
+    addFunction("saveSnapshot", "servicename configname comment",
+        false, true, DSLFunction::writeLane, &DSL_RDB::callSaveSnapshot);
+    addFunction("updateSnapshotEvent", "eventid user desc",
+        false, false, DSLFunction::writeLane, &DSL_RDB::callUpdateSnapshotEvent);
+    addFunction("retrieveServiceEvents", "configid start end comment user eventid limit offset before order",
+        true, false, DSLFunction::queryLane, &DSL_RDB::callTable, 2, checkPaging);
+    addFunction("retrieveServiceConfigs", "servicename configname configversion system eventid",
+        true, false, DSLFunction::queryLane, &DSL_RDB::callTable, 1);
+    addFunction("retrieveServiceConfigProps", "propname servicename configname",
+        true, false, DSLFunction::queryLane, &DSL_RDB::callTable, 2);
+    addFunction("retrieveChannelHistory", "pvname start end",
+        true, false, DSLFunction::queryLane, &DSL_RDB::callChannelHistory);
+    addFunction("retrieveServiceMetrics", "",
+        true, false, DSLFunction::queryLane, &DSL_RDB::callServiceMetrics);
+    addFunction("retrieveServiceStatus", "",
+        true, false, DSLFunction::queryLane, &DSL_RDB::callServiceStatus);
+}
+
+const DSLFunction * DSL_RDB::getFunction(string const & functionName) const
+{
+    std::map<string, Handler>::const_iterator it = handlers.find(functionName);
+    return it==handlers.end() ? 0 : &it->second.function;
+}
+
 PVStructurePtr DSL_RDB::request(
     string const & functionName,shared_vector<const string> const & names,shared_vector<const string> const &values)
 {
-//try{
-    if (functionName.compare("getLiveMachine")==0) {
-        NTMultiChannelPtr ntmultiChannel = getLiveMachine(values);
-        return ntmultiChannel->getPVStructure();
+    std::map<string, Handler>::const_iterator it = handlers.find(functionName);
+    if (it==handlers.end()) {
+        throw std::runtime_error("unsupported function " + functionName);
     }
-    int num = names.size();
-    PyGILState_STATE gstate = PyGILState_Ensure();
+    const Handler & handler = it->second;
+    checkArguments(handler, names);
+    if (handler.check) {
+        handler.check(names, values);
+    }
+    return (this->*handler.call)(handler, names, values);
+}
+
+/**
+ * Report, once per function and argument, an argument the function does not declare.
+ * Such arguments are still passed to the DSL, which ignores them.
+ */
+void DSL_RDB::checkArguments(Handler const & handler, shared_vector<const string> const & names)
+{
+    std::vector<string> const & declared = handler.function.arguments;
+    if (declared.size() == 1 && declared[0] == "*") return;
+    for (size_t i = 0; i < names.size(); i ++) {
+        if (std::find(declared.begin(), declared.end(), names[i]) != declared.end()) continue;
+        string key = handler.function.name + ' ' + names[i];
+        Lock guard(argumentMutex);
+        if (!reportedArguments.insert(key).second) continue;
+        cout << "DSL_RDB::request " << handler.function.name
+             << " ignores undeclared argument " << names[i] << endl;
+    }
+}
+
+/**
+ * PyLockGIL which records the time spent waiting for the GIL.
+ */
+struct TimedPyLockGIL
+{
+    explicit TimedPyLockGIL(FunctionMetrics * metrics)
+    : wait(metrics, FunctionMetrics::gilWaitStage)
+    {
+        wait.stop();
+    }
+    StageTimer wait;
+    PyLockGIL gil;
+};
+
+/**
+ * Build the argument dictionary of the Python DSL.
+ * Must be called with the GIL held.
+ */
+static PyObject * newArgument(string const & functionName,
+    shared_vector<const string> const & names, shared_vector<const string> const & values)
+{
     PyObject *pyDict = PyDict_New();
-    for (int i = 0; i < num; i ++) {
+    for (size_t i = 0; i < names.size(); i ++) {
         PyObject *pyValue = Py_BuildValue("s",values[i].c_str());
         PyDict_SetItemString(pyDict,names[i].c_str(),pyValue);
+        Py_DECREF(pyValue);
     }
     PyObject *pyValue = Py_BuildValue("s",functionName.c_str());
     PyDict_SetItemString(pyDict,"function",pyValue);
-    if (functionName.compare("updateSnapshotEvent")==0) {
-        NTScalarPtr pvReturn;
-        PyObject * pyTuple = PyTuple_New(1);
-        // put dictionary into the tuple
-        PyTuple_SetItem(pyTuple, 0, pyDict);
-        PyObject *result = PyEval_CallObject(prequest,pyTuple);
-        Py_DECREF(pyTuple);
-        if(result == NULL) {
-            pvReturn = noDataScalar("No data entry found in database.");
-        } else {
-            PyObject *list = 0;
-            if(!PyArg_ParseTuple(result,"O!:dslPY", &PyList_Type,&list))
-            {
-               throw std::runtime_error("Wrong format for returned data from dslPY.");
+    Py_DECREF(pyValue);
+    return pyDict;
+}
+
+/**
+ * Call the Python DSL with the arguments of a request, and return the list it replied.
+ * result holds the reply, and is empty if the call failed.
+ * Must be called with the GIL held.
+ */
+PyObject * DSL_RDB::callPython(Handler const & handler, PyObj & result,
+    shared_vector<const string> const & names, shared_vector<const string> const & values)
+{
+    PyObject * pyTuple = PyTuple_New(1);
+    // put dictionary into the tuple
+    PyTuple_SetItem(pyTuple, 0, newArgument(handler.function.name, names, values));
+    {
+        StageTimer python(handler.function.metrics.get(), FunctionMetrics::pythonStage);
+        result.reset(PyEval_CallObject(prequest,pyTuple));
+    }
+    Py_DECREF(pyTuple);
+    if(result.get() == NULL) {
+        PyErr_Print();
+        return 0;
+    }
+    PyObject *list = 0;
+    if(!PyArg_ParseTuple(result.get(),"O!:dslPY", &PyList_Type,&list))
+    {
+        PyErr_Clear();
+        throw std::runtime_error("Wrong format for returned data from dslPY.");
+    }
+    return list;
+}
+
+PVStructurePtr DSL_RDB::callLiveMachine(Handler const & handler,
+    shared_vector<const string> const & names, shared_vector<const string> const & values)
+{
+    NTMultiChannelPtr ntmultiChannel = liveGather->gather(values, handler.function.metrics.get());
+    return ntmultiChannel->getPVStructure();
+}
+
+MasarArchivePtr DSL_RDB::currentArchive()
+{
+    Lock guard(archiveMutex);
+    if (archiveFile.empty() || (archive && !archive->replaced())) {
+        return archive;
+    }
+    // archivemasar.py renamed a new file over the mapped one, or created the first one.
+    // Snapshots already handed out keep the old mapping alive.
+    try {
+        archive = MasarArchive::open(archiveFile);
+        cout << "DSL_RDB " << archive->size() << " events in archive " << archiveFile << endl;
+    } catch(std::exception& e) {
+        // keep serving the old mapping, if any
+    }
+    return archive;
+}
+
+PVStructurePtr DSL_RDB::callRetrieveSnapshot(Handler const & handler,
+    shared_vector<const string> const & names, shared_vector<const string> const & values)
+{
+    // values keep their native element type, unless the client asks for widen=true
+    bool widen = isWidenRetrieve(names, values);
+    MasarArchivePtr archive(currentArchive());
+    if (archive) {
+        // archived events need neither Python nor the database
+        for (size_t i = 0; i < names.size(); i ++) {
+            if (names[i].compare("eventid")!=0) continue;
+            const char * value = values[i].c_str();
+            char * end = 0;
+            int64 eid = strtoll(value, &end, 10);
+            if (end!=value && *end=='\0' && archive->contains(eid)) {
+                PVStructurePtr pvStructure = archive->retrieveSnapshot(eid)->getPVStructure();
+                return widen ? widenSnapshot(pvStructure) : pvStructure;
             }
-            pvReturn = updateSnapshotEvent(list);
-        }
-        Py_XDECREF(result);
-        PyGILState_Release(gstate);
-        return pvReturn->getPVStructure();
-    } else if (functionName.compare("retrieveSnapshot")==0) {
-        NTMultiChannelPtr pvReturn;
-        PyObject * pyTuple = PyTuple_New(1);
-        // put dictionary into the tuple
-        PyTuple_SetItem(pyTuple, 0, pyDict);
-        PyObject *result = PyEval_CallObject(prequest,pyTuple);
-        Py_DECREF(pyTuple);
+        }
+    }
+    bool batch = isBatchRetrieve(names, values);
+    TimedPyLockGIL gil(handler.function.metrics.get());
+    PyObj result;
+    PyObject * list = callPython(handler, result, names, values);
+    if(list == NULL) {
+        return noDataMultiChannel("No data entry found in database.")->getPVStructure();
+    }
+    StageTimer build(handler.function.metrics.get(), FunctionMetrics::buildStage);
+    PVStructurePtr pvStructure = batch ? retrieveSnapshots(list) : retrieveSnapshot(list)->getPVStructure();
+    return widen ? widenSnapshot(pvStructure) : pvStructure;
+}
+
+PVStructurePtr DSL_RDB::callUpdateSnapshotEvent(Handler const & handler,
+    shared_vector<const string> const & names, shared_vector<const string> const & values)
+{
+    TimedPyLockGIL gil(handler.function.metrics.get());
+    PyObj result;
+    PyObject * list = callPython(handler, result, names, values);
+    if(list == NULL) {
+        return noDataScalar("No data entry found in database.")->getPVStructure();
+    }
+    StageTimer build(handler.function.metrics.get(), FunctionMetrics::buildStage);
+    return updateSnapshotEvent(list)->getPVStructure();
+}
+
+PVStructurePtr DSL_RDB::callSaveSnapshot(Handler const & handler,
+    shared_vector<const string> const & names, shared_vector<const string> const & values)
+{
+    FunctionMetrics * metrics = handler.function.metrics.get();
+    TimedPyLockGIL gil(metrics);
+    // A tuple is needed to pass to Python as parameter.
+    PyObj pyTuple(PyTuple_New(1));
+    PyObject * pyDict = newArgument(handler.function.name, names, values);
+    // put dictionary into the tuple
+    PyTuple_SetItem(pyTuple.get(), 0, pyDict);
+    StageTimer lookup(metrics, FunctionMetrics::channelNamesStage);
+    shared_vector<const string> channelNames = getChannelNames(pyTuple.get(), names, values);
+    lookup.stop();
+    if (channelNames.size() == 0) {
+        return noDataMultiChannel("Failed to retrieve channel names.")->getPVStructure();
+    }
+    NTMultiChannelPtr data;
+    {
+        // let other requests run Python while the IOCs are read
+        PyUnlockGIL unlock;
+        data = liveGather->gather(channelNames, metrics, configKey(names, values));
+    }
+    PVStructurePtr pvStructure = data->getPVStructure();
+
+    // create a tuple is needed to pass to Python as parameter.
+    PyObject * pdata = PyCapsule_New(&pvStructure, "pvStructure", 0);
+    PyObj pyTuple2(PyTuple_New(2));
+
+    // first value is the data from live machine
+    PyTuple_SetItem(pyTuple2.get(), 0, pdata);
+    // second value is the dictionary
+    Py_INCREF(pyDict);
+    PyTuple_SetItem(pyTuple2.get(), 1, pyDict);
+    StageTimer python(metrics, FunctionMetrics::pythonStage);
+    PyObject *result = PyEval_CallObject(prequest,pyTuple2.get());
+    python.stop();
+    if(result == NULL) {
+        PyErr_Print();
+        return noDataMultiChannel("Failed to save snapshot.")->getPVStructure();
+    }
+    StageTimer build(metrics, FunctionMetrics::buildStage);
+    NTMultiChannelPtr pvReturn = saveSnapshot(result, data);
+    Py_DECREF(result);
+    return pvReturn->getPVStructure();
+}
+
+PVStructurePtr DSL_RDB::callTable(Handler const & handler,
+    shared_vector<const string> const & names, shared_vector<const string> const & values)
+{
+    TimedPyLockGIL gil(handler.function.metrics.get());
+    PyObj result;
+    PyObject * list = callPython(handler, result, names, values);
+    if(list == NULL) {
+        return noDataTable("No data entry found in database.")->getPVStructure();
+    }
+    StageTimer build(handler.function.metrics.get(), FunctionMetrics::buildStage);
+    return retrieveServiceConfigEvents(handler.function.name, list, handler.numeric)->getPVStructure();
+}
+
+PVStructurePtr DSL_RDB::callChannelHistory(Handler const & handler,
+    shared_vector<const string> const & names, shared_vector<const string> const & values)
+{
+    TimedPyLockGIL gil(handler.function.metrics.get());
+    PyObj result;
+    PyObject * list = callPython(handler, result, names, values);
+    if(list == NULL) {
+        return noDataTable("No data entry found in database.")->getPVStructure();
+    }
+    StageTimer build(handler.function.metrics.get(), FunctionMetrics::buildStage);
+    return retrieveChannelHistory(list)->getPVStructure();
+}
+
+static const char * laneName(DSLFunction::Lane lane)
+{
+    switch (lane) {
+    case DSLFunction::queryLane: return "query";
+    case DSLFunction::machineLane: return "machine";
+    case DSLFunction::writeLane: return "write";
+    }
+    return "";
+}
+
+/**
+ * Reply of retrieveServiceMetrics: one row per function and stage which has been recorded,
+ * with percentiles, mean and maximum in microseconds,
+ * and the lane, readOnly and touchesMachine declared by the function.
+ */
+PVStructurePtr DSL_RDB::callServiceMetrics(Handler const & handler,
+    shared_vector<const string> const & names, shared_vector<const string> const & values)
+{
+    shared_vector<string> function, stage, lane;
+    shared_vector<boolean> readOnly, touchesMachine;
+    shared_vector<int64> count;
+    shared_vector<double> p50, p90, p99, mean, maximum;
+    for(std::map<string, Handler>::const_iterator it = handlers.begin(); it != handlers.end(); ++it) {
+        DSLFunction const & declared = it->second.function;
+        FunctionMetrics const & metrics = *declared.metrics;
+        for(int i = 0; i < FunctionMetrics::numberStages; i++) {
+            FunctionMetrics::Stage s = (FunctionMetrics::Stage)i;
+            LatencyHistogram const & histogram = metrics.histogram(s);
+            if(histogram.count() == 0) continue;
+            function.push_back(it->first);
+            stage.push_back(FunctionMetrics::stageName(s));
+            lane.push_back(laneName(declared.lane));
+            readOnly.push_back(declared.readOnly);
+            touchesMachine.push_back(declared.touchesMachine);
+            count.push_back(histogram.count());
+            p50.push_back(histogram.percentile(0.5));
+            p90.push_back(histogram.percentile(0.9));
+            p99.push_back(histogram.percentile(0.99));
+            mean.push_back(histogram.mean());
+            maximum.push_back(histogram.max());
+        }
+    }
+
+    NTTablePtr ntTable = NTTable::createBuilder()->
+            addColumn("function", pvString)->
+            addColumn("stage", pvString)->
+            addColumn("count", pvLong)->
+            addColumn("p50", pvDouble)->
+            addColumn("p90", pvDouble)->
+            addColumn("p99", pvDouble)->
+            addColumn("mean", pvDouble)->
+            addColumn("max", pvDouble)->
+            addColumn("lane", pvString)->
+            addColumn("readOnly", pvBoolean)->
+            addColumn("touchesMachine", pvBoolean)->
+            addAlarm()->
+            addTimeStamp()->
+            create();
+    PVStructurePtr pvStructure = ntTable->getPVStructure();
+    pvStructure->getSubField<PVStringArray>("value.function")->replace(freeze(function));
+    pvStructure->getSubField<PVStringArray>("value.stage")->replace(freeze(stage));
+    pvStructure->getSubField<PVLongArray>("value.count")->replace(freeze(count));
+    pvStructure->getSubField<PVDoubleArray>("value.p50")->replace(freeze(p50));
+    pvStructure->getSubField<PVDoubleArray>("value.p90")->replace(freeze(p90));
+    pvStructure->getSubField<PVDoubleArray>("value.p99")->replace(freeze(p99));
+    pvStructure->getSubField<PVDoubleArray>("value.mean")->replace(freeze(mean));
+    pvStructure->getSubField<PVDoubleArray>("value.max")->replace(freeze(maximum));
+    pvStructure->getSubField<PVStringArray>("value.lane")->replace(freeze(lane));
+    pvStructure->getSubField<PVBooleanArray>("value.readOnly")->replace(freeze(readOnly));
+    pvStructure->getSubField<PVBooleanArray>("value.touchesMachine")->replace(freeze(touchesMachine));
+
+    PVTimeStamp pvTimeStamp;
+    ntTable->attachTimeStamp(pvTimeStamp);
+    TimeStamp timeStamp;
+    timeStamp.getCurrent();
+    timeStamp.setUserTag(0);
+    pvTimeStamp.set(timeStamp);
+    return pvStructure;
+}
+
+void DSL_RDB::warmUpMain(void * arg)
+{
+    DSL_RDBPtr * self = static_cast<DSL_RDBPtr*>(arg);
+    (*self)->warmUp();
+    delete self;
+}
+
+/**
+ * Connect the channels of every active config into the gather pool,
+ * one config after another, so that the first saveSnapshot after a start
+ * does not pay the channel searches.
+ */
+void DSL_RDB::warmUp()
+{
+    const char * mode = getenv("MASAR_WARMUP");
+    bool createGet = !(mode && strcmp(mode, "connect")==0);
+    // seconds between two configs, to spread the searches
+    const char * pause = getenv("MASAR_WARMUP_PAUSE");
+    double interval = pause ? atof(pause) : 0.5;
+    const string serviceName(defaultServiceName());
+
+    std::vector<string> configs;
+    {
+        PyLockGIL gil;
+        shared_vector<string> argNames(1, "servicename"), argValues(1, serviceName);
+        PyObj pyTuple(PyTuple_New(1));
+        PyTuple_SetItem(pyTuple.get(), 0, newArgument("retrieveActiveConfigs", freeze(argNames), freeze(argValues)));
+        PyObject * result = PyEval_CallObject(pactiveconfigs, pyTuple.get());
         if(result == NULL) {
-            pvReturn = noDataMultiChannel("No data entry found in database.");
-        } else {
-            PyObject *list = 0;
-            if(!PyArg_ParseTuple(result,"O!:dslPY", &PyList_Type,&list))
-            {
-               throw std::runtime_error("Wrong format for returned data from dslPY.");
-            }
-            pvReturn = retrieveSnapshot(list);
-        }
-        Py_XDECREF(result);
-        PyGILState_Release(gstate);
-        return pvReturn->getPVStructure();
-    } else if (functionName.compare("saveSnapshot")==0) {
-        NTMultiChannelPtr pvReturn;
-        // A tuple is needed to pass to Python as parameter.
-        PyObject * pyTuple = PyTuple_New(1);
-        // put dictionary into the tuple
-        PyTuple_SetItem(pyTuple, 0, pyDict);
-        PyObject *pchannelnames = PyEval_CallObject(pgetchannames, pyTuple);
-        if(pchannelnames == NULL) {
-            pvReturn = noDataMultiChannel("Failed to retrieve channel names.");
+            PyErr_Print();
         } else {
-            Py_ssize_t list_len = PyList_Size(pchannelnames);
-
-            shared_vector<string> channames(list_len);
-            PyObject * name;
-            for (ssize_t i = 0; i < list_len; i ++) {
-                name = PyList_GetItem(pchannelnames, i);
-                channames[i] = PyString_AsString(name);
-            }
-            if (channames.size() == 0) {
-                pvReturn = noDataMultiChannel("Failed to retrieve channel names.");
-                Py_DECREF(pchannelnames);
-            } else {
-                shared_vector<const string> names(freeze(channames));
-                Py_DECREF(pchannelnames);
-                NTMultiChannelPtr data = getLiveMachine(names);
-                PVStructurePtr pvStructure = data->getPVStructure();
-
-                // create a tuple is needed to pass to Python as parameter.
-                PyObject * pdata = PyCapsule_New(&pvStructure, "pvStructure", 0);
-                PyObject * pyTuple2 = PyTuple_New(2);
-
-                // first value is the data from live machine
-                PyTuple_SetItem(pyTuple2, 0, pdata);
-                // second value is the dictionary
-                PyTuple_SetItem(pyTuple2, 1, pyDict);
-                PyObject *result = PyEval_CallObject(prequest,pyTuple2);
-                if(result == NULL) {
-                    pvReturn = noDataMultiChannel("Failed to save snapshot.");
-                } else {
-                    pvReturn = saveSnapshot(result, data);
-                    Py_DECREF(result);
+            if(PyList_Check(result)) {
+                for(Py_ssize_t i = 0; i < PyList_Size(result); i++) {
+                    const char * name = PyString_AsString(PyList_GetItem(result, i));
+                    if(name) configs.push_back(name);
+                    else PyErr_Clear();
                 }
-                Py_DECREF(pyTuple2);
             }
+            Py_DECREF(result);
         }
-        Py_DECREF(pyTuple);
-        PyGILState_Release(gstate);
-        return pvReturn->getPVStructure();
-    } else {
-        NTTablePtr pvReturn;
-        // A tuple is needed to pass to Python as parameter.
-        PyObject * pyTuple = PyTuple_New(1);
-        // put dictionary into the tuple
-        PyTuple_SetItem(pyTuple, 0, pyDict);
-
-        PyObject *result = PyEval_CallObject(prequest,pyTuple);
-        Py_DECREF(pyTuple);
-        if(result == NULL) {
-            pvReturn = noDataTable("No data entry found in database.");
-        } else {
-            PyObject *list = 0;
-            if(!PyArg_ParseTuple(result,"O!:dslPY", &PyList_Type,&list))
+    }
+    {
+        Lock guard(warmMutex);
+        warmStates.resize(configs.size());
+        for(size_t i = 0; i < configs.size(); i++) {
+            warmStates[i].configName = configs[i];
+            warmStates[i].channels = 0;
+            warmStates[i].connected = 0;
+            warmStates[i].state = "waiting";
+        }
+    }
+    for(size_t i = 0; i < configs.size(); i++) {
+        shared_vector<const string> channelNames;
+        string config;
+        {
+            PyLockGIL gil;
+            shared_vector<string> argNames(2), argValues(2);
+            argNames[0] = "servicename";
+            argValues[0] = serviceName;
+            argNames[1] = "configname";
+            argValues[1] = configs[i];
+            shared_vector<const string> names(freeze(argNames)), values(freeze(argValues));
+            PyObj pyTuple(PyTuple_New(1));
+            PyTuple_SetItem(pyTuple.get(), 0, newArgument("saveSnapshot", names, values));
+            channelNames = getChannelNames(pyTuple.get(), names, values);
+            if(channelNames.size() == 0) PyErr_Clear();
+            config = configKey(names, values);
+        }
+        size_t connected = 0;
+        if(channelNames.size() > 0) {
             {
-                throw std::runtime_error("Wrong format for returned data from dslPY.");
-            }
-            if (functionName.compare("retrieveServiceEvents")==0) {
-                pvReturn = retrieveServiceConfigEvents(list, 2);
-            } else if (functionName.compare("retrieveServiceConfigs")==0) {
-                pvReturn = retrieveServiceConfigEvents(list, 1);
-            } else if (functionName.compare("retrieveServiceConfigProps")==0) {
-                pvReturn = retrieveServiceConfigEvents(list, 2);
-            } else {
-                pvReturn = noDataTable("Did not find data");
+                Lock guard(warmMutex);
+                warmStates[i].channels = channelNames.size();
+                warmStates[i].state = "connecting";
             }
-            Py_DECREF(result);
+            // generous, nobody waits for it
+            connected = liveGather->warm(config, channelNames, 5.0, createGet);
+        }
+        {
+            Lock guard(warmMutex);
+            warmStates[i].connected = connected;
+            if(channelNames.size() == 0) warmStates[i].state = "no channels";
+            else if(connected == channelNames.size()) warmStates[i].state = "ready";
+            else warmStates[i].state = "partly connected";
+        }
+        if(interval > 0 && i+1 < configs.size()) epicsThreadSleep(interval);
+    }
+    Lock guard(warmMutex);
+    warmDone = true;
+    cout << "DSL_RDB::warmUp " << configs.size() << " configs done" << endl;
+}
+
+/**
+ * Reply of retrieveServiceStatus: the warm up state of each active config.
+ * The alarm is minor while the warm up is running, its message tells the progress.
+ */
+PVStructurePtr DSL_RDB::callServiceStatus(Handler const & handler,
+    shared_vector<const string> const & names, shared_vector<const string> const & values)
+{
+    shared_vector<string> configName, state;
+    shared_vector<int64> channels, connected;
+    bool done;
+    size_t ready = 0;
+    {
+        Lock guard(warmMutex);
+        done = warmDone;
+        for(size_t i = 0; i < warmStates.size(); i++) {
+            configName.push_back(warmStates[i].configName);
+            state.push_back(warmStates[i].state);
+            channels.push_back(warmStates[i].channels);
+            connected.push_back(warmStates[i].connected);
+            if(warmStates[i].state != "waiting" && warmStates[i].state != "connecting") ready++;
         }
-        PyGILState_Release(gstate);
-        return pvReturn->getPVStructure();
     }
-//}catch(python_exception& e){
-//    PyErr_Print(); // TODO: print exception message/stack to string and return
-//    PyErr_Clear();
-//    throw epics::pvAccess::RPCRequestException(Status::STATUSTYPE_ERROR,"Python exception, check server log");
-//}
+    NTTablePtr ntTable = NTTable::createBuilder()->
+            addColumn("configName", pvString)->
+            addColumn("channels", pvLong)->
+            addColumn("connected", pvLong)->
+            addColumn("state", pvString)->
+            addAlarm()->
+            addTimeStamp()->
+            create();
+    PVStructurePtr pvStructure = ntTable->getPVStructure();
+    size_t total = configName.size();
+    pvStructure->getSubField<PVStringArray>("value.configName")->replace(freeze(configName));
+    pvStructure->getSubField<PVLongArray>("value.channels")->replace(freeze(channels));
+    pvStructure->getSubField<PVLongArray>("value.connected")->replace(freeze(connected));
+    pvStructure->getSubField<PVStringArray>("value.state")->replace(freeze(state));
+
+    PVAlarm pvAlarm;
+    Alarm alarm;
+    ntTable->attachAlarm(pvAlarm);
+    if(done) {
+        alarm.setMessage("ready");
+        alarm.setSeverity(noAlarm);
+    } else {
+        ostringstream message;
+        message << "warming up, " << ready << " of " << total << " configs done";
+        alarm.setMessage(message.str());
+        alarm.setSeverity(minorAlarm);
+    }
+    alarm.setStatus(clientStatus);
+    pvAlarm.set(alarm);
+
+    PVTimeStamp pvTimeStamp;
+    ntTable->attachTimeStamp(pvTimeStamp);
+    TimeStamp timeStamp;
+    timeStamp.getCurrent();
+    timeStamp.setUserTag(0);
+    pvTimeStamp.set(timeStamp);
+    return pvStructure;
 }
 
 DSLPtr createDSL_RDB()
@@ -0,0 +1,114 @@
+/* masarMetrics.cpp */
+/**
+ * Copyright - See the COPYRIGHT that is included with this distribution.
+ * This code is distributed subject to a Software License Agreement found
+ * in file LICENSE that is included with this distribution.
+ */
+
+#include <cstring>
+
+#include <epicsAtomic.h>
+
+#include <pv/masarMetrics.h>
+
+namespace epics { namespace masar {
+
+using namespace epics::pvData;
+
+LatencyHistogram::LatencyHistogram()
+: total(0), sum(0), maximum(0)
+{
+    memset(counts, 0, sizeof(counts));
+}
+
+size_t LatencyHistogram::bucketIndex(uint64 micros)
+{
+    if(micros < (uint64)subBuckets) return (size_t)micros;
+    int exponent = 0;
+    for(uint64 v = micros; v > 1; v >>= 1) ++exponent;
+    if(exponent > maxExponent) return numberBuckets-1;
+    // micros >> (exponent-subBucketBits) is within [subBuckets, 2*subBuckets)
+    uint64 sub = (micros >> (exponent-subBucketBits)) - subBuckets;
+    return (size_t)((exponent-subBucketBits+1)*subBuckets + sub);
+}
+
+double LatencyHistogram::bucketValue(size_t index)
+{
+    if(index < (size_t)subBuckets) return (double)index;
+    int exponent = (int)(index/subBuckets) + subBucketBits - 1;
+    uint64 sub = index%subBuckets;
+    uint64 width = (uint64)1 << (exponent-subBucketBits);
+    // middle of the bucket
+    return (double)((subBuckets+sub)*width) + (width-1)/2.0;
+}
+
+void LatencyHistogram::record(double seconds)
+{
+    if(seconds < 0) seconds = 0;
+    double value = seconds*1e6 + 0.5;
+    uint64 micros = value < 1.8e19 ? (uint64)value : (uint64)-1;
+    epicsAtomicIncrSizeT(&counts[bucketIndex(micros)]);
+    epicsAtomicIncrSizeT(&total);
+    size_t add = micros < (uint64)(size_t)-1 ? (size_t)micros : (size_t)-1;
+    epicsAtomicAddSizeT(&sum, add);
+    size_t current = epicsAtomicGetSizeT(&maximum);
+    while(add > current) {
+        size_t previous = epicsAtomicCmpAndSwapSizeT(&maximum, current, add);
+        if(previous == current) break;
+        current = previous;
+    }
+}
+
+size_t LatencyHistogram::count() const
+{
+    return epicsAtomicGetSizeT(const_cast<size_t*>(&total));
+}
+
+double LatencyHistogram::percentile(double q) const
+{
+    // buckets are read one by one, concurrent records may be partly seen
+    size_t snapshot[numberBuckets];
+    size_t n = 0;
+    for(size_t i=0; i<(size_t)numberBuckets; ++i) {
+        snapshot[i] = epicsAtomicGetSizeT(const_cast<size_t*>(&counts[i]));
+        n += snapshot[i];
+    }
+    if(n==0) return 0.0;
+    size_t rank = (size_t)(q*n);
+    if(rank >= n) rank = n-1;
+    size_t seen = 0;
+    for(size_t i=0; i<(size_t)numberBuckets; ++i) {
+        seen += snapshot[i];
+        if(seen > rank) return bucketValue(i);
+    }
+    return bucketValue(numberBuckets-1);
+}
+
+double LatencyHistogram::mean() const
+{
+    size_t n = count();
+    if(n==0) return 0.0;
+    return (double)epicsAtomicGetSizeT(const_cast<size_t*>(&sum))/n;
+}
+
+double LatencyHistogram::max() const
+{
+    return (double)epicsAtomicGetSizeT(const_cast<size_t*>(&maximum));
+}
+
+const char * FunctionMetrics::stageName(Stage stage)
+{
+    switch(stage) {
+    case totalStage: return "total";
+    case parseStage: return "parse";
+    case gilWaitStage: return "gilWait";
+    case channelNamesStage: return "channelNames";
+    case gatherConnectStage: return "gatherConnect";
+    case gatherGetStage: return "gatherGet";
+    case pythonStage: return "python";
+    case buildStage: return "build";
+    default: return "unknown";
+    }
+}
+
+}}
@@ -0,0 +1,115 @@
+/* masarMetrics.h */
+/**
+ * Copyright - See the COPYRIGHT that is included with this distribution.
+ * This code is distributed subject to a Software License Agreement found
+ * in file LICENSE that is included with this distribution.
+ *
+ * Latency histograms of the stages a masar service request goes through.
+ * Recording is lock free, so it can stay enabled on the hot path.
+ */
+#ifndef MASAR_METRICS_H
+#define MASAR_METRICS_H
+
+#include <cstddef>
+
+#include <epicsTime.h>
+
+#include <pv/pvData.h>
+
+namespace epics { namespace masar {
+
+/**
+ * Histogram of durations in microseconds with logarithmic buckets,
+ * each power of two split into 16 linear sub buckets (about 6% resolution),
+ * in the style of an HDR histogram.
+ * Durations above 2^40 microseconds go into the last bucket.
+ */
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+    /**
+     * Add one duration. Safe to call from any number of threads.
+     */
+    void record(double seconds);
+    /**
+     * Number of recorded durations.
+     */
+    size_t count() const;
+    /**
+     * Duration in microseconds below which the fraction q of recorded durations lie,
+     * 0 if nothing was recorded.
+     */
+    double percentile(double q) const;
+    double mean() const;
+    double max() const;
+
+    enum {subBucketBits = 4, subBuckets = 1<<subBucketBits, maxExponent = 40,
+          numberBuckets = (maxExponent-subBucketBits+2)*subBuckets};
+    static size_t bucketIndex(epics::pvData::uint64 micros);
+    static double bucketValue(size_t index);
+private:
+    size_t counts[numberBuckets];
+    size_t total;
+    size_t sum;
+    size_t maximum;
+};
+
+/**
+ * Stage histograms of one service function.
+ */
+class FunctionMetrics
+{
+public:
+    POINTER_DEFINITIONS(FunctionMetrics);
+    enum Stage {
+        totalStage,         // whole MasarService::request
+        parseStage,         // argument parsing in MasarService
+        gilWaitStage,       // waiting for the Python GIL
+        channelNamesStage,  // resolving the channel names of a config
+        gatherConnectStage, // connecting channels of a live machine gather
+        gatherGetStage,     // reading channels of a live machine gather
+        pythonStage,        // Python DSL and database call
+        buildStage,         // building the normative type reply
+        numberStages
+    };
+    static const char * stageName(Stage stage);
+    void record(Stage stage, double seconds) {histograms[stage].record(seconds);}
+    LatencyHistogram const & histogram(Stage stage) const {return histograms[stage];}
+private:
+    LatencyHistogram histograms[numberStages];
+};
+typedef FunctionMetrics::shared_pointer FunctionMetricsPtr;
+
+/**
+ * Records the time from construction to destruction, or to stop(), into a stage.
+ * Does nothing if metrics is null.
+ */
+class StageTimer
+{
+public:
+    StageTimer(FunctionMetrics * metrics, FunctionMetrics::Stage stage)
+    : metrics(metrics), stage(stage)
+    {
+        if(metrics) epicsTimeGetCurrent(&start);
+    }
+    ~StageTimer() {stop();}
+    void stop()
+    {
+        if(!metrics) return;
+        epicsTimeStamp now;
+        epicsTimeGetCurrent(&now);
+        metrics->record(stage, epicsTimeDiffInSeconds(&now, &start));
+        metrics = 0;
+    }
+private:
+    StageTimer(const StageTimer&);
+    StageTimer& operator=(const StageTimer&);
+    FunctionMetrics * metrics;
+    FunctionMetrics::Stage stage;
+    epicsTimeStamp start;
+};
+
+}}
+
+#endif  /* MASAR_METRICS_H */
@@ -0,0 +1,381 @@
+/* masarScheduler.cpp */
+/**
+ * Copyright - See the COPYRIGHT that is included with this distribution.
+ * This code is distributed subject to a Software License Agreement found
+ * in file LICENSE that is included with this distribution.
+ */
+
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <cstdlib>
+
+#include <pv/pvData.h>
+#include <pv/nt.h>
+#include <pv/masarScheduler.h>
+
+namespace epics { namespace masar {
+
+using namespace std;
+using namespace epics::pvData;
+using namespace epics::nt;
+using std::tr1::dynamic_pointer_cast;
+
+static FieldCreatePtr fieldCreate = getFieldCreate();
+static PVDataCreatePtr pvDataCreate = getPVDataCreate();
+
+MasarScheduler::MasarScheduler(MasarServicePtr const & service, string const & serviceName)
+: service(service),
+  serviceName(serviceName),
+  spacing(5.0),
+  triggerPoll(1.0),
+  running(false),
+  stopping(false)
+{
+    epicsTimeGetCurrent(&lastSave);
+    epicsTimeAddSeconds(&lastSave, -spacing);
+}
+
+MasarScheduler::~MasarScheduler()
+{
+    stop();
+}
+
+void MasarScheduler::setSpacing(double seconds)
+{
+    Lock guard(mutex);
+    spacing = seconds;
+}
+
+void MasarScheduler::setTriggerPoll(double seconds)
+{
+    Lock guard(mutex);
+    triggerPoll = seconds;
+}
+
+void MasarScheduler::add(EntryPtr const & entry)
+{
+    entry->triggerHigh = false;
+    entry->saves = 0;
+    entry->failures = 0;
+    entry->lastEvent = -1;
+    entry->lastSeconds = 0.0;
+    entry->scheduled = false;
+    {
+        Lock guard(mutex);
+        entries.push_back(entry);
+    }
+    // the scheduler thread sets the first due time
+    wakeup.signal();
+}
+
+void MasarScheduler::addPeriodic(string const & configName, double period, string const & comment)
+{
+    if(!(period > 0))
+        throw std::runtime_error("schedule period of " + configName + " has to be positive");
+    EntryPtr entry(new Entry());
+    entry->configName = configName;
+    entry->comment = comment;
+    entry->period = period;
+    add(entry);
+}
+
+void MasarScheduler::addTrigger(string const & configName, string const & triggerName, string const & comment)
+{
+    if(triggerName.empty())
+        throw std::runtime_error("schedule trigger of " + configName + " is empty");
+    EntryPtr entry(new Entry());
+    entry->configName = configName;
+    entry->comment = comment;
+    entry->period = 0.0;
+    entry->triggerName = triggerName;
+    add(entry);
+}
+
+/**
+ * Give periodic entries added since the last call their first due time,
+ * phase shifted evenly over the period among the entries of the same period.
+ * Entries already scheduled keep their due time.
+ * Called by the scheduler thread with mutex held.
+ */
+void MasarScheduler::spread()
+{
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    std::map<double, size_t> sharing;
+    for(size_t i=0; i<entries.size(); ++i) {
+        if(entries[i]->period > 0) sharing[entries[i]->period]++;
+    }
+    std::map<double, size_t> slot;
+    for(size_t i=0; i<entries.size(); ++i) {
+        Entry & entry = *entries[i];
+        if(entry.period <= 0) continue;
+        size_t n = slot[entry.period]++;
+        if(entry.scheduled) continue;
+        entry.due = now;
+        epicsTimeAddSeconds(&entry.due, entry.period*(n+1)/sharing[entry.period]);
+        entry.scheduled = true;
+    }
+}
+
+void MasarScheduler::load(string const & fileName)
+{
+    ifstream in(fileName.c_str());
+    if(!in)
+        throw std::runtime_error("can not read schedule file " + fileName);
+    string line;
+    int number = 0;
+    while(getline(in, line)) {
+        ++number;
+        size_t hash = line.find('#');
+        if(hash != string::npos) line.erase(hash);
+        istringstream words(line);
+        string configName;
+        words >> ws;
+        if(words.peek() == '"') {
+            words.get();
+            getline(words, configName, '"');
+        } else {
+            words >> configName;
+        }
+        if(configName.empty()) continue;
+        string when, comment;
+        words >> when;
+        getline(words >> ws, comment);
+        ostringstream where;
+        where << fileName << ":" << number << ": ";
+        if(when.compare(0, 8, "trigger=") == 0) {
+            addTrigger(configName, when.substr(8), comment);
+        } else {
+            char * end = 0;
+            double period = strtod(when.c_str(), &end);
+            if(when.empty() || *end != '\0' || !(period > 0))
+                throw std::runtime_error(where.str() + "expected a period in seconds or trigger=PVNAME");
+            addPeriodic(configName, period, comment);
+        }
+    }
+}
+
+void MasarScheduler::start()
+{
+    Lock guard(mutex);
+    if(running) return;
+    running = true;
+    stopping = false;
+    epicsThreadCreate("masarScheduler",
+                      epicsThreadPriorityLow,
+                      epicsThreadGetStackSize(epicsThreadStackBig),
+                      threadMain, this);
+}
+
+void MasarScheduler::stop()
+{
+    {
+        Lock guard(mutex);
+        if(!running) return;
+        stopping = true;
+    }
+    wakeup.signal();
+    stopped.wait();
+    Lock guard(mutex);
+    running = false;
+}
+
+void MasarScheduler::threadMain(void * arg)
+{
+    static_cast<MasarScheduler*>(arg)->run();
+}
+
+void MasarScheduler::run()
+{
+    while(true) {
+        std::vector<EntryPtr> current;
+        double poll, gap;
+        {
+            Lock guard(mutex);
+            if(stopping) break;
+            spread();
+            current = entries;
+            poll = triggerPoll;
+            gap = spacing;
+        }
+
+        epicsTimeStamp now;
+        epicsTimeGetCurrent(&now);
+        bool hasTrigger = false;
+        EntryPtr next;
+        for(size_t i=0; i<current.size(); ++i) {
+            if(current[i]->period <= 0) {
+                hasTrigger = true;
+            } else if(!next || epicsTimeLessThan(&current[i]->due, &next->due)) {
+                next = current[i];
+            }
+        }
+
+        double sinceSave = epicsTimeDiffInSeconds(&now, &lastSave);
+        if(next && epicsTimeDiffInSeconds(&now, &next->due) >= 0 && sinceSave >= gap) {
+            save(*next);
+            epicsTimeGetCurrent(&now);
+            // skip the periods missed by a long save
+            while(epicsTimeDiffInSeconds(&now, &next->due) >= 0) {
+                epicsTimeAddSeconds(&next->due, next->period);
+            }
+            continue;
+        }
+
+        if(hasTrigger) {
+            for(size_t i=0; i<current.size(); ++i) {
+                Entry & entry = *current[i];
+                if(entry.period > 0) continue;
+                bool high = entry.triggerHigh;
+                if(readTrigger(entry) && !high) {
+                    epicsTimeGetCurrent(&now);
+                    double wait = gap - epicsTimeDiffInSeconds(&now, &lastSave);
+                    if(wait > 0) epicsThreadSleep(wait);
+                    save(entry);
+                }
+            }
+        }
+
+        double wait = hasTrigger ? poll : 3600.0;
+        if(next) {
+            epicsTimeGetCurrent(&now);
+            double untilDue = epicsTimeDiffInSeconds(&next->due, &now);
+            double untilGap = gap - epicsTimeDiffInSeconds(&now, &lastSave);
+            double until = untilDue > untilGap ? untilDue : untilGap;
+            if(until < wait) wait = until;
+        }
+        if(wait > 0) wakeup.wait(wait);
+    }
+    Lock guard(mutex);
+    for(size_t i=0; i<entries.size(); ++i) {
+        if(entries[i]->trigger) {
+            entries[i]->trigger->destroy();
+            entries[i]->trigger.reset();
+        }
+    }
+    stopped.signal();
+}
+
+/**
+ * Read a trigger PV, return true if it is non zero.
+ * The channel stays connected between reads, and is connected again after a failure.
+ */
+bool MasarScheduler::readTrigger(Entry & entry)
+{
+    if(!entry.trigger) {
+        shared_vector<string> names(1, entry.triggerName);
+        entry.trigger = GatherV3Data::create(freeze(names));
+        if(!entry.trigger->connect(1.0)) {
+            entry.trigger->destroy();
+            entry.trigger.reset();
+            return entry.triggerHigh;
+        }
+    }
+    if(!entry.trigger->get()) {
+        entry.trigger->destroy();
+        entry.trigger.reset();
+        return entry.triggerHigh;
+    }
+    PVUnionArray::const_svector values = entry.trigger->getNTMultiChannel()->getValue()->view();
+    bool high = false;
+    if(values.size() == 1 && values[0]) {
+        PVScalarPtr scalar = dynamic_pointer_cast<PVScalar>(values[0]->get());
+        if(scalar) high = scalar->getAs<double>() != 0.0;
+    }
+    entry.triggerHigh = high;
+    return high;
+}
+
+/**
+ * Save a snapshot of the config of an entry, and approve it.
+ */
+void MasarScheduler::save(Entry & entry)
+{
+    epicsTimeStamp start;
+    epicsTimeGetCurrent(&start);
+    lastSave = start;
+
+    string message;
+    int64 eid = -1;
+    try {
+        StructureConstPtr type = fieldCreate->createFieldBuilder()->
+            add("function", pvString)->
+            add("servicename", pvString)->
+            add("configname", pvString)->
+            add("comment", pvString)->
+            createStructure();
+        PVStructurePtr argument = pvDataCreate->createPVStructure(type);
+        argument->getSubField<PVString>("function")->put("saveSnapshot");
+        argument->getSubField<PVString>("servicename")->put(serviceName);
+        argument->getSubField<PVString>("configname")->put(entry.configName);
+        argument->getSubField<PVString>("comment")->put(entry.comment);
+        PVStructurePtr result = service->request(argument);
+
+        NTMultiChannelPtr snapshot = NTMultiChannel::wrap(result);
+        PVStructurePtr timeStamp = result->getSubField<PVStructure>("timeStamp");
+        PVStringPtr alarmMessage = result->getSubField<PVString>("alarm.message");
+        if(snapshot && timeStamp && alarmMessage
+                && alarmMessage->get().compare("Machine preview Successed.") == 0) {
+            eid = timeStamp->getSubField<PVInt>("userTag")->get();
+            argument = pvDataCreate->createPVStructure(fieldCreate->createFieldBuilder()->
+                add("function", pvString)->
+                add("eventid", pvString)->
+                add("user", pvString)->
+                add("desc", pvString)->
+                createStructure());
+            ostringstream id;
+            id << eid;
+            argument->getSubField<PVString>("function")->put("updateSnapshotEvent");
+            argument->getSubField<PVString>("eventid")->put(id.str());
+            argument->getSubField<PVString>("user")->put("masarScheduler");
+            argument->getSubField<PVString>("desc")->put(entry.comment);
+            service->request(argument);
+            message = "saved";
+        } else {
+            message = alarmMessage ? alarmMessage->get() : string("saveSnapshot failed");
+        }
+    } catch(std::exception & e) {
+        message = e.what();
+    }
+
+    epicsTimeStamp end;
+    epicsTimeGetCurrent(&end);
+    Lock guard(mutex);
+    if(eid >= 0) {
+        entry.saves++;
+        entry.lastEvent = eid;
+    } else {
+        entry.failures++;
+        cerr << "masarScheduler: " << entry.configName << ": " << message << endl;
+    }
+    entry.lastSeconds = epicsTimeDiffInSeconds(&end, &start);
+    entry.lastMessage = message;
+}
+
+void MasarScheduler::report(std::ostream & out)
+{
+    Lock guard(mutex);
+    out << (running ? "running" : "stopped") << ", " << entries.size() << " configs, "
+        << spacing << " s between saves" << endl;
+    for(size_t i=0; i<entries.size(); ++i) {
+        Entry const & entry = *entries[i];
+        out << "  " << entry.configName << ": ";
+        if(entry.period > 0) {
+            out << "every " << entry.period << " s";
+        } else {
+            out << "on " << entry.triggerName;
+        }
+        out << ", " << entry.saves << " saved, " << entry.failures << " failed";
+        if(entry.saves + entry.failures > 0) {
+            out << ", last event " << entry.lastEvent << " took " << entry.lastSeconds << " s: "
+                << entry.lastMessage;
+        }
+        out << endl;
+    }
+}
+
+}}
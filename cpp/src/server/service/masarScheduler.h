@@ -0,0 +1,128 @@
+/* masarScheduler.h */
+/**
+ * Copyright - See the COPYRIGHT that is included with this distribution.
+ * This code is distributed subject to a Software License Agreement found
+ * in file LICENSE that is included with this distribution.
+ *
+ * Unattended snapshots taken inside the service process.
+ */
+#ifndef MASAR_SCHEDULER_H
+#define MASAR_SCHEDULER_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <stdexcept>
+
+#include <epicsEvent.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+#include <pv/lock.h>
+#include <pv/pvData.h>
+#include <pv/gatherV3Data.h>
+#include <pv/masarService.h>
+
+namespace epics { namespace masar {
+
+class MasarScheduler;
+typedef std::tr1::shared_ptr<MasarScheduler> MasarSchedulerPtr;
+
+/**
+ * Saves and approves snapshots of configs through a MasarService,
+ * either every 'period' seconds or when a trigger PV changes from zero to non zero.
+ * All saves run one after another on the scheduler thread,
+ * at least 'spacing' seconds apart, and configs sharing a period are
+ * phase shifted over that period, so that their channel searches do not coincide.
+ * A save which overruns its period skips the missed ones instead of catching up.
+ *
+ * A schedule file has one config per line, '#' starts a comment:
+ *   configname period [comment]
+ *   configname trigger=PVNAME [comment]
+ * A config name containing blanks is written within double quotes.
+ */
+class MasarScheduler
+{
+public:
+    POINTER_DEFINITIONS(MasarScheduler);
+    /**
+     * @param service     The service which saves the snapshots.
+     * @param serviceName The masar service name passed to saveSnapshot.
+     */
+    MasarScheduler(MasarServicePtr const & service, std::string const & serviceName = "masar");
+    ~MasarScheduler();
+    /**
+     * Save a config every period seconds.
+     */
+    void addPeriodic(std::string const & configName, double period, std::string const & comment = "");
+    /**
+     * Save a config on every zero to non zero transition of a trigger PV.
+     */
+    void addTrigger(std::string const & configName, std::string const & triggerName,
+        std::string const & comment = "");
+    /**
+     * Add the entries of a schedule file.
+     * Throws std::runtime_error if the file can not be read or has a malformed line.
+     */
+    void load(std::string const & fileName);
+    /**
+     * Start the scheduler thread. Entries may be added before or after.
+     */
+    void start();
+    /**
+     * Stop the scheduler thread, after the save in progress if any.
+     */
+    void stop();
+    void report(std::ostream & out);
+    /**
+     * Minimum seconds between two saves, 5 by default.
+     */
+    void setSpacing(double seconds);
+    /**
+     * Seconds between two reads of the trigger PVs, 1 by default.
+     */
+    void setTriggerPoll(double seconds);
+private:
+    struct Entry
+    {
+        std::string configName;
+        std::string comment;
+        // 0 for a trigger entry
+        double period;
+        std::string triggerName;
+        // next save of a periodic entry, set and advanced by the scheduler thread only
+        epicsTimeStamp due;
+        bool scheduled;
+        GatherV3DataPtr trigger;
+        bool triggerHigh;
+        size_t saves;
+        size_t failures;
+        epics::pvData::int64 lastEvent;
+        double lastSeconds;
+        std::string lastMessage;
+    };
+    typedef std::tr1::shared_ptr<Entry> EntryPtr;
+    void add(EntryPtr const & entry);
+    static void threadMain(void * arg);
+    void run();
+    void spread();
+    bool readTrigger(Entry & entry);
+    void save(Entry & entry);
+
+    MasarServicePtr service;
+    const std::string serviceName;
+    double spacing;
+    double triggerPoll;
+    epics::pvData::Mutex mutex;
+    // guarded by mutex, an entry itself is only changed by the scheduler thread
+    std::vector<EntryPtr> entries;
+    epicsEvent wakeup;
+    epicsEvent stopped;
+    bool running;
+    bool stopping;
+    epicsTimeStamp lastSave;
+};
+
+}}
+
+#endif  /* MASAR_SCHEDULER_H */
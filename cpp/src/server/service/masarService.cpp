@@ -54,6 +54,13 @@ PVStructurePtr MasarService::request(
             throw epics::pvAccess::RPCRequestException(
                         Status::STATUSTYPE_ERROR,"pvArgument has an unsupported function");
         }
+        const DSLFunction * function = dslRdb->getFunction(functionName);
+        if(function == NULL) {
+            throw epics::pvAccess::RPCRequestException(
+                        Status::STATUSTYPE_ERROR,"unsupported function " + functionName);
+        }
+        StageTimer total(function->metrics.get(), FunctionMetrics::totalStage);
+        StageTimer parse(function->metrics.get(), FunctionMetrics::parseStage);
 
         if(!NTNameValue::is_a(pvArgument->getStructure())) {
             // support non NTNameValue Pair for some general purpose client, for example command line tools
@@ -71,12 +78,14 @@ PVStructurePtr MasarService::request(
                 }
             }
 
+            parse.stop();
             PVStructurePtr result = dslRdb->request(functionName, freeze(names), freeze(values));
             return result;
         } else{
 
             const shared_vector<const string> name = pvArgument->getSubFieldT<PVStringArray>("name")->view();
             const shared_vector<const string> value = pvArgument->getSubFieldT<PVStringArray>("value")->view();
+            parse.stop();
             PVStructurePtr result = dslRdb->request(functionName, name, value);
             return result;
         }
@@ -54,7 +54,9 @@ class client():
             raise Exception(channelRPC.getMessage())
         if function in ["retrieveSnapshot", "getLiveMachine", "saveSnapshot"]:
             result = NTMultiChannel(result)
-        elif function in ["retrieveServiceEvents", "retrieveServiceConfigs", "retrieveServiceConfigProps"]:
+        elif function in ["retrieveServiceEvents", "retrieveServiceConfigs", "retrieveServiceConfigProps",
+                          "retrieveChannelHistory", "retrieveServiceMetrics",
+                          "retrieveServiceStatus"]:
             result = NTTable(result)
         elif function == "updateSnapshotEvent":
             result = NTScalar(result)
@@ -141,6 +143,11 @@ class client():
                     'end':      The time range to
                     'comment':  event contain given comment. 
                     'user':     who did that event
+                    'limit':    return at most that many events
+                    'offset':   skip that many events
+                    'before':   return only events older than given event id
+                    'order':    'asc' or 'desc' by event time, for example
+                                {'configid': '1', 'order': 'desc', 'limit': '20'} gets the newest 20 events
         result:     list of list with the following format:
                     id []:     list of each event id
                     comment:   a list to show comment for each event
@@ -200,6 +207,8 @@ class client():
                     'start':    The time range from
                     'end':      The time range to
                     'comment':  event contain given comment. 
+                    'widen':    'true' to get char and short values as int, and float as double.
+                                By default values keep the element type of their channel.
 
         result:     list of list with the following format:
                     pv name []:          pv name list
@@ -242,6 +251,97 @@ class client():
                 ntmultichannels.getStatus(),
                 ntmultichannels.getMessage())
         
+    def retrieveChannelHistory(self, params):
+        """
+        Retrieve the saved values of one or more pvs across all approved snapshots.
+        
+        Parameters: a dictionary which can have any combination of the following predefined keys:
+                    'pvname':   pv name, or several pv names separated by comma
+                    'start':    [optional] The time range from
+                    'end':      [optional] The time range to
+        result:     list of list with the following format, one entry per pv per event:
+                    pv name []:      pv name list
+                    id []:           event id list
+                    date []:         time list to show when that event happened in UTC format
+                    value []:        numeric value, NaN for string and array
+                    string value []: value in string format
+                    alarmSeverity []: EPICS IOC severity
+                    
+                    otherwise, False if nothing is found.
+        """
+        function = 'retrieveChannelHistory'
+        nttable = self.__clientRPC(function, params)
+
+        if not isinstance(nttable, NTTable):
+            raise RuntimeError("Wrong returned data type")
+        if self.__isFault(nttable):
+            return False
+
+        return (nttable.getColumn('channelName'),
+                nttable.getColumn('eventid'),
+                nttable.getColumn('time'),
+                nttable.getColumn('value'),
+                nttable.getColumn('stringValue'),
+                nttable.getColumn('severity'))
+
+    def retrieveServiceMetrics(self):
+        """
+        Retrieve the latency statistics the service collected since it started,
+        one entry per function and per stage of a request, for example python or gatherGet.
+        
+        result:     list of list with the following format:
+                    function []: function name list
+                    stage []:    stage name list
+                    count []:    number of recorded requests
+                    p50 []:      median latency in microseconds
+                    p99 []:      99th percentile latency in microseconds
+                    max []:      maximum latency in microseconds
+                    
+                    otherwise, False if nothing is found.
+        """
+        function = 'retrieveServiceMetrics'
+        nttable = self.__clientRPC(function, {})
+
+        if not isinstance(nttable, NTTable):
+            raise RuntimeError("Wrong returned data type")
+        if self.__isFault(nttable):
+            return False
+
+        return (nttable.getColumn('function'),
+                nttable.getColumn('stage'),
+                nttable.getColumn('count'),
+                nttable.getColumn('p50'),
+                nttable.getColumn('p99'),
+                nttable.getColumn('max'))
+
+    def retrieveServiceStatus(self):
+        """
+        Retrieve the state of the channel warm up the service runs at start,
+        one entry per active configuration.
+        
+        result:     tuple of the following format:
+                    ready:        True when the warm up is finished
+                    message:      progress of the warm up
+                    configName []: configuration name list
+                    channels []:  number of channels of each configuration
+                    connected []: number of connected channels
+                    state []:     waiting, connecting, ready, partly connected or no channels
+        """
+        function = 'retrieveServiceStatus'
+        nttable = self.__clientRPC(function, {})
+
+        if not isinstance(nttable, NTTable):
+            raise RuntimeError("Wrong returned data type")
+        alarm = Alarm()
+        nttable.getAlarm(alarm)
+        message = alarm.getMessage()
+        return (message == 'ready',
+                message,
+                nttable.getColumn('configName'),
+                nttable.getColumn('channels'),
+                nttable.getColumn('connected'),
+                nttable.getColumn('state'))
+
     def saveSnapshot(self, params):
         """
         This function is to take a machine snapshot data and send data to client for preview . 
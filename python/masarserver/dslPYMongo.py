@@ -6,7 +6,6 @@
 # Author: Guobao Shen   2014.08
 
 import os
-import re
 import json
 
 from masarclient.ntmultiChannel import NTMultiChannel
@@ -33,24 +32,29 @@ class DSL(object):
         self.epicsString = [0, 3]
         self.epicsDouble = [2, 6]
         self.epicsNoAccess = [7]
+        self._actions = {}
+        for fname, func in (("retrieveServiceConfigProps", self.retrieveSystems),
+                            ("retrieveServiceConfigs", self.retrieveServiceConfigs),
+                            ("retrieveServiceEvents", self.retrieveServiceEvents),
+                            ("retrieveSnapshot", self.retrieveSnapshot),
+                            ("saveSnapshot", self.saveSnapshot),
+                            ('updateSnapshotEvent', self.approveSnapshotEvent)):
+            self.register(fname, func)
 
     def __del__(self):
         """destructor"""
         print ('close MongoDB connection.')
         #utils.close(self.mongoconn)
 
+    def register(self, fname, func):
+        """serve function fname by calling func with the request arguments"""
+        self._actions[fname] = func
+
     def dispatch(self, fname, fargs):
         """Dispatch a request"""
-        actions = (("retrieveServiceConfigProps", self.retrieveSystems),
-                   ("retrieveServiceConfigs", self.retrieveServiceConfigs),
-                   ("retrieveServiceEvents", self.retrieveServiceEvents),
-                   ("retrieveSnapshot", self.retrieveSnapshot),
-                   ("saveSnapshot", self.saveSnapshot),
-                   ('updateSnapshotEvent', self.approveSnapshotEvent)
-                   )
-        for (params, func) in actions:
-            if re.match(params, fname):
-                return func(fargs)
+        func = self._actions.get(fname)
+        if func is not None:
+            return func(fargs)
 
     def request(self, *argument):
         """issue request"""
@@ -227,8 +231,10 @@ class DSL(object):
         :raises:
 
         """
-        key = ['eventid', 'comment']
-        eid, _ = self._parseParams(params, key)
+        key = ['eventid', 'comment', 'start', 'end']
+        eid, comment, start, end = self._parseParams(params, key)
+        if (eid is None and (start is not None or end is not None)) or (eid is not None and ',' in eid):
+            return self._retrieveSnapshots(eid, start, end, comment)
         result = [[('user tag', 'event time', 'service config name', 'service name'),
                    ('pv name', 'string value', 'double value', 'long value', 'dbr type', 'isConnected',
                     'secondsPastEpoch', 'nanoSeconds', 'timeStampTag', 'alarmSeverity', 'alarmStatus', 'alarmMessage',
@@ -248,6 +254,41 @@ class DSL(object):
             result.append(temp)
         return result
 
+    def _retrieveSnapshots(self, eid, start, end, comment):
+        """Retrieve data of several events over a single connection
+
+        :returns: 2 lists with header description as first row. Structure like: ::
+
+            [[('event id', 'user tag', 'event UTC time', 'service config name', 'service name'),
+              (eventid, comment, date, config name, None), ...],
+             [('event id', 'pv name', 'string value', ..., 'is_array', 'array_value'),
+              (eventid, value for pv1 as retrieveSnapshot), ...]]
+
+        """
+        events = [('event id', 'user tag', 'event UTC time', 'service config name', 'service name')]
+        datas = [('event id', 'pv name', 'string value', 'double value', 'long value', 'dbr type', 'isConnected',
+                  'secondsPastEpoch', 'nanoSeconds', 'timeStampTag', 'alarmSeverity', 'alarmStatus', 'alarmMessage',
+                  'is_array', 'array_value')]
+        mongoconn, collection = utils.conn(host=os.environ["MASAR_MONGO_HOST"],
+                                           port=os.environ["MASAR_MONGO_PORT"],
+                                           db=os.environ["MASAR_MONGO_DB"])
+        if eid is not None:
+            eids = [int(e) for e in eid.split(',') if e.strip()]
+        else:
+            eids = [res["eventidx"] for res in pymasar.retrieveevents(mongoconn, collection, start=start, end=end,
+                                                                      comment=comment, approval=True)]
+        confignames = {}
+        for e in sorted(eids):
+            eiddata = pymasar.retrievesnapshot(mongoconn, collection, e)
+            configidx = eiddata["configidx"]
+            if configidx not in confignames:
+                confignames[configidx] = pymasar.retrieveconfig(mongoconn, collection, configidx=configidx)[0]["name"]
+            events.append((e, eiddata["comment"], eiddata["created_on"], confignames[configidx], None))
+            for d in eiddata["masar_data"]:
+                datas.append((e, ) + tuple(d))
+        utils.close(mongoconn)
+        return [events, datas]
+
     def saveSnapshot(self, params):
         """Save event with data.
 
@@ -383,6 +424,21 @@ class DSL(object):
 
         return results
 
+    def retrieveActiveConfigs(self, params):
+        """Names of the active configurations, which the server connects ahead at start.
+
+        :returns: list of configuration names like: ::
+
+            [config1, config2, ...]
+
+        """
+        mongoconn, collection = utils.conn(host=os.environ["MASAR_MONGO_HOST"],
+                                           port=os.environ["MASAR_MONGO_PORT"],
+                                           db=os.environ["MASAR_MONGO_DB"])
+        result = pymasar.retrieveconfig(mongoconn, collection, status="active")
+        utils.close(mongoconn)
+        return [str(res["name"]) for res in result]
+
     def approveSnapshotEvent(self, params):
         """Approve a new snapshot
 
@@ -6,7 +6,8 @@
 # Author: Guobao Shen   2012.01
 #         Marty Kraimer 2011.11
 
-import re
+import os
+import array
 
 from masarclient.ntmultiChannel import NTMultiChannel
 import pymasarsqlite as pymasar
@@ -18,7 +19,8 @@ class DSL(object):
     """Implements an IRMIS request."""
     def __init__(self) :
         """constructor"""
-        self.__servicename = 'masar'
+        # default service of requests which name none, as for the warm up of the server
+        self.__servicename = os.environ.get('MASAR_SERVICE_NAME', 'masar')
         #define    DBF_STRING  0
         #define    DBF_INT     1
         #define    DBF_SHORT   1
@@ -31,22 +33,40 @@ class DSL(object):
         self.epicsString = [0, 3]
         self.epicsDouble = [2, 6]
         self.epicsNoAccess = [7]
+        # save every n-th snapshot of a configuration in full, and only changed channels in between.
+        # 0 (default) or 1 saves every snapshot in full.
+        self.keyframe = int(os.environ.get('MASAR_KEYFRAME_INTERVAL', 0))
+        # with a staging file, saveSnapshot replies once the data is staged,
+        # and a background thread saves it into the database.
+        self.staging = None
+        if os.environ.get('MASAR_STAGING'):
+            self.staging = pymasar.masardata.StagedWriter(os.environ['MASAR_STAGING'], pymasar.utils.connect,
+                                                          keyframe=self.keyframe)
+        # seconds a query over saved events waits for the staged ones to be saved
+        self.flushTimeout = float(os.environ.get('MASAR_STAGING_FLUSH_TIMEOUT', 10.0))
+        self._actions = {}
+        for fname, func in (("retrieveServiceConfigProps", self.retrieveServiceConfigProps),
+                            ("retrieveServiceConfigs", self.retrieveServiceConfigs),
+                            ("retrieveServiceEvents", self.retrieveServiceEvents),
+                            ("retrieveSnapshot", self.retrieveSnapshot),
+                            ("retrieveChannelHistory", self.retrieveChannelHistory),
+                            ("saveSnapshot", self.saveSnapshot),
+                            ('updateSnapshotEvent', self.updateSnapshotEvent)):
+            self.register(fname, func)
         
     def __del__(self):
         """destructor"""
         print ('close SQLite3 connection.')
 #        pymasar.utils.close(conn)
     
+    def register(self, fname, func):
+        """serve function fname by calling func with the request arguments"""
+        self._actions[fname] = func
+
     def dispatch(self, fname, fargs):
-        actions = (("retrieveServiceConfigProps", self.retrieveServiceConfigProps),
-                   ("retrieveServiceConfigs", self.retrieveServiceConfigs),
-                   ("retrieveServiceEvents", self.retrieveServiceEvents),
-                   ("retrieveSnapshot", self.retrieveSnapshot),
-                   ("saveSnapshot", self.saveSnapshot),
-                   ('updateSnapshotEvent', self.updateSnapshotEvent))
-        for (params, func) in actions:
-            if re.match(params, fname):
-                return func(fargs)
+        func = self._actions.get(fname)
+        if func is not None:
+            return func(fargs)
 
     def request(self, *argument):
         """issue request"""
@@ -71,6 +91,23 @@ class DSL(object):
             except:
                 results.append(None)
         return results
+
+    def _columns(self, result, numeric):
+        """Transpose a table result into [labels, column, ...] so that the service fills its NTTable column by column.
+        The first numeric columns are packed into arrays of 64 bit integers when possible."""
+        if not result or len(result) < 2:
+            return result
+        columns = [result[0]]
+        for i, column in enumerate(zip(*result[1:])):
+            if i < numeric and array.array('l').itemsize == 8:
+                try:
+                    column = array.array('l', column)
+                except TypeError:
+                    column = list(column)
+            else:
+                column = list(column)
+            columns.append(column)
+        return columns
     
     def retrieveServiceConfigProps(self, params):
         key = ['propname', 'servicename', 'configname']
@@ -80,7 +117,7 @@ class DSL(object):
         conn = pymasar.utils.connect()
         result = pymasar.service.retrieveServiceConfigProps(conn, propname=name, servicename=service, configname=config)
         pymasar.utils.close(conn)
-        return result
+        return self._columns(result, 2)
     
     def retrieveServiceConfigs(self, params):
         """FGet service configuration information.
@@ -96,27 +133,67 @@ class DSL(object):
                                                         configversion=version, system=system,
                                                         eventid=eid)
         pymasar.utils.close(conn)
-        return result
+        return self._columns(result, 1)
     
     def retrieveServiceEvents(self, params):
         """Get service events with given search constrains.
         If event id is given, get header information for that event only then."""
-        key = ['configid', 'start', 'end', 'comment', 'user', 'eventid']
-        cid, start, end, comment, user, eid = self._parseParams(params, key)
+        key = ['configid', 'start', 'end', 'comment', 'user', 'eventid', 'limit', 'offset', 'before', 'order']
+        cid, start, end, comment, user, eid, limit, offset, before, order = self._parseParams(params, key)
         conn = pymasar.utils.connect()
         result = pymasar.service.retrieveServiceEvents(conn, configid=cid, eventid=eid,
-                                                       start=start, end=end, comment=comment, user=user)
+                                                       start=start, end=end, comment=comment, user=user,
+                                                       limit=limit, offset=offset, before=before, order=order)
         pymasar.utils.close(conn)
-        return result
+        return self._columns(result, 2)
 
-    def retrieveSnapshot(self, params): 
+    def _flushStaging(self):
+        """wait for the staged events to be saved, so that a query over the database sees them."""
+        if not self.staging.flush(self.flushTimeout):
+            raise RuntimeError("Staged snapshots are not saved yet. %s" % (self.staging.error or ''))
+
+    def _isBatch(self, eid, start, end):
+        """several events are wanted either as a comma separated event id list, or by time frame."""
+        if eid is None:
+            return start is not None or end is not None
+        return ',' in eid
+
+    def retrieveSnapshot(self, params):
         key = ['eventid', 'start', 'end', 'comment']
         eid, start, end, comment = self._parseParams(params, key)
+        if self.staging and self._isBatch(eid, start, end):
+            self._flushStaging()
+        staged = None
+        if self.staging and eid and not self._isBatch(eid, start, end):
+            # looked up before the database, so that an event saved in between is found there
+            staged = self.staging.retrieve(eid)
         conn = pymasar.utils.connect()
-        result = pymasar.masardata.retrieveSnapshot(conn, eventid=eid, start=start, end=end, comment=comment)
+        if self._isBatch(eid, start, end):
+            eids = None
+            if eid is not None:
+                eids = [e for e in eid.split(',') if e.strip()]
+            result = pymasar.masardata.retrieveSnapshots(conn, eventids=eids, start=start, end=end, comment=comment)
+        else:
+            result = pymasar.masardata.retrieveSnapshot(conn, eventid=eid, start=start, end=end, comment=comment)
+            if staged is not None and len(result) > 1 and len(result[1]) == 1:
+                result[1] = result[1] + staged
         pymasar.utils.close(conn)
         return result
     
+    def retrieveChannelHistory(self, params):
+        """Get the saved values of one or more pvs (comma separated) across snapshots in a time frame."""
+        key = ['pvname', 'start', 'end']
+        pvname, start, end = self._parseParams(params, key)
+        if not pvname:
+            raise RuntimeError("pvname is required to retrieve channel history.")
+        pvnames = [name.strip() for name in pvname.split(',') if name.strip()]
+        if self.staging:
+            self._flushStaging()
+        conn = pymasar.utils.connect()
+        result = pymasar.masardata.retrieveChannelHistory(conn, pvnames, start=start, end=end)
+        pymasar.utils.close(conn)
+        return result
+
     def saveSnapshot(self, params):
         key = ['servicename', 'configname', 'comment']
         service, config, comment = self._parseParams(params[1], key)
@@ -172,7 +249,21 @@ class DSL(object):
         # save into database
         try:
             conn = pymasar.utils.connect()
-            eid, result = pymasar.masardata.saveSnapshot(conn, datas, servicename=service, configname=config, comment=comment)
+            if self.staging:
+                eid = pymasar.service.saveServiceEvent(conn, service, config, comment=comment)
+                pymasar.utils.save(conn)
+                try:
+                    self.staging.stage(eid, datas)
+                except:
+                    # do not leave an event without data behind
+                    pymasar.service.deleteServiceEvent(conn, eid)
+                    pymasar.utils.save(conn)
+                    raise
+                finally:
+                    pymasar.utils.close(conn)
+                return [eid]
+            eid, result = pymasar.masardata.saveSnapshot(conn, datas, servicename=service, configname=config, comment=comment,
+                                                         keyframe=self.keyframe)
             pymasar.utils.save(conn)
             pymasar.utils.close(conn)
             result.insert(0, eid)
@@ -192,6 +283,32 @@ class DSL(object):
         pymasar.utils.close(conn)
         return result
     
+    def retrieveChannelNamesStamp(self, params):
+        """Version stamp of the channel list of a config, which changes whenever the list does.
+        Return -1 if the config does not exist."""
+        key = ['servicename','configname']
+        service, config = self._parseParams(params, key)
+        if not service:
+            service = self.__servicename
+
+        conn = pymasar.utils.connect()
+        result = pymasar.service.retrieveServiceConfigStamp(conn, config, servicename=service)
+        pymasar.utils.close(conn)
+        if result is None:
+            return -1
+        return result
+
+    def retrieveActiveConfigs(self, params):
+        """Names of the active configs of a service, which the server connects ahead at start."""
+        key = ['servicename']
+        service, = self._parseParams(params, key)
+        if not service:
+            service = self.__servicename
+        conn = pymasar.utils.connect()
+        result = pymasar.service.retrieveServiceConfigs(conn, servicename=service)
+        pymasar.utils.close(conn)
+        return [str(row[1]) for row in result[1:] if row[5] in (None, 'active')]
+
     def updateSnapshotEvent(self, params):
         key = ['eventid', 'user', 'desc']
         eid, user, desc = self._parseParams(params, key)
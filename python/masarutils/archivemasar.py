@@ -0,0 +1,318 @@
+"""
+Pack approved masar events from the SQLite database into an archive file,
+which the masar service maps into memory and serves without database access.
+Set MASAR_ARCHIVE to the archive file name before starting the service.
+
+The layout is described in cpp/src/server/archive/masarArchive.h.
+Events already in the archive are skipped, new ones are appended,
+so the tool can run periodically against the same file.
+Each run writes a new file and renames it over the old one, which the service then maps again.
+All numbers are written in host byte order.
+Waveforms take the narrowest element width which holds all their values (version 3),
+like packArray() stores them in the database, so a char waveform read back as shorts stays intact.
+Archives of version 1 and 2 have a fixed width per dbr type and stay that way when appended to,
+a waveform which does not fit it makes the run fail rather than lose values.
+
+Usage: python archivemasar.py archive.mar [--start UTC time] [--end UTC time]
+"""
+
+import os
+import shutil
+import struct
+import tempfile
+import argparse
+
+import pymasarsqlite as pymasar
+
+MAGIC = 'MASARARC'
+ENDMAGIC = 'MASAREND'
+VERSION = 3
+BYTEORDER = 0x01020304
+ALIGN = 64
+HEADER = struct.Struct('=8sII48x')
+TRAILER = struct.Struct('=QQII8s')
+INDEX = struct.Struct('=qQIIIIII')
+# number of column offsets at the start of an event section
+SLOTS = 16
+
+# dbr types, see db_access.h
+DBR_STRING, DBR_INT, DBR_FLOAT, DBR_ENUM, DBR_CHAR, DBR_LONG, DBR_DOUBLE = range(7)
+
+# struct formats waveform elements may take per archive version and dbr type, narrowest first,
+# version 3 records the one used for each channel
+ELEMENTS = {1: {DBR_CHAR: 'i', DBR_INT: 'i', DBR_LONG: 'i', DBR_FLOAT: 'd', DBR_DOUBLE: 'd'},
+            2: {DBR_CHAR: 'b', DBR_INT: 'h', DBR_LONG: 'i', DBR_FLOAT: 'f', DBR_DOUBLE: 'd'},
+            3: {DBR_CHAR: 'bhiq', DBR_INT: 'hiq', DBR_LONG: 'iq', DBR_FLOAT: 'fd', DBR_DOUBLE: 'd'}}
+
+
+class Strings(object):
+    """interned string table"""
+    def __init__(self, strings=()):
+        self.strings = list(strings)
+        self.index = dict((s, i) for i, s in enumerate(self.strings))
+
+    def intern(self, value):
+        if value is None:
+            value = ''
+        if isinstance(value, unicode):
+            value = value.encode('utf-8')
+        else:
+            value = str(value)
+        i = self.index.get(value)
+        if i is None:
+            i = self.index[value] = len(self.strings)
+            self.strings.append(value)
+        return i
+
+    def write(self, f):
+        f.write(struct.pack('=I', len(self.strings)))
+        for s in self.strings:
+            f.write(struct.pack('=I', len(s)))
+            f.write(s)
+
+
+def _align(f):
+    pos = f.tell()
+    pad = (-pos) % ALIGN
+    if pad:
+        f.write('\0' * pad)
+    return pos + pad
+
+
+def _pack(f, fmt, values):
+    offset = _align(f)
+    f.write(struct.pack('=%d%s' % (len(values), fmt), *values))
+    return offset
+
+
+def readArchive(f):
+    """Return string table, event index entries, the offset where new events go and the version."""
+    f.seek(0, os.SEEK_END)
+    if f.tell() == 0:
+        f.write(HEADER.pack(MAGIC, VERSION, BYTEORDER))
+        return Strings(), [], HEADER.size, VERSION
+    f.seek(0)
+    magic, version, byteorder = HEADER.unpack(f.read(HEADER.size))
+    f.seek(-TRAILER.size, os.SEEK_END)
+    tableoffset, indexoffset, version2, _, endmagic = TRAILER.unpack(f.read(TRAILER.size))
+    if magic != MAGIC or endmagic != ENDMAGIC:
+        raise RuntimeError('not a masar archive')
+    if version not in ELEMENTS or version2 != version or byteorder != BYTEORDER:
+        raise RuntimeError('masar archive with other version or byte order')
+
+    f.seek(tableoffset)
+    strings = []
+    for _ in range(struct.unpack('=I', f.read(4))[0]):
+        length = struct.unpack('=I', f.read(4))[0]
+        strings.append(f.read(length))
+    f.seek(indexoffset)
+    index = [INDEX.unpack(f.read(INDEX.size)) for _ in range(struct.unpack('=I', f.read(4))[0])]
+    return Strings(strings), index, tableoffset, version
+
+
+def _int32(value):
+    try:
+        value = int(value)
+    except (TypeError, ValueError):
+        return 0
+    return value if -2**31 <= value < 2**31 else 0
+
+
+def _packArray(f, name, formats, values):
+    """
+    Pack a waveform with the first of formats which holds all its values,
+    return its offset and the format used.
+
+    >>> import io
+    >>> f = io.BytesIO()
+    >>> offset, fmt = _packArray(f, 'char', 'bhiq', [1, 200, 255])
+    >>> fmt
+    'h'
+    >>> struct.unpack('=3h', f.getvalue()[offset:offset + 6])
+    (1, 200, 255)
+    >>> _packArray(f, 'char', 'b', [1, 200, 255])
+    Traceback (most recent call last):
+    ...
+    ValueError: waveform of char does not fit format b
+    >>> _packArray(f, 'long', 'iq', [1, 2.5])
+    Traceback (most recent call last):
+    ...
+    ValueError: waveform of long has a value which is not an integer: 2.5
+    """
+    if formats[0] not in 'fd':
+        # struct truncates floats silently
+        for value in values:
+            if isinstance(value, float) and not value.is_integer():
+                raise ValueError('waveform of %s has a value which is not an integer: %r' % (name, value))
+    for fmt in formats:
+        try:
+            data = struct.pack('=%d%s' % (len(values), fmt), *values)
+        except (struct.error, OverflowError):
+            continue
+        offset = _align(f)
+        f.write(data)
+        return offset, fmt
+    raise ValueError('waveform of %s does not fit format %s' % (name, formats[-1]))
+
+
+def writeEvent(f, strings, rows, version=VERSION):
+    """
+    Append one event section, and return its offset.
+    rows are data rows as retrieveSnapshot() returns them.
+    """
+    elements = ELEMENTS[version]
+    section = _align(f)
+    f.write('\0' * (SLOTS * 8))
+
+    arrayoffset, arraylength, arraytype = [], [], []
+    for row in rows:
+        dbr, values = row[4], row[13] or []
+        if not row[12] or (dbr != DBR_STRING and dbr not in elements):
+            arrayoffset.append(0)
+            arraylength.append(0)
+            arraytype.append(0)
+            continue
+        if dbr == DBR_STRING:
+            offset, fmt = _pack(f, 'I', [strings.intern(v) for v in values]), 'I'
+        elif dbr in (DBR_DOUBLE, DBR_FLOAT):
+            offset, fmt = _packArray(f, row[0], elements[dbr], [float(v) for v in values])
+        else:
+            offset, fmt = _packArray(f, row[0], elements[dbr], values)
+        arrayoffset.append(offset)
+        arraylength.append(len(values))
+        arraytype.append(ord(fmt))
+
+    nan = float('nan')
+    # same order as enum Column in masarArchive.cpp
+    offsets = [
+        _pack(f, 'I', [strings.intern(row[0]) for row in rows]),
+        _pack(f, 'i', [_int32(row[4]) for row in rows]),
+        _pack(f, 'B', [1 if row[5] else 0 for row in rows]),
+        _pack(f, 'q', [int(row[6]) for row in rows]),
+        _pack(f, 'i', [_int32(row[7]) for row in rows]),
+        _pack(f, 'i', [_int32(row[8]) for row in rows]),
+        _pack(f, 'i', [_int32(row[9]) for row in rows]),
+        _pack(f, 'i', [_int32(row[10]) for row in rows]),
+        _pack(f, 'I', [strings.intern(row[11]) for row in rows]),
+        _pack(f, 'B', [1 if row[12] else 0 for row in rows]),
+        _pack(f, 'd', [nan if row[2] is None else float(row[2]) for row in rows]),
+        _pack(f, 'i', [_int32(row[3]) for row in rows]),
+        _pack(f, 'I', [strings.intern(row[1]) for row in rows]),
+        _pack(f, 'Q', arrayoffset),
+        _pack(f, 'I', arraylength),
+    ]
+    if version >= 3:
+        offsets.append(_pack(f, 'B', arraytype))
+    end = f.tell()
+    f.seek(section)
+    f.write(struct.pack('=%dQ' % SLOTS, *(offsets + [0] * (SLOTS - len(offsets)))))
+    f.seek(end)
+    return section
+
+
+def archive(conn, fname, start=None, end=None, batch=20):
+    """
+    Append approved events within a time frame to an archive file, return number of new events.
+    The archive is written to a temporary file next to it, which then replaces it,
+    so a service which has the old file mapped keeps reading it until it maps the new one.
+
+    >>> import sqlite3, tempfile, shutil
+    >>> from pymasarsqlite.db.masarsqlite import (SQL)
+    >>> conn = sqlite3.connect(":memory:")
+    >>> result = conn.cursor().executescript(SQL)
+    >>> pymasar.service.saveService(conn, 'masar1', desc='non-empty description')
+    1
+    >>> pymasar.service.saveServiceConfig(conn, 'masar1', 'orbit C01', 'BPM horizontal readout')
+    1
+    >>> data = [('SR:C01-BI:G02A<BPM:L1>Pos-X', '12.2', 12.2, 12, 6, 1, 4356, 3452, 0, 0, 0, "", 0, []),
+    ...        ('SR:C01-BI:G02A<BPM:L2>Pos-X', '12.2', 12.2, 12, 6, 1, 4356, 3452, 0, 0, 0, "", 1, [1.2, 2.3])]
+    >>> pymasar.masardata.saveSnapshot(conn, data, servicename='masar1', configname='orbit C01', approval=True)
+    (1, [1, 2])
+    >>> tmpdir = tempfile.mkdtemp()
+    >>> fname = os.path.join(tmpdir, 'test.mar')
+    >>> archive(conn, fname)
+    1
+    >>> old = open(fname, 'rb')
+    >>> pymasar.masardata.saveSnapshot(conn, data, servicename='masar1', configname='orbit C01', approval=True)
+    (2, [3, 4])
+    >>> archive(conn, fname)
+    1
+    >>> archive(conn, fname)
+    0
+    >>> with open(fname, 'rb') as f:
+    ...     print ([entry[0] for entry in readArchive(f)[1]])
+    [1, 2]
+    >>> print ([entry[0] for entry in readArchive(old)[1]])
+    [1]
+    >>> old.close()
+    >>> os.listdir(tmpdir)
+    ['test.mar']
+    >>> shutil.rmtree(tmpdir)
+    >>> conn.close()
+    """
+    events = pymasar.service.retrieveServiceEvents(conn, start=start, end=end)
+    tmpname = None
+    try:
+        # never write into the live file, the service may have it mapped
+        fd, tmpname = tempfile.mkstemp(prefix=os.path.basename(fname) + '.', dir=os.path.dirname(os.path.abspath(fname)))
+        os.close(fd)
+        if os.path.exists(fname):
+            shutil.copyfile(fname, tmpname)
+            shutil.copymode(fname, tmpname)
+        else:
+            os.chmod(tmpname, 0o644)
+        count = _append(conn, tmpname, events, batch)
+        if count == 0 and os.path.exists(fname):
+            return 0
+        os.rename(tmpname, fname)
+        tmpname = None
+        return count
+    finally:
+        if tmpname is not None:
+            os.remove(tmpname)
+
+
+def _append(conn, fname, events, batch):
+    """Append events not in the archive file yet, return number of new events."""
+    with open(fname, 'r+b') as f:
+        strings, index, offset, version = readArchive(f)
+        archived = set(entry[0] for entry in index)
+        eids = [event[0] for event in events[1:] if event[0] not in archived]
+
+        # drop the old string table and index, they are written again after the new events
+        f.seek(offset)
+        f.truncate()
+        for i in range(0, len(eids), batch):
+            heads, datas = pymasar.masardata.retrieveSnapshots(conn, eventids=eids[i:i + batch])
+            rows = {}
+            for data in datas[1:]:
+                rows.setdefault(data[0], []).append(data[1:])
+            for head in heads[1:]:
+                data = rows.get(head[0], [])
+                section = writeEvent(f, strings, data, version)
+                index.append((head[0], section, len(data), strings.intern(head[1]), strings.intern(head[2]),
+                              strings.intern(head[3]), strings.intern(head[4]), 0))
+
+        tableoffset = _align(f)
+        strings.write(f)
+        indexoffset = f.tell()
+        f.write(struct.pack('=I', len(index)))
+        for entry in index:
+            f.write(INDEX.pack(*entry))
+        f.write(TRAILER.pack(tableoffset, indexoffset, version, 0, ENDMAGIC))
+        f.flush()
+        os.fsync(f.fileno())
+    return len(eids)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Pack approved masar events into a memory mapped archive file.')
+    parser.add_argument('archive', help='archive file, created if it does not exist')
+    parser.add_argument('--start', help='pack events after this UTC time')
+    parser.add_argument('--end', help='pack events before this UTC time')
+    args = parser.parse_args()
+
+    conn = pymasar.utils.connect()
+    count = archive(conn, args.archive, start=args.start, end=args.end)
+    pymasar.utils.close(conn)
+    print ('%d events added to %s' % (count, args.archive))
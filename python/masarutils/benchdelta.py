@@ -0,0 +1,78 @@
+"""
+Compare write volume and retrieve latency of full and delta snapshot storage in SQLite.
+
+A configuration with a given number of channels is saved many times,
+with only a fraction of channels changing between two consecutive snapshots.
+
+Usage: python benchdelta.py [channels] [snapshots] [changed fraction] [keyframe interval]
+"""
+
+import os
+import sys
+import time
+import random
+import tempfile
+
+from pymasarsqlite.db import masarsqlite
+from pymasarsqlite.service.service import saveService
+from pymasarsqlite.service.serviceconfig import saveServiceConfig
+from pymasarsqlite.masardata import (saveSnapshot, retrieveSnapshots)
+
+
+def snapshots(channels, count, fraction):
+    """generate data for count snapshots, changing a fraction of channels each time"""
+    data = [['SIM:PV%05d' % i, '0.0', 0.0, 0, 6, 1, 0, 0, 0, 0, 0, '', 0, None] for i in range(channels)]
+    for n in range(count):
+        for row in random.sample(data, int(channels * fraction)):
+            value = random.random()
+            row[1], row[2], row[3] = str(value), value, int(value)
+        for row in data:
+            row[6] = n
+        yield [tuple(row) for row in data]
+
+
+def bench(channels, count, fraction, keyframe):
+    fd, fname = tempfile.mkstemp(suffix='.db')
+    os.close(fd)
+    os.remove(fname)
+    try:
+        conn = masarsqlite.connect(fname)
+        saveService(conn, 'masar', desc='benchmark')
+        saveServiceConfig(conn, 'masar', 'bench', 'benchmark configuration')
+        conn.commit()
+
+        random.seed(0)
+        eids = []
+        start = time.time()
+        for data in snapshots(channels, count, fraction):
+            eid, _ = saveSnapshot(conn, data, servicename='masar', configname='bench', approval=True,
+                                  keyframe=keyframe)
+            conn.commit()
+            eids.append(eid)
+        save = (time.time() - start) / count
+
+        rows = conn.execute('select count(*) from masar_data').fetchone()[0]
+        conn.execute('VACUUM')
+        size = os.path.getsize(fname)
+
+        start = time.time()
+        for eid in eids:
+            retrieveSnapshots(conn, eventids=[eid])
+        retrieve = (time.time() - start) / count
+        conn.close()
+    finally:
+        os.remove(fname)
+    return rows, size, save, retrieve
+
+
+if __name__ == '__main__':
+    channels = int(sys.argv[1]) if len(sys.argv) > 1 else 5000
+    count = int(sys.argv[2]) if len(sys.argv) > 2 else 50
+    fraction = float(sys.argv[3]) if len(sys.argv) > 3 else 0.02
+    keyframe = int(sys.argv[4]) if len(sys.argv) > 4 else 10
+
+    print ("%d channels, %d snapshots, %.1f%% changed per snapshot" % (channels, count, fraction * 100))
+    print ("%-12s %12s %12s %12s %14s" % ('mode', 'rows', 'file bytes', 'save ms', 'retrieve ms'))
+    for mode, interval in (('full', 0), ('delta/%d' % keyframe, keyframe)):
+        rows, size, save, retrieve = bench(channels, count, fraction, interval)
+        print ("%-12s %12d %12d %12.1f %14.1f" % (mode, rows, size, save * 1000, retrieve * 1000))
@@ -2,7 +2,7 @@
 import logging
 _log = logging.getLogger(__name__)
 
-import sqlite3, json, sys
+import sqlite3, json, sys, threading
 
 if sys.version_info>=(3,0,0):
     def loads(V):
@@ -15,10 +15,11 @@ if sys.version_info>=(3,0,0):
 else:
     sqlite3.register_converter('json', json.loads)
 
-def connect(fname):
+def connect(fname, check_same_thread=True):
     conn = sqlite3.connect(fname,
                            isolation_level='DEFERRED',
-                           detect_types=sqlite3.PARSE_COLNAMES)
+                           detect_types=sqlite3.PARSE_COLNAMES,
+                           check_same_thread=check_same_thread)
     try:
         conn.execute("PRAGMA foreign_keys = ON;")
         conn.row_factory = sqlite3.Row
@@ -39,6 +40,47 @@ def connect(fname):
     else:
         return conn
 
+class ThreadConnections(object):
+    """One connection to the .db file per thread, for servers with several worker threads.
+
+    Used in place of a connection, eg. 'with conns as conn:' uses the connection of the calling thread.
+    """
+    def __init__(self, fname):
+        if fname==':memory:':
+            raise ValueError("Each connection to :memory: is a different database")
+        self.fname = fname
+        self._local = threading.local()
+        self._lock = threading.Lock()
+        self._all = []
+
+    def get(self):
+        conn = getattr(self._local, 'conn', None)
+        if conn is None:
+            # only used by this thread, but closed by the thread calling close()
+            conn = self._local.conn = connect(self.fname, check_same_thread=False)
+            with self._lock:
+                self._all.append(conn)
+        return conn
+
+    def __enter__(self):
+        return self.get().__enter__()
+
+    def __exit__(self, A, B, C):
+        return self.get().__exit__(A, B, C)
+
+    def execute(self, *args):
+        return self.get().execute(*args)
+
+    def iterdump(self):
+        return self.get().iterdump()
+
+    def close(self):
+        'Close all connections, once the threads using them are done'
+        with self._lock:
+            conns, self._all = self._all, []
+        for conn in conns:
+            conn.close()
+
 # We would like to add 'UNIQUE(name, next)' to config,
 # but this is difficult for sqlite to handle w/ update and distinct-ness of NULL
 #
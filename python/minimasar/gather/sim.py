@@ -56,6 +56,9 @@ _kinds = [
 ]
 
 class Gatherer(object):
+    # may be called by several RPC worker threads at once
+    threadsafe = True
+
     def __init__(self, queue=None):
         pass
     def gather(self, pvs):
@@ -59,9 +59,11 @@ def timestr2tuple(tstr):
     return int(S), int(NS*1e9)
 
 class Service(object):
-    def __init__(self, conn, gather=None, sim=False):
+    def __init__(self, conn, gather=None, sim=False, saved=None):
         self.conn = conn
         self.gather = gather
+        # called with the id of each new event, once committed
+        self.saved = saved
 
         if not sim:
             # current time string (UTC)
@@ -407,6 +409,9 @@ class Service(object):
 
             _log.debug("event %s with %s %s", eid, len(names), C.rowcount)
 
+        if self.saved is not None:
+            self.saved(eid)
+
         return self.retrieveSnapshot(eventid=eid)
 
     @rpc(NTScalar.buildType('?'))
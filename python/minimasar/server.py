@@ -2,14 +2,17 @@
 import logging
 _log = logging.getLogger(__name__)
 
+import signal
 from importlib import import_module
-from threading import Event
+from threading import Event, Thread
 
 from .ops import Service
-from .db import connect
+from .db import connect, ThreadConnections
 
-from p4p.server import Server, installProvider
-from p4p.rpc import WorkQueue, MASARDispatcher, NTURIDispatcher
+from p4p.server import Server, installProvider, SharedPV, StaticProvider, setTrace, logTrace
+from p4p.rpc import NativeQueue, MASARDispatcher, NTURIDispatcher
+from p4p.nt import NTScalar
+from p4p.wrapper import Value
 
 def getargs():
     from argparse import ArgumentParser
@@ -18,6 +21,11 @@ def getargs():
     P.add_argument('--name', default='masarService', help='Service name')
     P.add_argument('-L', '--log-level', default='INFO', help='Level name (eg. ERROR, WARN, INFO, DEBUG)')
     P.add_argument('-G', '--gather', default='ca', help='PV value gathering backend')
+    P.add_argument('-Q', '--queue', type=int, default=100, help='Number of RPC calls which may wait')
+    P.add_argument('-W', '--workers', type=int, default=1,
+                   help='Number of threads serving RPC calls, more than 1 needs a thread safe backend (not ca)')
+    P.add_argument('-T', '--trace', type=lambda v: int(v, 0), default=0,
+                   help='p4p trace categories to record (see p4p.server), logged on SIGUSR1')
     return P.parse_args()
 
 def main(args):
@@ -27,30 +35,55 @@ def main(args):
 
     logging.basicConfig(level=lvl)
 
-    Q = WorkQueue(maxsize=5)
+    if args.trace:
+        setTrace(args.trace)
+    signal.signal(signal.SIGUSR1, lambda sig, frame: logTrace(_log))
+
+    Q = NativeQueue(maxsize=args.queue)
 
     GM = 'minimasar.gather.'+args.gather
     _log.debug('Import gatherer "%s"', GM)
     GM = import_module(GM)
     gather = GM.Gatherer(queue=Q)
+    if args.workers>1 and not getattr(gather, 'threadsafe', False):
+        raise ValueError('Gatherer "%s" is not thread safe, needs --workers 1'%args.gather)
 
     _log.debug('Open DB "%s"', args.db)
-    db = connect(args.db)
+    if args.workers>1:
+        # sqlite3 connections can't be shared between threads
+        db = ThreadConnections(args.db)
+    else:
+        db = connect(args.db)
+
+    # id of the newest event, monitor instead of polling retrieveServiceEvents
+    eventType = NTScalar.buildType('i')
+    lastEvent = SharedPV()
+    lastEvent.post(Value(eventType, {'value': db.execute('select max(id) from event').fetchone()[0] or 0}))
+
+    def saved(eid):
+        lastEvent.post(Value(eventType, {'value': eid}), changed=['value'])
 
     _log.info("Install provider")
-    M = Service(db, gather=gather.gather)
+    M = Service(db, gather=gather.gather, saved=saved)
     # provide MASAR style calls through a single PV (args.name)
-    installProvider("masar", MASARDispatcher(Q, target=M, channels=[args.name]))
+    installProvider("masar", MASARDispatcher(Q, target=M, channels=[args.name]), queue=Q)
     # provide NTRUI style calls, one PV per method, with a common prefix (args.name+':')
-    installProvider("masarnturi", NTURIDispatcher(Q, target=M, prefix=args.name+':'))
+    installProvider("masarnturi", NTURIDispatcher(Q, target=M, prefix=args.name+':'), queue=Q)
+    installProvider("masarstatus", StaticProvider({args.name+':lastEvent': lastEvent}))
 
     _log.info("Prepare server")
-    S = Server(providers="masar masarnturi")
+    S = Server(providers="masar masarnturi masarstatus")
 
     _log.info("Run server")
     S.start()
     _log.info("Started")
 
+    # the main thread is one of the workers
+    workers = [Thread(target=Q.handle) for n in range(args.workers-1)]
+    for T in workers:
+        T.daemon = True
+        T.start()
+
     try:
         Q.handle()
     except KeyboardInterrupt:
@@ -58,6 +91,11 @@ def main(args):
 
     _log.info("Stop")
     S.stop()
+    for T in workers:
+        Q.interrupt()
+    for T in workers:
+        T.join()
+    _log.info("RPC queue %s", Q.stats())
     _log.info("Done")
 
     db.close()
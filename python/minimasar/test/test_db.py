@@ -1,9 +1,9 @@
 
-import unittest, sqlite3
+import unittest, sqlite3, os, shutil, tempfile, threading
 
 import numpy
 
-from ..db import connect
+from ..db import connect, ThreadConnections
 
 class TestDB(unittest.TestCase):
     def setUp(self):
@@ -29,3 +29,34 @@ class TestDB(unittest.TestCase):
                     (cid, 'foo'),
                     (cid, 'foo'), # should fail UNIQUE
             ])
+
+class TestThreadConnections(unittest.TestCase):
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+        self.conns = ThreadConnections(os.path.join(self.dir, 'test.db'))
+
+    def tearDown(self):
+        self.conns.close()
+        shutil.rmtree(self.dir)
+
+    def test_memory(self):
+        self.assertRaises(ValueError, ThreadConnections, ':memory:')
+
+    def test_threads(self):
+        with self.conns as conn:
+            conn.execute('insert into config(name, created, desc) values (?,?,?);', ('main', 'aaa', 'bbb'))
+        main = self.conns.get()
+
+        result = []
+        def other():
+            with self.conns as conn:
+                conn.execute('insert into config(name, created, desc) values (?,?,?);', ('other', 'aaa', 'bbb'))
+            result.append(self.conns.get() is not main)
+        T = threading.Thread(target=other)
+        T.start()
+        T.join()
+
+        self.assertEqual(result, [True])
+        self.assertIs(self.conns.get(), main)
+        names = [R[0] for R in self.conns.execute('select name from config order by id')]
+        self.assertEqual(names, ['main', 'other'])
@@ -78,6 +78,7 @@ CREATE TABLE "service_config" (
   "service_config_version" INT DEFAULT NULL,
   "service_config_status" VARCHAR(50) DEFAULT NULL,
   "service_config_create_date" timestamp NOT NULL ,
+  "service_config_stamp" INT NOT NULL DEFAULT 0,
   PRIMARY KEY ("service_config_id")
   CONSTRAINT "Ref_197" FOREIGN KEY ("service_id") REFERENCES "service" ("service_id") ON DELETE NO ACTION ON UPDATE NO ACTION
 );
@@ -111,16 +112,53 @@ CREATE TABLE "service_event_prop" (
   PRIMARY KEY ("service_event_prop_id")
   CONSTRAINT "Ref_11" FOREIGN KEY ("service_event_id") REFERENCES "service_event" ("service_event_id") ON DELETE NO ACTION ON UPDATE NO ACTION
 );
+DROP TABLE IF EXISTS "service_event_delta";
+CREATE TABLE "service_event_delta" (
+  "service_event_id" INTEGER ,
+  "base_event_id" INT NOT NULL,
+  PRIMARY KEY ("service_event_id")
+  CONSTRAINT "Ref_13" FOREIGN KEY ("service_event_id") REFERENCES "service_event" ("service_event_id") ON DELETE NO ACTION ON UPDATE NO ACTION
+  CONSTRAINT "Ref_14" FOREIGN KEY ("base_event_id") REFERENCES "service_event" ("service_event_id") ON DELETE NO ACTION ON UPDATE NO ACTION
+);
 CREATE INDEX "service_config_Ref_197" ON "service_config" ("service_id");
 CREATE INDEX "service_event_Ref_08" ON "service_event" ("service_config_id");
+CREATE INDEX "service_event_idx_config_time" ON "service_event" ("service_config_id", "service_event_UTC_time");
 CREATE INDEX "pv__pvgroup_idx_pv_id" ON "pv__pvgroup" ("pv_id");
 CREATE INDEX "pv__pvgroup_idx_pvgroup_id" ON "pv__pvgroup" ("pv_group_id");
 CREATE INDEX "pvgroup__serviceconfig_Ref_09" ON "pvgroup__serviceconfig" ("service_config_id");
 CREATE INDEX "pvgroup__serviceconfig_Ref_137" ON "pvgroup__serviceconfig" ("pv_group_id");
 CREATE INDEX "masar_data_Ref_10" ON "masar_data" ("service_event_id");
+CREATE INDEX "masar_data_idx_pv_name" ON "masar_data" ("pv_name", "service_event_id");
 CREATE INDEX "service_config_prop_Ref_12" ON "service_config_prop" ("service_config_id");
 CREATE INDEX "pv_idx_pv_name" ON "pv" ("pv_name");
 CREATE INDEX "service_event_prop_Ref_11" ON "service_event_prop" ("service_event_id");
+CREATE INDEX "service_event_delta_Ref_14" ON "service_event_delta" ("base_event_id");
+CREATE TRIGGER "pvgroup__serviceconfig_stamp_insert" AFTER INSERT ON "pvgroup__serviceconfig"
+BEGIN
+  UPDATE "service_config" SET "service_config_stamp" = (SELECT max("service_config_stamp") FROM "service_config") + 1
+  WHERE "service_config_id" = NEW."service_config_id";
+END;
+CREATE TRIGGER "pvgroup__serviceconfig_stamp_delete" AFTER DELETE ON "pvgroup__serviceconfig"
+BEGIN
+  UPDATE "service_config" SET "service_config_stamp" = (SELECT max("service_config_stamp") FROM "service_config") + 1
+  WHERE "service_config_id" = OLD."service_config_id";
+END;
+CREATE TRIGGER "pv__pvgroup_stamp_insert" AFTER INSERT ON "pv__pvgroup"
+BEGIN
+  UPDATE "service_config" SET "service_config_stamp" = (SELECT max("service_config_stamp") FROM "service_config") + 1
+  WHERE "service_config_id" IN (SELECT "service_config_id" FROM "pvgroup__serviceconfig" WHERE "pv_group_id" = NEW."pv_group_id");
+END;
+CREATE TRIGGER "pv__pvgroup_stamp_delete" AFTER DELETE ON "pv__pvgroup"
+BEGIN
+  UPDATE "service_config" SET "service_config_stamp" = (SELECT max("service_config_stamp") FROM "service_config") + 1
+  WHERE "service_config_id" IN (SELECT "service_config_id" FROM "pvgroup__serviceconfig" WHERE "pv_group_id" = OLD."pv_group_id");
+END;
+CREATE TRIGGER "pv_stamp_update" AFTER UPDATE OF "pv_name" ON "pv"
+BEGIN
+  UPDATE "service_config" SET "service_config_stamp" = (SELECT max("service_config_stamp") FROM "service_config") + 1
+  WHERE "service_config_id" IN (SELECT "service_config_id" FROM "pvgroup__serviceconfig"
+                                JOIN "pv__pvgroup" USING ("pv_group_id") WHERE "pv_id" = NEW."pv_id");
+END;
 COMMIT;
 
 PRAGMA foreign_keys=ON;
@@ -30,9 +30,57 @@ def connect(*args, **kws):
         if loadschema:
             print 'Loading SQLITE DB schema'
             conn.executescript(SQL)
+        else:
+            # databases created before the per pv index and delta storage existed
+            conn.executescript(UPGRADE)
+            columns = [column[1] for column in conn.execute('PRAGMA table_info("service_config")')]
+            if 'service_config_stamp' not in columns:
+                conn.executescript(STAMP)
     except:
         conn.close()
         raise
     return conn
 
 SQL = getSqlite()
+
+UPGRADE = '''
+CREATE INDEX IF NOT EXISTS "masar_data_idx_pv_name" ON "masar_data" ("pv_name", "service_event_id");
+CREATE TABLE IF NOT EXISTS "service_event_delta" (
+  "service_event_id" INTEGER ,
+  "base_event_id" INT NOT NULL,
+  PRIMARY KEY ("service_event_id")
+);
+CREATE INDEX IF NOT EXISTS "service_event_delta_Ref_14" ON "service_event_delta" ("base_event_id");
+CREATE INDEX IF NOT EXISTS "service_event_idx_config_time" ON "service_event" ("service_config_id", "service_event_UTC_time");
+'''
+
+# version stamp of the pv list of each service config
+STAMP = '''
+ALTER TABLE "service_config" ADD COLUMN "service_config_stamp" INT NOT NULL DEFAULT 0;
+CREATE TRIGGER IF NOT EXISTS "pvgroup__serviceconfig_stamp_insert" AFTER INSERT ON "pvgroup__serviceconfig"
+BEGIN
+  UPDATE "service_config" SET "service_config_stamp" = (SELECT max("service_config_stamp") FROM "service_config") + 1
+  WHERE "service_config_id" = NEW."service_config_id";
+END;
+CREATE TRIGGER IF NOT EXISTS "pvgroup__serviceconfig_stamp_delete" AFTER DELETE ON "pvgroup__serviceconfig"
+BEGIN
+  UPDATE "service_config" SET "service_config_stamp" = (SELECT max("service_config_stamp") FROM "service_config") + 1
+  WHERE "service_config_id" = OLD."service_config_id";
+END;
+CREATE TRIGGER IF NOT EXISTS "pv__pvgroup_stamp_insert" AFTER INSERT ON "pv__pvgroup"
+BEGIN
+  UPDATE "service_config" SET "service_config_stamp" = (SELECT max("service_config_stamp") FROM "service_config") + 1
+  WHERE "service_config_id" IN (SELECT "service_config_id" FROM "pvgroup__serviceconfig" WHERE "pv_group_id" = NEW."pv_group_id");
+END;
+CREATE TRIGGER IF NOT EXISTS "pv__pvgroup_stamp_delete" AFTER DELETE ON "pv__pvgroup"
+BEGIN
+  UPDATE "service_config" SET "service_config_stamp" = (SELECT max("service_config_stamp") FROM "service_config") + 1
+  WHERE "service_config_id" IN (SELECT "service_config_id" FROM "pvgroup__serviceconfig" WHERE "pv_group_id" = OLD."pv_group_id");
+END;
+CREATE TRIGGER IF NOT EXISTS "pv_stamp_update" AFTER UPDATE OF "pv_name" ON "pv"
+BEGIN
+  UPDATE "service_config" SET "service_config_stamp" = (SELECT max("service_config_stamp") FROM "service_config") + 1
+  WHERE "service_config_id" IN (SELECT "service_config_id" FROM "pvgroup__serviceconfig"
+                                JOIN "pv__pvgroup" USING ("pv_group_id") WHERE "pv_id" = NEW."pv_id");
+END;
+'''
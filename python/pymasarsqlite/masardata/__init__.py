@@ -1,3 +1,5 @@
-from masardata import (saveSnapshot, retrieveSnapshot)
+from masardata import (saveSnapshot, saveSnapshotData, retrieveSnapshot, retrieveSnapshots, retrieveChannelHistory)
+from staging import (StagedWriter)
 
-__all__ = ['saveSnapshot', 'retrieveSnapshot']
+__all__ = ['saveSnapshot', 'saveSnapshotData', 'retrieveSnapshot', 'retrieveSnapshots', 'retrieveChannelHistory',
+           'StagedWriter']
@@ -8,14 +8,21 @@ from __future__ import print_function
 from __future__ import unicode_literals
 
 import cPickle as pickle
+import array
+import sys
 import sqlite3
+import datetime as dt
 
 from pymasarsqlite.utils import checkConnection
 from pymasarsqlite.service.serviceevent import (saveServiceEvent, retrieveServiceEvents)
 
-def saveSnapshot(conn, data, servicename=None, configname=None, comment=None,approval=False):
+def saveSnapshot(conn, data, servicename=None, configname=None, comment=None,approval=False, keyframe=0):
     """
     save a snapshot (masar event) with data.
+    If keyframe is larger than 1, delta storage is used: only pvs whose value, alarm or
+    connection state differ from the latest full snapshot (keyframe) of the same configuration
+    are saved, and every keyframe-th event of a configuration is saved in full.
+    The time stamp of an unchanged pv is therefore the one of its keyframe.
     The data format is a tuple array like 
     [('pv name', 'string value', 'double value', 'long value', 'dbr type', 'isConnected', 
       'secondsPastEpoch', 'nanoSeconds', 'timeStampTag', 'alarmSeverity', 'alarmStatus', 'alarmMessage',
@@ -58,17 +65,173 @@ def saveSnapshot(conn, data, servicename=None, configname=None, comment=None,app
     ...        ('SR:C01-BI:G06B<BPM:H2>Pos-X', '12.2', 12.2, 12, 6, 1, 564562342566, 3452345098734, 0, 0, 0, "", 0, [])]
     >>> saveSnapshot(conn, data, servicename='masar1', configname='orbit C01', comment='a service event')
     (2, [7, 8, 9, 10, 11, 12])
+    >>> data[0] = ('SR:C01-BI:G02A<BPM:L1>Pos-X','12.5', 12.5, 12, 6, 1, 564562342566, 3452345098734, 0, 0, 0, "", 0, [])
+    >>> saveSnapshot(conn, data, servicename='masar1', configname='orbit C01', comment='a delta event', keyframe=3)
+    (3, [13])
+    >>> saveSnapshot(conn, data, servicename='masar1', configname='orbit C01', comment='a delta event', keyframe=3)
+    (4, [14])
+    >>> saveSnapshot(conn, data, servicename='masar1', configname='orbit C01', comment='a keyframe', keyframe=3)
+    (5, [15, 16, 17, 18, 19, 20])
     >>> conn.close()
     """
     checkConnection(conn)
     eventid = saveServiceEvent(conn, servicename, configname, comment=comment, approval=approval)
+    return eventid, saveSnapshotData(conn, eventid, data, keyframe=keyframe)
+
+def saveSnapshotData(conn, eventid, data, keyframe=0):
+    """
+    save the data of a masar event created by saveServiceEvent(), as saveSnapshot() does.
+    Events of a configuration have to get their data in event id order when delta storage is used.
+    Return masar_data_id[].
+    """
+    checkConnection(conn)
     masarid = None
     try:
+        base = __deltaBase(conn, eventid, keyframe)
+        if base is not None:
+            delta = __diffMasarData(__retrieveMasarData(conn, base), data)
+            if delta is not None:
+                data = delta
+                cur = conn.cursor()
+                cur.execute('insert into service_event_delta (service_event_id, base_event_id) values (?, ?)',
+                            (eventid, base,))
         masarid = __saveMasarData(conn, eventid, data)
     except sqlite3.Error, e:
         print ('Error %s' %e.args[0])
         raise
-    return eventid, masarid
+    return masarid
+
+def __deltaBase(conn, eventid, keyframe):
+    """
+    Find the keyframe a new event should be saved against.
+    Return None if the event has to be saved as a full snapshot,
+    which is when delta storage is off, there is no earlier keyframe of the same configuration,
+    or keyframe-1 deltas have been saved against the latest one already.
+    """
+    if keyframe is None or int(keyframe) <= 1:
+        return None
+    sql = '''
+    select max(service_event_id) from service_event
+    where service_config_id = (select service_config_id from service_event where service_event_id = ?)
+    and service_event_id < ?
+    and service_event_id not in (select service_event_id from service_event_delta)
+    '''
+    cur = conn.cursor()
+    cur.execute(sql, (eventid, eventid,))
+    base = cur.fetchone()[0]
+    if base is None:
+        return None
+    cur.execute('select count(*) from service_event_delta where base_event_id = ?', (base,))
+    if cur.fetchone()[0] >= int(keyframe) - 1:
+        return None
+    return base
+
+# columns compared to decide whether a pv changed:
+# value in all formats, dbr type, connection, alarm, and array value.
+# Time stamps are left out, since they change with every snapshot.
+__deltaColumns = (1, 2, 3, 4, 5, 9, 10, 11, 12, 13)
+
+def __diffMasarData(basedata, datas):
+    """
+    Return the entries of datas which differ from basedata.
+    Return None when both do not cover the same pvs, in which case a full snapshot is needed.
+    """
+    base = {}
+    for row in basedata:
+        base[row[0]] = row
+    if len(base) != len(datas):
+        return None
+    delta = []
+    for data in datas:
+        if data[0] not in base:
+            return None
+        previous = base[data[0]]
+        for i in __deltaColumns:
+            new, old = data[i], previous[i]
+            if i == 13:
+                new, old = list(new or []), list(old or [])
+            if new != old:
+                delta.append(data)
+                break
+    return delta
+
+def __overlay(basedata, delta):
+    """
+    Reconstruct a snapshot saved in delta mode.
+    Entries of delta replace the entries with the same pv name in basedata, order of basedata is kept.
+    """
+    changed = {}
+    for row in delta:
+        changed[row[0]] = row
+    return [changed.get(row[0], row) for row in basedata]
+
+def __deltaBases(conn, eventids):
+    """Return a dictionary of event id to keyframe event id for events saved in delta mode."""
+    bases = {}
+    cur = conn.cursor()
+    for chunk in __chunks(list(eventids)):
+        sql = 'select service_event_id, base_event_id from service_event_delta where service_event_id in (%s)' \
+              % ','.join(['?'] * len(chunk))
+        cur.execute(sql, chunk)
+        bases.update(cur.fetchall())
+    return bases
+
+# SQLite allows at most 999 parameters per statement by default
+__maxParameters = 500
+
+def __chunks(values):
+    """Split a list of query parameters into chunks which fit into one statement."""
+    for i in range(0, len(values), __maxParameters):
+        yield values[i:i + __maxParameters]
+
+# array.array type codes of the native element type of each dbr type,
+# followed by wider ones for values which do not fit.
+__arrayTypes = {1: 'hil',   # DBR_SHORT, int16
+                2: 'f',     # DBR_FLOAT, float32
+                4: 'bhil',  # DBR_CHAR, int8
+                5: 'il',    # DBR_LONG, int32
+                6: 'd'}     # DBR_DOUBLE, float64
+
+def packArray(dbrtype, values):
+    """
+    Encode an array value for the array_value column.
+    Numeric arrays are packed with their native element width, little endian,
+    behind a zero byte and the array.array type code.
+    Anything else is pickled, as all array values were before.
+
+    >>> unpackArray(packArray(4, [1, -2, 3]))
+    array('b', [1, -2, 3])
+    >>> len(packArray(4, [1] * 1000))
+    1002
+    >>> unpackArray(packArray(4, [1, 200]))
+    array('h', [1, 200])
+    >>> unpackArray(packArray(0, ['a', 'b'])) == ['a', 'b']
+    True
+    """
+    for typecode in __arrayTypes.get(dbrtype, ''):
+        try:
+            packed = array.array(str(typecode), values)
+        except (OverflowError, TypeError, ValueError):
+            continue
+        if sys.byteorder == 'big':
+            packed.byteswap()
+        return b'\0' + typecode.encode('ascii') + packed.tostring()
+    return pickle.dumps(values, protocol=2)
+
+def unpackArray(blob):
+    """
+    Decode a value of the array_value column,
+    an array.array for a packed numeric array, otherwise the pickled list.
+    """
+    blob = bytes(blob)
+    # a pickle never starts with a zero byte
+    if blob[:1] == b'\0':
+        result = array.array(str(blob[1:2].decode('ascii')))
+        result.fromstring(blob[2:])
+        if sys.byteorder == 'big':
+            result.byteswap()
+        return result
+    return pickle.loads(blob)
 
 def __saveMasarData(conn, eventid, datas):
     """
@@ -93,10 +256,10 @@ def __saveMasarData(conn, eventid, datas):
             cur.execute(sql, (None, eventid, data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7], data[8], data[9], data[10], data[11], data[12]))
             data_id = cur.lastrowid
             if data[12]:
-                    # Here we force pickle to use the efficient binary protocol
-                    # (protocol=2). This means you absolutely must use an SQLite BLOB field
+                    # Numeric arrays keep their native element width, see packArray().
+                    # This means you absolutely must use an SQLite BLOB field
                     # and make sure you use sqlite3.Binary() to bind a BLOB parameter.
-                cur.execute("update masar_data set array_value = ? where masar_data_id = ?", (sqlite3.Binary(pickle.dumps(data[13], protocol=2)), data_id,))
+                cur.execute("update masar_data set array_value = ? where masar_data_id = ?", (sqlite3.Binary(packArray(data[4], data[13])), data_id,))
             masarid.append(data_id)
     except:
         raise 
@@ -180,7 +343,7 @@ def retrieveSnapshot(conn, eventid=None,start=None, end=None, comment=None,appro
     >>> for data in datas[1][1:]:
     ...    print (data)
     (u'SR:C01-BI:G02A<BPM:L1>Pos-X', u'12.2', 12.2, 12, 6, 1, 435686768234L, 3452345098734L, 0, 0, 0, u'', 0, [])
-    (u'SR:C01-BI:G02A<BPM:L2>Pos-X', u'12.2', 12.2, 12, 6, 1, 435686768234L, 3452345098734L, 0, 0, 0, u'', 1, [1.2, 2.3, 3.4, 4.5])
+    (u'SR:C01-BI:G02A<BPM:L2>Pos-X', u'12.2', 12.2, 12, 6, 1, 435686768234L, 3452345098734L, 0, 0, 0, u'', 1, array('d', [1.2, 2.3, 3.4, 4.5]))
     (u'SR:C01-BI:G04A<BPM:M1>Pos-X', u'12.2', 12.2, 12, 6, 1, 435686768234L, 3452345098734L, 0, 0, 0, u'', 0, [])
     (u'SR:C01-BI:G04B<BPM:M1>Pos-X', u'12.2', 12.2, 12, 6, 1, 435686768234L, 3452345098734L, 0, 0, 0, u'', 0, [])
     (u'SR:C01-BI:G06B<BPM:H1>Pos-X', u'12.2', 12.2, 12, 6, 1, 435686768234L, 3452345098734L, 0, 0, 0, u'', 0, [])
@@ -192,7 +355,7 @@ def retrieveSnapshot(conn, eventid=None,start=None, end=None, comment=None,appro
     ...        print (data)
     a service event , orbit C01 , masar1
     (u'SR:C01-BI:G02A<BPM:L1>Pos-X', u'12.2', 12.2, 12, 6, 1, 435686768234L, 3452345098734L, 0, 0, 0, u'', 0, [])
-    (u'SR:C01-BI:G02A<BPM:L2>Pos-X', u'12.2', 12.2, 12, 6, 1, 435686768234L, 3452345098734L, 0, 0, 0, u'', 1, [1.2, 2.3, 3.4, 4.5])
+    (u'SR:C01-BI:G02A<BPM:L2>Pos-X', u'12.2', 12.2, 12, 6, 1, 435686768234L, 3452345098734L, 0, 0, 0, u'', 1, array('d', [1.2, 2.3, 3.4, 4.5]))
     (u'SR:C01-BI:G04A<BPM:M1>Pos-X', u'12.2', 12.2, 12, 6, 1, 435686768234L, 3452345098734L, 0, 0, 0, u'', 0, [])
     (u'SR:C01-BI:G04B<BPM:M1>Pos-X', u'12.2', 12.2, 12, 6, 1, 435686768234L, 3452345098734L, 0, 0, 0, u'', 0, [])
     (u'SR:C01-BI:G06B<BPM:H1>Pos-X', u'12.2', 12.2, 12, 6, 1, 435686768234L, 3452345098734L, 0, 0, 0, u'', 0, [])
@@ -202,7 +365,7 @@ def retrieveSnapshot(conn, eventid=None,start=None, end=None, comment=None,appro
     (u'SR:C01-BI:G02A<BPM:L2>Pos-X', u'12.2', 12.2, 12, 6, 1, 564562342566L, 3452345098734L, 0, 0, 0, u'', 0, [])
     (u'SR:C01-BI:G04A<BPM:M1>Pos-X', u'12.2', 12.2, 12, 6, 1, 564562342566L, 3452345098734L, 0, 0, 0, u'', 0, [])
     (u'SR:C01-BI:G04B<BPM:M1>Pos-X', u'12.2', 12.2, 12, 6, 1, 564562342566L, 3452345098734L, 0, 0, 0, u'', 0, [])
-    (u'SR:C01-BI:G06B<BPM:H1>Pos-X', u'12.2', 12.2, 12, 6, 1, 564562342566L, 3452345098734L, 0, 0, 0, u'', 1, [1.2, 2.3, 3.4, 4.5])
+    (u'SR:C01-BI:G06B<BPM:H1>Pos-X', u'12.2', 12.2, 12, 6, 1, 564562342566L, 3452345098734L, 0, 0, 0, u'', 1, array('d', [1.2, 2.3, 3.4, 4.5]))
     (u'SR:C01-BI:G06B<BPM:H2>Pos-X', u'12.2', 12.2, 12, 6, 1, 564562342566L, 3452345098734L, 0, 0, 0, u'', 0, [])
     >>> datasets = retrieveSnapshot(conn, start=end2)
     >>> print (datasets[0][0])
@@ -236,12 +399,21 @@ def retrieveSnapshot(conn, eventid=None,start=None, end=None, comment=None,appro
             result =cur.fetchall()
             data = result[:] + data[:]
             dataset.append(data)
+            base = __deltaBases(conn, [eventid]).get(int(eventid))
+            if base is not None:
+                # saved in delta mode, the keyframe comes as an extra data set
+                # and the caller overlays the delta on it.
+                cur.execute(sql, (base,))
+                dataset.append(cur.fetchall() + __retrieveMasarData(conn, base))
         else:
             results = retrieveServiceEvents(conn, start=start, end=end, comment=comment, approval=approval)
     #        print ("event retults = ", results)
             sql += ' and service_config_id = ?  and service_event_approval = 1 '
+            bases = __deltaBases(conn, [result[0] for result in results[1:]])
             for result in results[1:]:
                 data= __retrieveMasarData(conn, result[0])
+                if result[0] in bases:
+                    data = __overlay(__retrieveMasarData(conn, bases[result[0]]), data)
     #            data = datahead + data[:]
         
                 cur = conn.cursor()
@@ -254,6 +426,241 @@ def retrieveSnapshot(conn, eventid=None,start=None, end=None, comment=None,appro
         raise
     return dataset
 
+def retrieveSnapshots(conn, eventids=None, start=None, end=None, comment=None, approval=True):
+    """
+    retrieve masar data of several events with one query.
+    Events are selected either by a list of event ids, or by time frame and comment
+    as retrieveServiceEvents() does.
+    It returns data as a list of 2 lists like below, the first row of each being a description:
+    [[('event id', 'user tag', 'event UTC time', 'service config name', 'service name'),
+      (event header for each event)],
+     [('event id', 'pv name', 'string value', 'double value', 'long value', 'dbr type', 'isConnected',
+       'secondsPastEpoch', 'nanoSeconds', 'timeStampTag', 'alarmSeverity', 'alarmStatus', 'alarmMessage',
+       'is_array', 'array_value'),
+      (data row for each pv of each event, ordered by event)]]
+
+    >>> import sqlite3
+    >>> from pymasarsqlite.service.service import (saveService)
+    >>> from pymasarsqlite.service.serviceconfig import (saveServiceConfig)
+    >>> from pymasarsqlite.db.masarsqlite import (SQL)
+    >>> conn = sqlite3.connect(":memory:")
+    >>> cur = conn.cursor()
+    >>> result = cur.executescript(SQL)
+    >>> saveService(conn, 'masar1', desc='non-empty description')
+    1
+    >>> saveServiceConfig(conn, 'masar1', 'orbit C01', 'BPM horizontal readout for storage ring')
+    1
+    >>> data = [('SR:C01-BI:G02A<BPM:L1>Pos-X','12.2', 12.2, 12, 6, 1, 4356, 3452, 0, 0, 0, "", 0, []),
+    ...        ('SR:C01-BI:G02A<BPM:L2>Pos-X', '12.2', 12.2, 12, 6, 1, 4356, 3452, 0, 0, 0, "", 1, [1.2,2.3])]
+    >>> saveSnapshot(conn, data, servicename='masar1', configname='orbit C01', comment='first')
+    (1, [1, 2])
+    >>> saveSnapshot(conn, data, servicename='masar1', configname='orbit C01', comment='second')
+    (2, [3, 4])
+    >>> events, datas = retrieveSnapshots(conn, eventids=[2, 1])
+    >>> for event in events[1:]:
+    ...    print (event[0], event[1], event[3], event[4])
+    1 first orbit C01 masar1
+    2 second orbit C01 masar1
+    >>> for data in datas[1:]:
+    ...    print (data[0], data[1], data[2], data[13], data[14])
+    1 SR:C01-BI:G02A<BPM:L1>Pos-X 12.2 0 []
+    1 SR:C01-BI:G02A<BPM:L2>Pos-X 12.2 1 array('d', [1.2, 2.3])
+    2 SR:C01-BI:G02A<BPM:L1>Pos-X 12.2 0 []
+    2 SR:C01-BI:G02A<BPM:L2>Pos-X 12.2 1 array('d', [1.2, 2.3])
+    >>> data = [('SR:C01-BI:G02A<BPM:L1>Pos-X','13.1', 13.1, 13, 6, 1, 4357, 3452, 0, 0, 0, "", 0, []),
+    ...        ('SR:C01-BI:G02A<BPM:L2>Pos-X', '12.2', 12.2, 12, 6, 1, 4357, 3452, 0, 0, 0, "", 1, [1.2,2.3])]
+    >>> saveSnapshot(conn, data, servicename='masar1', configname='orbit C01', comment='third', keyframe=5)
+    (3, [5])
+    >>> events, datas = retrieveSnapshots(conn, eventids=[3])
+    >>> for data in datas[1:]:
+    ...    print (data[0], data[1], data[2], data[13], data[14])
+    3 SR:C01-BI:G02A<BPM:L1>Pos-X 13.1 0 []
+    3 SR:C01-BI:G02A<BPM:L2>Pos-X 12.2 1 array('d', [1.2, 2.3])
+    >>> events, datas = retrieveSnapshots(conn, eventids=range(1, 2000))
+    >>> print (len(events) - 1, len(datas) - 1)
+    3 6
+    >>> conn.close()
+    """
+    checkConnection(conn)
+    eventhead = [('event id', 'user tag', 'event UTC time', 'service config name', 'service name')]
+    datahead = [('event id', 'pv name', 'string value', 'double value', 'long value', 'dbr type', 'isConnected',
+                 'secondsPastEpoch', 'nanoSeconds', 'timeStampTag', 'alarmSeverity', 'alarmStatus', 'alarmMessage',
+                 'is_array', 'array_value')]
+
+    if eventids is None:
+        results = retrieveServiceEvents(conn, start=start, end=end, comment=comment, approval=approval)
+        eventids = [result[0] for result in results[1:]]
+    eventids = [int(eid) for eid in eventids]
+    if len(eventids) == 0:
+        return [eventhead, datahead]
+
+    # one statement per chunk of events, one bound parameter per event id,
+    # since SQLite limits the number of parameters of a statement
+    sql = '''
+    select service_event_id, service_event_user_tag, service_event_UTC_time, service_config_name, service_name
+    from service_event
+    left join service_config using (service_config_id)
+    left join service using (service_id)
+    where service_event_id in (%s)
+    order by service_event_id
+    '''
+    datasql = '''
+    select service_event_id, pv_name, s_value, d_value, l_value, dbr_type, isConnected,
+    ioc_timestamp, ioc_timestamp_nano, timestamp_tag, severity, status, alarmMessage,
+    is_array, array_value
+    from masar_data where service_event_id in (%s)
+    order by service_event_id, masar_data_id
+    '''
+    try:
+        cur = conn.cursor()
+        events, data = [], []
+        for chunk in __chunks(sorted(set(eventids))):
+            marks = ','.join(['?'] * len(chunk))
+            cur.execute(sql % marks, chunk)
+            events += cur.fetchall()
+            cur.execute(datasql % marks, chunk)
+            data += cur.fetchall()
+        for i in range(len(data)):
+            res = data[i]
+            if res[14] != None:
+                result = unpackArray(res[14])
+            else:
+                result = []
+            data[i] = res[:14] + (result[:],)
+        bases = __deltaBases(conn, eventids)
+        if bases:
+            data = __overlaySnapshots(conn, [event[0] for event in events], data, bases)
+    except:
+        raise
+    return [eventhead + events, datahead + data]
+
+def __overlaySnapshots(conn, eventids, data, bases):
+    """
+    Reconstruct events saved in delta mode from data rows led by their event id,
+    as retrieveSnapshots() returns them. Each keyframe is read once.
+    """
+    rows = {}
+    for row in data:
+        rows.setdefault(row[0], []).append(row)
+    keyframes = {}
+    merged = []
+    for eid in eventids:
+        if eid not in bases:
+            merged += rows.get(eid, [])
+            continue
+        base = bases[eid]
+        if base not in keyframes:
+            keyframes[base] = __retrieveMasarData(conn, base)
+        delta = [row[1:] for row in rows.get(eid, [])]
+        merged += [(eid,) + row for row in __overlay(keyframes[base], delta)]
+    return merged
+
+def retrieveChannelHistory(conn, pvnames, start=None, end=None, approval=True):
+    """
+    retrieve the saved values of given pvs across all snapshots within a time frame.
+    Rows are located through the (pv_name, service_event_id) index of masar_data,
+    so the cost depends on the history length of wanted pvs instead of the snapshot size.
+    Events saved in delta mode report the value of their keyframe for pvs which did not change,
+    so every event has a row for each of its pvs.
+    If neither start nor end is given, the whole history is returned.
+    Both start time and end time should be in UTC time format.
+    It returns data as a tuple array like below, the first row being a description:
+    [('pv name', 'event id', 'event UTC time', 'double value', 'string value',
+      'alarmSeverity', 'alarmStatus', 'dbr type', 'is_array'),
+     (history row for each pv of each event, ordered by pv name and event)]
+
+    >>> import sqlite3
+    >>> from pymasarsqlite.service.service import (saveService)
+    >>> from pymasarsqlite.service.serviceconfig import (saveServiceConfig)
+    >>> from pymasarsqlite.db.masarsqlite import (SQL)
+    >>> conn = sqlite3.connect(":memory:")
+    >>> cur = conn.cursor()
+    >>> result = cur.executescript(SQL)
+    >>> saveService(conn, 'masar1', desc='non-empty description')
+    1
+    >>> saveServiceConfig(conn, 'masar1', 'orbit C01', 'BPM horizontal readout for storage ring')
+    1
+    >>> data = [('SR:C01-BI:G02A<BPM:L1>Pos-X','12.2', 12.2, 12, 6, 1, 4356, 3452, 0, 0, 0, "", 0, []),
+    ...        ('SR:C01-BI:G02A<BPM:L2>Pos-X', '12.2', 12.2, 12, 6, 1, 4356, 3452, 0, 0, 0, "", 1, [1.2,2.3])]
+    >>> saveSnapshot(conn, data, servicename='masar1', configname='orbit C01', comment='first', approval=True)
+    (1, [1, 2])
+    >>> data = [('SR:C01-BI:G02A<BPM:L1>Pos-X','13.5', 13.5, 13, 6, 1, 4357, 3452, 0, 1, 3, "", 0, [])]
+    >>> saveSnapshot(conn, data, servicename='masar1', configname='orbit C01', comment='second', approval=True)
+    (2, [3])
+    >>> results = retrieveChannelHistory(conn, ['SR:C01-BI:G02A<BPM:L1>Pos-X'])
+    >>> for result in results[1:]:
+    ...    print (result[0], result[1], result[3], result[4], result[5], result[6])
+    SR:C01-BI:G02A<BPM:L1>Pos-X 1 12.2 12.2 0 0
+    SR:C01-BI:G02A<BPM:L1>Pos-X 2 13.5 13.5 1 3
+    >>> for value in (1.0, 2.0, 1.0, 3.0):
+    ...    data = [('A', str(value), value, 0, 6, 1, 4358, 0, 0, 0, 0, "", 0, []),
+    ...            ('B', '5.0', 5.0, 0, 6, 1, 4358, 0, 0, 0, 0, "", 0, [])]
+    ...    print (saveSnapshot(conn, data, servicename='masar1', configname='orbit C01', approval=True, keyframe=10))
+    (3, [4, 5])
+    (4, [6])
+    (5, [])
+    (6, [7])
+    >>> results = retrieveChannelHistory(conn, ['A', 'B'])
+    >>> for result in results[1:]:
+    ...    print (result[0], result[1], result[3])
+    A 3 1.0
+    A 4 2.0
+    A 5 1.0
+    A 6 3.0
+    B 3 5.0
+    B 4 5.0
+    B 5 5.0
+    B 6 5.0
+    >>> conn.close()
+    """
+    checkConnection(conn)
+    head = [('pv name', 'event id', 'event UTC time', 'double value', 'string value',
+             'alarmSeverity', 'alarmStatus', 'dbr type', 'is_array')]
+    if not pvnames:
+        return head
+
+    marks = ','.join(['?'] * len(pvnames))
+    where = ''
+    args = []
+    if approval:
+        where += ' and service_event_approval = 1 '
+    if start is not None or end is not None:
+        where += ' and service_event_UTC_time > ? and service_event_UTC_time < ? '
+        if end is None:
+            end = dt.datetime.utcnow()
+        if start is None:
+            start = end - dt.timedelta(weeks=1)
+        if start > end:
+            raise Exception('Time range error')
+        args += [start, end]
+    # rows saved with each event, and for events saved in delta mode,
+    # the keyframe rows of pvs which did not change.
+    sql = '''
+    select pv_name, masar_data.service_event_id, service_event_UTC_time, d_value, s_value,
+    severity, status, dbr_type, is_array
+    from masar_data indexed by masar_data_idx_pv_name
+    join service_event using (service_event_id)
+    where pv_name in (%s) %s
+    union all
+    select pv_name, service_event.service_event_id, service_event_UTC_time, d_value, s_value,
+    severity, status, dbr_type, is_array
+    from service_event_delta
+    join service_event on service_event.service_event_id = service_event_delta.service_event_id
+    join masar_data indexed by masar_data_idx_pv_name on masar_data.service_event_id = base_event_id
+    where pv_name in (%s) %s
+    and not exists (select 1 from masar_data as changed
+                    where changed.pv_name = masar_data.pv_name
+                    and changed.service_event_id = service_event_delta.service_event_id)
+    order by 1, 2
+    ''' % (marks, where, marks, where)
+    try:
+        cur = conn.cursor()
+        cur.execute(sql, list(pvnames) + args + list(pvnames) + args)
+        results = cur.fetchall()
+    except:
+        raise
+    return head + results
+
 def __retrieveMasarData(conn, eventid):
     checkConnection(conn)
     sql = '''
@@ -270,7 +677,7 @@ def __retrieveMasarData(conn, eventid):
         for i in range(len(data)):
             res = data[i]
             if res[13] != None:
-                result = pickle.loads(str(res[13]))
+                result = unpackArray(res[13])
             else:
                 result = []
             data[i]=data[i][:13]+ (result[:],)
@@ -0,0 +1,290 @@
+'''
+Asynchronous commit of snapshot data through a write-ahead staging file.
+'''
+from __future__ import division
+from __future__ import print_function
+from __future__ import unicode_literals
+
+import os
+import json
+import time
+import threading
+import Queue
+
+from pymasarsqlite.masardata.masardata import (saveSnapshotData)
+
+
+class StagedWriter(object):
+    """
+    Persist snapshot data in the background.
+    stage() appends the data of an event to the staging file and syncs it to disk,
+    a writer thread then saves it into the database, one event at a time in event id order.
+    Until then the data is served by retrieve().
+    A save which fails is tried again after a pause, later events wait so that they are saved in order.
+    flush() waits for the saves at most a given time, error tells why the last save failed.
+    Events staged but not saved when the process stopped are saved again by the next StagedWriter
+    on the same file, events whose data reached the database already are skipped.
+    The staging file is emptied whenever all staged events are saved.
+
+    >>> import tempfile, sqlite3
+    >>> from pymasarsqlite.service.service import (saveService)
+    >>> from pymasarsqlite.service.serviceconfig import (saveServiceConfig)
+    >>> from pymasarsqlite.service.serviceevent import (saveServiceEvent)
+    >>> from pymasarsqlite.masardata.masardata import (retrieveSnapshot)
+    >>> from pymasarsqlite.db.masarsqlite import (SQL)
+    >>> tmp = tempfile.mkdtemp()
+    >>> dbname, stagename = os.path.join(tmp, 'masar.db'), os.path.join(tmp, 'masar.staging')
+    >>> connect = lambda: sqlite3.connect(dbname)
+    >>> conn = connect()
+    >>> result = conn.executescript(SQL)
+    >>> saveService(conn, 'masar1', desc='non-empty description')
+    1
+    >>> saveServiceConfig(conn, 'masar1', 'orbit C01', 'BPM horizontal readout for storage ring')
+    1
+    >>> eid = saveServiceEvent(conn, 'masar1', 'orbit C01', comment='staged')
+    >>> conn.commit()
+    >>> data = [('SR:C01-BI:G02A<BPM:L1>Pos-X','12.2', 12.2, 12, 6, 1, 4356, 3452, 0, 0, 0, "", 0, []),
+    ...         ('SR:C01-BI:G02A<BPM:L2>Pos-X', '', None, None, 6, 1, 4356, 3452, 0, 0, 0, "", 1, [1.2,2.3])]
+
+    Stage without a writer thread, as if the process stopped before saving:
+
+    >>> writer = StagedWriter(stagename, connect, start=False)
+    >>> writer.stage(eid, data)
+    >>> writer.retrieve(eid)[1]
+    (u'SR:C01-BI:G02A<BPM:L2>Pos-X', u'', None, None, 6, 1, 4356, 3452, 0, 0, 0, u'', 1, [1.2, 2.3])
+    >>> len(retrieveSnapshot(conn, eventid=eid)[1])
+    1
+    >>> conn.close()
+
+    A new writer replays the staging file:
+
+    >>> writer = StagedWriter(stagename, connect)
+    >>> writer.flush()
+    True
+    >>> conn = connect()
+    >>> writer.retrieve(eid) is None
+    True
+    >>> for row in retrieveSnapshot(conn, eventid=eid)[1][1:]:
+    ...     print (row[0], row[13])
+    SR:C01-BI:G02A<BPM:L1>Pos-X []
+    SR:C01-BI:G02A<BPM:L2>Pos-X array('d', [1.2, 2.3])
+    >>> os.path.getsize(stagename)
+    0
+    >>> writer.close()
+
+    An event saved in delta mode without changed pvs has no rows, it is not saved twice on replay:
+
+    >>> eid = saveServiceEvent(conn, 'masar1', 'orbit C01', comment='unchanged')
+    >>> conn.commit()
+    >>> writer = StagedWriter(stagename, connect, keyframe=5)
+    >>> writer.stage(eid, data)
+    >>> writer.close()
+    >>> with open(stagename, 'ab') as f:
+    ...     f.write(json.dumps({'eventid': eid, 'data': data}) + '\\n')
+    >>> writer = StagedWriter(stagename, connect, keyframe=5)
+    >>> writer.close()
+    >>> dataset = retrieveSnapshot(conn, eventid=eid)
+    >>> len(dataset[1]), len(dataset[2])
+    (1, 3)
+    >>> os.path.getsize(stagename)
+    0
+
+    A failed save is tried again:
+
+    >>> eid = saveServiceEvent(conn, 'masar1', 'orbit C01', comment='retried')
+    >>> conn.commit()
+    >>> failures = []
+    >>> def flaky():
+    ...     if not failures:
+    ...         failures.append(1)
+    ...         raise sqlite3.OperationalError('database is locked')
+    ...     return connect()
+    >>> messages = []
+    >>> writer = StagedWriter(stagename, flaky, retry=0.01, log=messages.append)
+    >>> writer.stage(eid, data)
+    >>> writer.flush(10.0)
+    True
+    >>> for message in messages:
+    ...     print (message)
+    Failed to save staged event 3: database is locked
+    >>> writer.retrieve(eid) is None
+    True
+    >>> writer.close()
+
+    A save which keeps failing does not block flush() for longer than its timeout:
+
+    >>> eid = saveServiceEvent(conn, 'masar1', 'orbit C01', comment='broken')
+    >>> conn.commit()
+    >>> def broken():
+    ...     raise sqlite3.OperationalError('disk I/O error')
+    >>> writer = StagedWriter(stagename, broken, retry=0.01, log=messages.append)
+    >>> writer.stage(eid, data)
+    >>> writer.flush(0.5)
+    False
+    >>> print (writer.error)
+    Failed to save staged event 4: disk I/O error
+    >>> writer.retrieve(eid) is None
+    False
+    >>> writer.close()
+    >>> conn.close()
+    """
+    def __init__(self, fname, connect, keyframe=0, start=True, retry=5.0, log=None):
+        """
+        fname: staging file, created if it does not exist
+        connect: function returning a new connection to the database
+        keyframe: keyframe interval passed to saveSnapshotData()
+        retry: seconds to wait before a failed save is tried again
+        log: function called with the message of each failed save, printed by default
+        """
+        self.fname = fname
+        self.connect = connect
+        self.keyframe = keyframe
+        self.retry = retry
+        self.log = log
+        self.closing = threading.Event()
+        self.lock = threading.Lock()
+        # notified whenever a staged event is saved
+        self.saved = threading.Condition(self.lock)
+        # message of the last failed save, None once a save succeeds
+        self.error = None
+        self.pending = {}
+        self.queue = Queue.Queue()
+        self.thread = None
+
+        staged = []
+        if os.path.exists(fname):
+            done = set()
+            good = 0
+            with open(fname, 'rb') as f:
+                for line in f:
+                    try:
+                        record = json.loads(line)
+                    except ValueError:
+                        # torn last line, it was never acknowledged
+                        break
+                    good += len(line)
+                    if 'done' in record:
+                        done.add(record['done'])
+                    else:
+                        staged.append(record)
+            if good < os.path.getsize(fname):
+                with open(fname, 'r+b') as f:
+                    f.truncate(good)
+            staged = [record for record in staged if record['eventid'] not in done]
+        self.f = open(fname, 'ab')
+        for record in sorted(staged, key=lambda record: record['eventid']):
+            self.pending[record['eventid']] = [tuple(row) for row in record['data']]
+            self.queue.put(record['eventid'])
+        if start:
+            self.thread = threading.Thread(target=self._run, name='masar staged writer')
+            self.thread.daemon = True
+            self.thread.start()
+
+    def _append(self, record):
+        """append one record and make it durable, called with lock held"""
+        end = self.f.tell()
+        try:
+            self.f.write(json.dumps(record) + '\n')
+            self.f.flush()
+            os.fsync(self.f.fileno())
+        except:
+            # a partial line would hide the records appended after it on replay
+            self.f.truncate(end)
+            raise
+
+    def stage(self, eventid, data):
+        """stage the data of an event, return once it is on disk"""
+        eventid = int(eventid)
+        data = [tuple(row) for row in data]
+        with self.lock:
+            self._append({'eventid': eventid, 'data': data})
+            self.pending[eventid] = data
+        self.queue.put(eventid)
+
+    def retrieve(self, eventid):
+        """return the data of an event which is not saved yet, otherwise None"""
+        with self.lock:
+            return self.pending.get(int(eventid))
+
+    def flush(self, timeout=None):
+        """
+        wait until every staged event is saved, at most timeout seconds if given.
+        return False if some are not saved yet, then error tells why.
+        """
+        deadline = None if timeout is None else time.time() + timeout
+        with self.lock:
+            while self.pending and self.thread is not None:
+                if deadline is None:
+                    # wakes up now and then, so that KeyboardInterrupt is seen
+                    self.saved.wait(1.0)
+                    continue
+                remaining = deadline - time.time()
+                if remaining <= 0:
+                    break
+                self.saved.wait(remaining)
+            return not self.pending
+
+    def close(self):
+        """save the staged events, unless saving fails, in which case they are left for the next writer"""
+        if self.thread is not None:
+            self.closing.set()
+            self.queue.put(None)
+            self.thread.join()
+            self.thread = None
+        with self.lock:
+            self.f.close()
+
+    def _run(self):
+        while True:
+            eventid = self.queue.get()
+            try:
+                if eventid is None:
+                    return
+                while not self._save(eventid):
+                    if self.closing.is_set():
+                        # left in the staging file, it is saved again on restart
+                        return
+                    self.closing.wait(self.retry)
+            finally:
+                self.queue.task_done()
+
+    def _save(self, eventid):
+        """save one staged event, return False if it failed"""
+        with self.lock:
+            data = self.pending.get(eventid)
+        try:
+            conn = self.connect()
+            try:
+                # the data and the delta record are committed together,
+                # so either of them tells the event was saved.
+                # An event saved in delta mode may have no data rows.
+                cur = conn.cursor()
+                cur.execute('''select exists (select 1 from masar_data where service_event_id = ?)
+                               or exists (select 1 from service_event_delta where service_event_id = ?)''',
+                            (eventid, eventid,))
+                if not cur.fetchone()[0]:
+                    saveSnapshotData(conn, eventid, data, keyframe=self.keyframe)
+                    conn.commit()
+            finally:
+                conn.close()
+        except Exception as e:
+            message = 'Failed to save staged event %s: %s' % (eventid, e)
+            with self.lock:
+                self.error = message
+            if self.log is None:
+                print (message)
+            else:
+                self.log(message)
+            return False
+        with self.lock:
+            self._append({'done': eventid})
+            del self.pending[eventid]
+            if not self.pending:
+                self.f.truncate(0)
+            self.error = None
+            self.saved.notify_all()
+        return True
+
+if __name__ == '__main__':
+    import doctest
+    doctest.testmod()
@@ -1,11 +1,11 @@
 from service import (retrieveServices, saveService)
 from serviceconfig import (saveServiceConfig, saveServicePvGroup, retrieveServiceConfigs, retrieveServicePvGroups,
-                           updateServiceConfigStatus, retrieveServiceConfigPVs)
-from serviceevent import (saveServiceEvent, retrieveServiceEvents)
+                           updateServiceConfigStatus, retrieveServiceConfigPVs, retrieveServiceConfigStamp)
+from serviceevent import (saveServiceEvent, retrieveServiceEvents, deleteServiceEvent)
 from serviceconfigprop import (saveServiceConfigProp, retrieveServiceConfigProps)
 
 __all__ = ['retrieveServices', 'saveService']
 __all__.extend(['saveServiceConfig', 'saveServicePvGroup', 'retrieveServiceConfigs', 'retrieveServicePvGroups',
-                'updateServiceConfigStatus', 'retrieveServiceConfigPVs'])
-__all__.extend(['saveServiceEvent', 'retrieveServiceEvents', 'updateServiceEvent'])
+                'updateServiceConfigStatus', 'retrieveServiceConfigPVs', 'retrieveServiceConfigStamp'])
+__all__.extend(['saveServiceEvent', 'retrieveServiceEvents', 'updateServiceEvent', 'deleteServiceEvent'])
 __all__.extend(['saveServiceConfigProp', 'retrieveServiceConfigProps'])
@@ -622,6 +622,71 @@ def retrieveServiceConfigPVs(conn, configname, servicename=None):
     return pvlist.values()
 
 
+def retrieveServiceConfigStamp(conn, configname, servicename=None):
+    """
+    Retrieve the version stamp of the pv list of a given service config.
+    Triggers raise the stamp to a new, database wide unique value whenever pv groups of the config,
+    or pvs of those groups, are added or removed. It is a cheap check whether a cached result of
+    retrieveServiceConfigPVs() is still valid.
+    Return None if the service config does not exist.
+    
+    >>> import sqlite3
+    >>> conn = sqlite3.connect(':memory:')
+    >>> from pymasarsqlite.service.service import (saveService)
+    >>> from pymasarsqlite.pvgroup.pvgroup import (savePvGroup)
+    >>> from pymasarsqlite.pvgroup.pv import (saveGroupPvs)
+    >>> from pymasarsqlite.db.masarsqlite import (SQL)
+    >>> cur = conn.cursor()
+    >>> result = cur.executescript(SQL)
+    >>> saveService(conn, 'masar', desc='masar service description')
+    1
+    >>> saveServiceConfig(conn, 'masar', 'masar1', configdesc='masar1 desc')
+    1
+    >>> saveServiceConfig(conn, 'masar', 'masar2', configdesc='masar2 desc')
+    2
+    >>> retrieveServiceConfigStamp(conn, 'masar1')
+    0
+    >>> savePvGroup(conn, 'pvg1', func='pv group 1')
+    [1]
+    >>> saveServicePvGroup(conn, 'masar1', ['pvg1'])
+    [1]
+    >>> stamp1 = retrieveServiceConfigStamp(conn, 'masar1', servicename='masar')
+    >>> stamp1 > 0
+    True
+    >>> saveGroupPvs(conn, 'pvg1', ['SR:C01-BI:G02A<BPM:L1>Pos-X'])
+    [1]
+    >>> retrieveServiceConfigStamp(conn, 'masar1') > stamp1
+    True
+    >>> retrieveServiceConfigStamp(conn, 'masar2')
+    0
+    >>> print (retrieveServiceConfigStamp(conn, 'masar3'))
+    None
+    >>> conn.close()
+    """
+    if configname is None:
+        raise Exception('service config name is not specified')
+
+    checkConnection(conn)
+    sql = 'select service_config_stamp from service_config where service_config_name = ? '
+    try:
+        cur = conn.cursor()
+        if servicename is None:
+            cur.execute(sql, (configname, ))
+        else:
+            services = retrieveServices(conn, servicename)
+            if len(services) == 0:
+                raise Exception('Given service (%s) does not exist.' %servicename)
+            sql = sql + ' and service_id = ?'
+            cur.execute(sql, (configname, services[0][0]))
+        result = cur.fetchone()
+    except sqlite3.Error, e:
+        print ("Error %s" %e.args[0])
+        raise
+    if result is None:
+        return None
+    return result[0]
+
+
 ### pvmeta  ##############################################################
 #def retrieveGroupPvs(conn,pvGroup):
 #    SQLgetPvsForPvGroup = '''
@@ -135,12 +135,56 @@ def updateServiceEvent(conn, eventid, comment=None, approval=False, username=Non
         raise
     return True
 
-def retrieveServiceEvents(conn, configid=None, eventid=None, start=None, end=None, comment=None, user=None, approval=True):
+def deleteServiceEvent(conn, eventid):
+    """
+    delete an event which has no data, for example when saving its data could not be started.
+    Return True if the event was deleted.
+
+    >>> import sqlite3
+    >>> from pymasarsqlite.service.service import (saveService)
+    >>> from pymasarsqlite.service.serviceconfig import (saveServiceConfig)
+    >>> from pymasarsqlite.db.masarsqlite import (SQL)
+    >>> conn = sqlite3.connect(":memory:")
+    >>> cur = conn.cursor()
+    >>> result = cur.executescript(SQL)
+    >>> saveService(conn, 'masar1', desc='non-empty description')
+    1
+    >>> saveServiceConfig(conn, 'masar1', 'orbit C01', 'BPM horizontal readout for storage ring')
+    1
+    >>> saveServiceEvent(conn, servicename='masar1', configname='orbit C01', comment='a service event')
+    1
+    >>> deleteServiceEvent(conn, 1)
+    True
+    >>> deleteServiceEvent(conn, 1)
+    False
+    >>> conn.close()
+    """
+    checkConnection(conn)
+
+    sql = '''
+    DELETE FROM service_event
+    WHERE service_event_id = ?
+    AND service_event_id NOT IN (SELECT service_event_id FROM masar_data WHERE service_event_id = ?)
+    AND service_event_id NOT IN (SELECT service_event_id FROM service_event_delta WHERE service_event_id = ?)
+    '''
+    try:
+        cur = conn.cursor()
+        cur.execute(sql, (eventid, eventid, eventid,))
+    except sqlite3.Error, e:
+        print ('Error %s' %e.args[0])
+        raise
+    return cur.rowcount > 0
+
+def retrieveServiceEvents(conn, configid=None, eventid=None, start=None, end=None, comment=None, user=None, approval=True,
+                          limit=None, offset=None, before=None, order=None):
     """
     retrieve an service event with given user tag within given time frame.
     If event id is given, get service event header information for that given event.
     Both start and end time should be in UTC time format.
     If end time is not specified, use current time. If start is not specified, use one week before end time.
+    A page of events is selected with limit and offset, or with before, which keeps events older than
+    the given event id only. order is 'asc' or 'desc' by event time, so that order='desc', limit=n
+    gets the newest n events, and the last event id of a page is the before cursor of the next one.
     It return a tuple array with format like:
     [(service_event_id, service_config_id, service_event_user_tag, service_event_UTC_time, service_event_user_name)]
     
@@ -190,6 +234,19 @@ def retrieveServiceEvents(conn, configid=None, eventid=None, start=None, end=Non
     >>> for result in results[1:]:
     ...    print (result[0], result[1], result[2])
     2 1 a service event2
+    >>> results = retrieveServiceEvents(conn, configid=1, order='desc', limit=2)
+    >>> for result in results[1:]:
+    ...    print (result[0], result[1], result[2])
+    3 1 a service event3
+    2 1 a service event2
+    >>> results = retrieveServiceEvents(conn, configid=1, order='desc', limit=2, before=results[-1][0])
+    >>> for result in results[1:]:
+    ...    print (result[0], result[1], result[2])
+    1 1 a service event1
+    >>> results = retrieveServiceEvents(conn, order='asc', limit=1, offset=1)
+    >>> for result in results[1:]:
+    ...    print (result[0], result[1], result[2])
+    2 1 a service event2
     >>> conn.close()
     """
     checkConnection(conn)
@@ -202,10 +259,11 @@ def retrieveServiceEvents(conn, configid=None, eventid=None, start=None, end=Non
         service_event_user_name
         from service_event where service_event_approval = 1 
         '''
+        args = []
 
         if eventid is not None:
             sql += ' and service_event_id = ?'
-            cur.execute(sql, (eventid,))
+            args.append(eventid)
 
         else:
             if comment != None:
@@ -216,13 +274,7 @@ def retrieveServiceEvents(conn, configid=None, eventid=None, start=None, end=Non
                 user = user.replace("*","%").replace("?","_")
                 sql += ' and service_event_user_name like "%s" ' %(user)
 
-            if (start is None) and (end is None):
-                if configid is None:
-                    cur.execute(sql, )
-                else:
-                    sql += ' and service_config_id = ?'
-                    cur.execute(sql, (configid, ))
-            else:
+            if (start is not None) or (end is not None):
                 sql += ' and service_event_UTC_time > ? and service_event_UTC_time < ? '
                 if end is None:
                     end = dt.datetime.utcnow()
@@ -231,12 +283,26 @@ def retrieveServiceEvents(conn, configid=None, eventid=None, start=None, end=Non
 
                 if start > end:
                     raise Exception('Time range error')
+                args += [start, end]
+
+            if configid is not None:
+                sql += ' and service_config_id = ? '
+                args.append(configid)
+
+            if before is not None:
+                sql += ' and service_event_id < ? '
+                args.append(before)
+
+            if order is not None:
+                if order not in ('asc', 'desc'):
+                    raise ValueError("order has to be 'asc' or 'desc'")
+                # event ids grow with time, and break ties of events saved within the same second
+                sql += ' order by service_event_UTC_time %s, service_event_id %s ' % (order, order)
 
-                if configid is None:
-                    cur.execute(sql, (start, end, ))
-                else:
-                    sql += ' and service_config_id = ? '
-                    cur.execute(sql, (start, end, configid, ))
+            if limit is not None or offset is not None:
+                sql += ' limit ? offset ? '
+                args += [-1 if limit is None else int(limit), 0 if offset is None else int(offset)]
+        cur.execute(sql, args)
         results = cur.fetchall()
     except:
         raise